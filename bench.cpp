@@ -0,0 +1,792 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "geometry.h"
+#include "matrix_math.h"
+#include "octree.h"
+
+using namespace Eigen;
+using namespace Geom;
+
+/* Benchmarks the octree on seeded synthetic datasets and prints the results as JSON.
+ * Usage: bench [numObjects] [seed] [maxDepth]
+ * On Linux, hardware counters are read around each workload when perf_event_open allows it
+ * (see /proc/sys/kernel/perf_event_paranoid); otherwise they are reported as null.
+ * Set GEOM_SIMD (scalar, sse, avx2 or avx512) to compare instruction sets.
+ */
+
+#define WORLD_SIZE 100.0f
+#define NUM_QUERIES 2000
+#define WALK_RUNS 3   // The walk is timed this many times and the best kept
+
+typedef std::chrono::steady_clock Clock;
+
+static bool boxInCellTest(void * object, Cell * cell) {
+   AABBf * box = (AABBf *) object;
+   return box->lowBound(0) <= cell->highBound(0) && box->highBound(0) >= cell->lowBound(0) &&
+          box->lowBound(1) <= cell->highBound(1) && box->highBound(1) >= cell->lowBound(1) &&
+          box->lowBound(2) <= cell->highBound(2) && box->highBound(2) >= cell->lowBound(2);
+}
+
+static bool boxBoxTest(void * objectOut, void * objectIn) {
+   AABBf * a = (AABBf *) objectOut;
+   AABBf * b = (AABBf *) objectIn;
+   return a->lowBound(0) <= b->highBound(0) && a->highBound(0) >= b->lowBound(0) &&
+          a->lowBound(1) <= b->highBound(1) && a->highBound(1) >= b->lowBound(1) &&
+          a->lowBound(2) <= b->highBound(2) && a->highBound(2) >= b->lowBound(2);
+}
+
+static void boxBounds(void * object, Vector3f& lowBound, Vector3f& highBound) {
+   AABBf * box = (AABBf *) object;
+   lowBound = box->lowBound;
+   highBound = box->highBound;
+}
+
+// The sphere-box test Geom used before it was exact. It passes spheres that are only near a
+// corner or an edge of the box, which puts them in cells they don't touch.
+static bool slabSphereInCellTest(void * object, Cell * cell) {
+   Spheref * sphere = (Spheref *) object;
+   return sphere->center(0) + sphere->radius >= cell->lowBound(0) && sphere->center(0) - sphere->radius <= cell->highBound(0) &&
+          sphere->center(1) + sphere->radius >= cell->lowBound(1) && sphere->center(1) - sphere->radius <= cell->highBound(1) &&
+          sphere->center(2) + sphere->radius >= cell->lowBound(2) && sphere->center(2) - sphere->radius <= cell->highBound(2);
+}
+
+static bool sphereInCellTest(void * object, Cell * cell) {
+   AABBf box(cell->lowBound, cell->highBound);
+   return DoesIntersect(*(Spheref *) object, box);
+}
+
+static unsigned int sphereOctantsTest(void * object, Cell * cell) {
+   AABBf box(cell->lowBound, cell->highBound);
+   return IntersectingOctants(*(Spheref *) object, box);
+}
+
+static double nanosSince(Clock::time_point start) {
+   return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+enum PerfEvent {
+   PERF_CYCLES,
+   PERF_INSTRUCTIONS,
+   PERF_L1D_MISSES,
+   PERF_LLC_MISSES,
+   PERF_BRANCH_MISSES,
+   NUM_PERF_EVENTS
+};
+
+static const char * perfEventNames[NUM_PERF_EVENTS] = {
+   "cycles", "instructions", "l1dMisses", "llcMisses", "branchMisses"
+};
+
+/* Counter totals of one workload. -1 means the counter isn't available. */
+class PerfSample {
+public:
+   PerfSample() {
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         values[e] = -1;
+      }
+   }
+
+   // Prints the counts per operation as a JSON object, or null if nothing was counted
+   void printJson(double numOps) {
+      bool any = false;
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         any |= values[e] >= 0;
+      }
+      if (!any || numOps <= 0) {
+         printf("null");
+         return;
+      }
+
+      printf("{");
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         if (values[e] >= 0)
+            printf("%s\"%s\": %.2f", e == 0 ? "" : ", ", perfEventNames[e], values[e] / numOps);
+         else
+            printf("%s\"%s\": null", e == 0 ? "" : ", ", perfEventNames[e]);
+      }
+      printf("}");
+   }
+
+   long long values[NUM_PERF_EVENTS];
+};
+
+/* Hardware counters of this thread, read with perf_event_open. Each counter is opened on
+ * its own, so a machine missing one (e.g. a VM without LLC events) still reports the rest. */
+class PerfCounters {
+public:
+   PerfCounters() {
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         fds[e] = -1;
+      }
+#ifdef __linux__
+      fds[PERF_CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+      fds[PERF_INSTRUCTIONS] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+      fds[PERF_L1D_MISSES] = openEvent(PERF_TYPE_HW_CACHE,
+         PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+      fds[PERF_LLC_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+      fds[PERF_BRANCH_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+   }
+
+   ~PerfCounters() {
+#ifdef __linux__
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         if (fds[e] >= 0)
+            close(fds[e]);
+      }
+#endif
+   }
+
+   bool available() {
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         if (fds[e] >= 0)
+            return true;
+      }
+      return false;
+   }
+
+   void start() {
+#ifdef __linux__
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         if (fds[e] >= 0) {
+            ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+         }
+      }
+#endif
+   }
+
+   // Stops counting and stores the counts since start, scaled up if the kernel had to
+   // share the hardware counters between events
+   void stop(PerfSample& sample) {
+#ifdef __linux__
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         if (fds[e] >= 0)
+            ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+      }
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+         unsigned long long data[3];   // value, time enabled, time running
+         if (fds[e] < 0 || read(fds[e], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+            continue;
+         sample.values[e] = (long long) ((double) data[0] * data[1] / data[2]);
+      }
+#endif
+   }
+
+private:
+#ifdef __linux__
+   static int openEvent(unsigned int type, unsigned long long config) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+   }
+#endif
+
+   int fds[NUM_PERF_EVENTS];
+};
+
+static PerfCounters perfCounters;
+
+/* A set of boxes, how they move each frame, and how many frames they move for */
+class Dataset {
+public:
+   std::string name;
+   std::vector<AABBf> boxes;
+   std::vector<Vector3f> velocities;
+   int frames;
+};
+
+/* Per call latencies of one octree function */
+class OpTimes {
+public:
+   OpTimes() : totalNanos(0.0) {}
+
+   void add(double nanos) {
+      times.push_back(nanos);
+      totalNanos += nanos;
+   }
+
+   double percentile(double p) {
+      if (times.size() == 0)
+         return 0.0;
+      std::sort(times.begin(), times.end());
+      return times[std::min(times.size() - 1, (size_t) (p * times.size()))];
+   }
+
+   void printJson(const char * name, bool last) {
+      double seconds = totalNanos / 1e9;
+      printf("        \"%s\": {\"count\": %d, \"opsPerSec\": %.1f, \"p50Ns\": %.0f, \"p90Ns\": %.0f, \"p99Ns\": %.0f, \"maxNs\": %.0f, \"perOp\": ",
+         name, (int) times.size(), seconds > 0.0 ? times.size() / seconds : 0.0,
+         percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0));
+      perf.printJson(times.size());
+      printf("}%s\n", last ? "" : ",");
+   }
+
+   std::vector<double> times;
+   double totalNanos;
+   PerfSample perf;   // Includes the cost of reading the clock around each call
+};
+
+static Vector3f randomPoint(std::mt19937& rng, float low, float high) {
+   std::uniform_real_distribution<float> dist(low, high);
+   float x = dist(rng);
+   float y = dist(rng);
+   float z = dist(rng);
+   return Vector3f(x, y, z);
+}
+
+static AABBf boxAround(const Vector3f& center, float size) {
+   Vector3f half(size / 2.0f, size / 2.0f, size / 2.0f);
+   return AABBf(center - half, center + half);
+}
+
+// Keeps a center far enough inside the world that a box of the given size fits
+static Vector3f clampToWorld(Vector3f center, float size) {
+   for (int i = 0; i < 3; i++) {
+      center(i) = std::max(size / 2.0f, std::min(WORLD_SIZE - size / 2.0f, center(i)));
+   }
+   return center;
+}
+
+static Dataset makeUniform(int numObjects, std::mt19937& rng) {
+   Dataset data;
+   data.name = "uniform";
+   data.frames = 1;
+   for (int i = 0; i < numObjects; i++) {
+      data.boxes.push_back(boxAround(randomPoint(rng, 1.0f, WORLD_SIZE - 1.0f), 1.0f));
+      data.velocities.push_back(randomPoint(rng, -0.1f, 0.1f));
+   }
+   return data;
+}
+
+static Dataset makeClustered(int numObjects, std::mt19937& rng) {
+   Dataset data;
+   data.name = "clustered";
+   data.frames = 1;
+   std::vector<Vector3f> clusters;
+   for (int i = 0; i < 16; i++) {
+      clusters.push_back(randomPoint(rng, 10.0f, WORLD_SIZE - 10.0f));
+   }
+   std::normal_distribution<float> spread(0.0f, 3.0f);
+   for (int i = 0; i < numObjects; i++) {
+      Vector3f center = clusters[rng() % clusters.size()];
+      float x = spread(rng);
+      float y = spread(rng);
+      float z = spread(rng);
+      center = clampToWorld(center + Vector3f(x, y, z), 0.5f);
+      data.boxes.push_back(boxAround(center, 0.5f));
+      data.velocities.push_back(randomPoint(rng, -0.05f, 0.05f));
+   }
+   return data;
+}
+
+// Mostly small boxes, with one in fifty being up to a fifth of the world wide
+static Dataset makeMixed(int numObjects, std::mt19937& rng) {
+   Dataset data;
+   data.name = "mixed";
+   data.frames = 1;
+   std::uniform_real_distribution<float> largeSize(5.0f, WORLD_SIZE / 5.0f);
+   for (int i = 0; i < numObjects; i++) {
+      float size = (i % 50 == 0) ? largeSize(rng) : 0.5f;
+      Vector3f center = clampToWorld(randomPoint(rng, 0.0f, WORLD_SIZE), size);
+      data.boxes.push_back(boxAround(center, size));
+      data.velocities.push_back(randomPoint(rng, -0.1f, 0.1f));
+   }
+   return data;
+}
+
+// Uniform boxes that keep moving for several frames, bouncing off the world's walls
+static Dataset makeMoving(int numObjects, std::mt19937& rng) {
+   Dataset data = makeUniform(numObjects, rng);
+   data.name = "moving";
+   data.frames = 10;
+   for (int i = 0; i < numObjects; i++) {
+      data.velocities[i] = randomPoint(rng, -1.0f, 1.0f);
+   }
+   return data;
+}
+
+static void moveBox(AABBf& box, Vector3f& velocity) {
+   for (int i = 0; i < 3; i++) {
+      if (box.lowBound(i) + velocity(i) < 0.0f || box.highBound(i) + velocity(i) > WORLD_SIZE)
+         velocity(i) = -velocity(i);
+   }
+   box.lowBound += velocity;
+   box.highBound += velocity;
+}
+
+static void runDataset(Dataset& data, int maxDepth, std::mt19937& rng, bool last) {
+   int numObjects = data.boxes.size();
+   Octree tree(Vector3f(0,0,0), Vector3f(WORLD_SIZE, WORLD_SIZE, WORLD_SIZE), maxDepth, boxInCellTest);
+   tree.setObjectBoundsFunction(boxBounds);
+
+   OpTimes insertTimes, removeTimes, updateTimes, insideTimes, outsideTimes;
+   std::vector<ObjectHandle> handles(numObjects);
+   perfCounters.start();
+   for (int i = 0; i < numObjects; i++) {
+      Clock::time_point start = Clock::now();
+      handles[i] = tree.insert(&data.boxes[i]);
+      insertTimes.add(nanosSince(start));
+   }
+   perfCounters.stop(insertTimes.perf);
+
+   OctreeStats shape = tree.stats();
+
+   ObjectList collisions;
+   std::vector<int> queryObjects;
+   for (int q = 0; q < NUM_QUERIES; q++) {
+      queryObjects.push_back(rng() % numObjects);
+   }
+   perfCounters.start();
+   for (int q = 0; q < NUM_QUERIES; q++) {
+      collisions.clear();
+      Clock::time_point start = Clock::now();
+      tree.testIntersectionInside(handles[queryObjects[q]], boxBoxTest, &collisions);
+      insideTimes.add(nanosSince(start));
+   }
+   perfCounters.stop(insideTimes.perf);
+
+   std::vector<AABBf> queries;
+   for (int q = 0; q < NUM_QUERIES; q++) {
+      queries.push_back(boxAround(randomPoint(rng, 2.0f, WORLD_SIZE - 2.0f), 4.0f));
+   }
+   perfCounters.start();
+   for (int q = 0; q < NUM_QUERIES; q++) {
+      collisions.clear();
+      Clock::time_point start = Clock::now();
+      tree.testIntersectionOutside(&queries[q], boxInCellTest, boxBoxTest, &collisions);
+      outsideTimes.add(nanosSince(start));
+   }
+   perfCounters.stop(outsideTimes.perf);
+
+   // Every object against every object it touches; pairs are found from both sides
+   size_t pairsFound = 0;
+   PerfSample allPairsPerf;
+   perfCounters.start();
+   Clock::time_point allPairsStart = Clock::now();
+   for (int i = 0; i < numObjects; i++) {
+      collisions.clear();
+      tree.testIntersectionInside(handles[i], boxBoxTest, &collisions);
+      pairsFound += collisions.size();
+   }
+   double allPairsNanos = nanosSince(allPairsStart);
+   perfCounters.stop(allPairsPerf);
+
+   // Also counts moving the boxes, which is small next to the update
+   perfCounters.start();
+   for (int frame = 0; frame < data.frames; frame++) {
+      for (int i = 0; i < numObjects; i++) {
+         moveBox(data.boxes[i], data.velocities[i]);
+         Clock::time_point start = Clock::now();
+         tree.update(handles[i]);
+         updateTimes.add(nanosSince(start));
+      }
+   }
+   perfCounters.stop(updateTimes.perf);
+
+   // Rebuilding is the only part of the octree that uses threads
+   std::vector<int> threadCounts;
+   std::vector<double> rebuildNanos;
+   for (int threads = 1; threads <= 8; threads *= 2) {
+      tree.setRebuildThreads(threads);
+      Clock::time_point start = Clock::now();
+      tree.resetWithBounds(tree.rootCell->lowBound, tree.rootCell->highBound);
+      threadCounts.push_back(threads);
+      rebuildNanos.push_back(nanosSince(start));
+   }
+
+   perfCounters.start();
+   for (int i = 0; i < numObjects; i++) {
+      Clock::time_point start = Clock::now();
+      tree.remove(handles[i]);
+      removeTimes.add(nanosSince(start));
+   }
+   perfCounters.stop(removeTimes.perf);
+
+   printf("    {\n");
+   printf("      \"name\": \"%s\",\n", data.name.c_str());
+   printf("      \"objects\": %d,\n", numObjects);
+   printf("      \"memoryBytes\": %zu,\n", shape.totalBytes);
+   printf("      \"memoryPerObject\": %.1f,\n", (double) shape.totalBytes / numObjects);
+   printf("      \"cells\": %d,\n", shape.numCells);
+   printf("      \"averageCellsPerObject\": %.3f,\n", shape.averageCellsPerObject);
+   printf("      \"ops\": {\n");
+   insertTimes.printJson("insert", false);
+   removeTimes.printJson("remove", false);
+   updateTimes.printJson("update", false);
+   insideTimes.printJson("queryInside", false);
+   outsideTimes.printJson("queryOutside", true);
+   printf("      },\n");
+   printf("      \"allPairs\": {\"seconds\": %.6f, \"objectsPerSec\": %.1f, \"pairsFound\": %zu, \"perObject\": ",
+      allPairsNanos / 1e9, numObjects / (allPairsNanos / 1e9), pairsFound);
+   allPairsPerf.printJson(numObjects);
+   printf("},\n");
+   printf("      \"rebuildScaling\": [");
+   for (size_t t = 0; t < threadCounts.size(); t++) {
+      printf("%s{\"threads\": %d, \"seconds\": %.6f, \"speedup\": %.2f}", t == 0 ? "" : ", ",
+         threadCounts[t], rebuildNanos[t] / 1e9, rebuildNanos[0] / rebuildNanos[t]);
+   }
+   printf("]\n");
+   printf("    }%s\n", last ? "" : ",");
+}
+
+// The sphere inside each box of the dataset
+static std::vector<Spheref> spheresIn(const Dataset& data) {
+   std::vector<Spheref> spheres;
+   for (size_t i = 0; i < data.boxes.size(); i++) {
+      const AABBf& box = data.boxes[i];
+      spheres.push_back(Spheref((box.lowBound + box.highBound) / 2.0f, (box.highBound(0) - box.lowBound(0)) / 2.0f));
+   }
+   return spheres;
+}
+
+// Inserts the spheres with each sphere-cell test and reports how many cells they end up in
+static void runSphereCells(const char * name, std::vector<Spheref>& spheres, int maxDepth, bool last) {
+   const char * testNames[3] = { "slab", "exact", "exactOctants" };
+   double cellsPerObject[3];
+   int numCells[3];
+   double insertNanos[3];
+   for (int t = 0; t < 3; t++) {
+      Octree tree(Vector3f(0,0,0), Vector3f(WORLD_SIZE, WORLD_SIZE, WORLD_SIZE), maxDepth,
+                  t == 0 ? slabSphereInCellTest : sphereInCellTest);
+      if (t == 2)
+         tree.setOctantsTest(sphereOctantsTest);
+      Clock::time_point start = Clock::now();
+      for (size_t i = 0; i < spheres.size(); i++) {
+         tree.insert(&spheres[i]);
+      }
+      insertNanos[t] = nanosSince(start);
+      OctreeStats shape = tree.stats();
+      cellsPerObject[t] = shape.averageCellsPerObject;
+      numCells[t] = shape.numCells;
+   }
+
+   printf("    {\"name\": \"%s\", ", name);
+   for (int t = 0; t < 3; t++) {
+      printf("\"%s\": {\"cellsPerObject\": %.3f, \"cells\": %d, \"insertSeconds\": %.6f}, ",
+         testNames[t], cellsPerObject[t], numCells[t], insertNanos[t] / 1e9);
+   }
+   printf("\"cellsPerObjectReduction\": %.3f}%s\n", 1.0 - cellsPerObject[1] / cellsPerObject[0], last ? "" : ",");
+}
+
+// A main camera, four cascades covering slices of its range, and three probes looking
+// along the axes from around the world
+static std::vector<Frustumf> makeViews() {
+   std::vector<Frustumf> views;
+   Vector3f eye(WORLD_SIZE / 2.0f, WORLD_SIZE / 2.0f, WORLD_SIZE * 1.5f);
+   Matrix4f cameraView = Mmath::ViewMatrix<float>(eye, Vector3f(0,0,-1), Vector3f(0,1,0));
+   views.push_back(Frustumf(Mmath::PerspectiveMatrix<float>(M_PI / 3, 1.0f, 1.0f, WORLD_SIZE * 2.0f) * cameraView));
+   float sliceEnds[5] = { 1.0f, WORLD_SIZE * 0.6f, WORLD_SIZE, WORLD_SIZE * 1.4f, WORLD_SIZE * 2.0f };
+   for (int i = 0; i < 4; i++) {
+      views.push_back(Frustumf(Mmath::PerspectiveMatrix<float>(M_PI / 3, 1.0f, sliceEnds[i], sliceEnds[i + 1]) * cameraView));
+   }
+   Vector3f probeEyes[3] = { Vector3f(-20, 50, 50), Vector3f(50, -20, 50), Vector3f(30, 30, 30) };
+   Vector3f probeDirs[3] = { Vector3f(1,0,0), Vector3f(0,1,0), Vector3f(1,1,1).normalized() };
+   Vector3f probeUps[3] = { Vector3f(0,1,0), Vector3f(0,0,1), Vector3f(0,1,0) };
+   for (int i = 0; i < 3; i++) {
+      Matrix4f probeView = Mmath::ViewMatrix<float>(probeEyes[i], probeDirs[i], probeUps[i]);
+      views.push_back(Frustumf(Mmath::PerspectiveMatrix<float>(M_PI / 2, 1.0f, 0.5f, WORLD_SIZE / 2.0f) * probeView));
+   }
+   return views;
+}
+
+// Culls every view in one pass, then each view on its own, and reports both
+static void runCull(Dataset& data, int maxDepth) {
+   Octree tree(Vector3f(0,0,0), Vector3f(WORLD_SIZE, WORLD_SIZE, WORLD_SIZE), maxDepth, boxInCellTest);
+   tree.setObjectBoundsFunction(boxBounds);
+   for (size_t i = 0; i < data.boxes.size(); i++) {
+      tree.insert(&data.boxes[i]);
+   }
+
+   std::vector<Frustumf> views = makeViews();
+   int numViews = views.size();
+   int rounds = 20;
+   CullList visible;
+   size_t multiFound = 0, separateFound = 0;
+
+   Clock::time_point start = Clock::now();
+   for (int r = 0; r < rounds; r++) {
+      multiFound += tree.cullFrustums(&views[0], numViews, visible);
+   }
+   double multiNanos = nanosSince(start);
+
+   start = Clock::now();
+   for (int r = 0; r < rounds; r++) {
+      for (int v = 0; v < numViews; v++) {
+         separateFound += tree.cullFrustums(&views[v], 1, visible);
+      }
+   }
+   double separateNanos = nanosSince(start);
+
+   printf("  \"cull\": {\"dataset\": \"%s\", \"views\": %d, \"rounds\": %d, \"objectsFound\": %zu, \"objectViewsFound\": %zu, "
+          "\"multiViewSeconds\": %.6f, \"separateSeconds\": %.6f, \"speedup\": %.2f},\n",
+      data.name.c_str(), numViews, rounds, multiFound / rounds, separateFound / rounds,
+      multiNanos / 1e9, separateNanos / 1e9, separateNanos / multiNanos);
+}
+
+// A camera walking across the world, turning slowly, culled coherently and from scratch
+static void runWalk(Dataset& data, int maxDepth) {
+   Octree tree(Vector3f(0,0,0), Vector3f(WORLD_SIZE, WORLD_SIZE, WORLD_SIZE), maxDepth, boxInCellTest);
+   tree.setObjectBoundsFunction(boxBounds);
+   for (size_t i = 0; i < data.boxes.size(); i++) {
+      tree.insert(&data.boxes[i]);
+   }
+
+   int frames = 300;
+   Matrix4f projection = Mmath::PerspectiveMatrix<float>(M_PI / 3, 16.0f / 9.0f, 0.1f, WORLD_SIZE / 3.0f);
+   std::vector<Frustumf> views;
+   for (int f = 0; f < frames; f++) {
+      float along = (float) f / frames;
+      Vector3f eye(WORLD_SIZE * (0.1f + 0.8f * along), WORLD_SIZE * 0.5f, WORLD_SIZE * 0.1f);
+      Vector3f look(cosf(along), sinf(along), -0.1f);
+      views.push_back(Frustumf(projection * Mmath::ViewMatrix<float>(eye, look.normalized(), Vector3f(0,0,1))));
+   }
+
+   CullCache cache;
+   CullList visible;
+   unsigned long long coherentTests = 0, freshTests = 0, reused = 0;
+   size_t coherentFound = 0, freshFound = 0;
+
+   // Each way takes the best of a few walks, since one walk is short enough to be noisy
+   double coherentNanos = INFINITY, freshNanos = INFINITY, cullNanos = INFINITY;
+   for (int run = 0; run < WALK_RUNS; run++) {
+      coherentTests = freshTests = reused = 0;
+      coherentFound = freshFound = 0;
+
+      cache.clear();
+      Clock::time_point start = Clock::now();
+      for (int f = 0; f < frames; f++) {
+         coherentFound += tree.cullFrustumCoherent(views[f], cache, visible);
+         coherentTests += cache.planeTests;
+         reused += cache.reusedCells;
+      }
+      coherentNanos = std::min(coherentNanos, nanosSince(start));
+
+      start = Clock::now();
+      for (int f = 0; f < frames; f++) {
+         cache.clear();
+         freshFound += tree.cullFrustumCoherent(views[f], cache, visible);
+         freshTests += cache.planeTests;
+      }
+      freshNanos = std::min(freshNanos, nanosSince(start));
+
+      start = Clock::now();
+      for (int f = 0; f < frames; f++) {
+         tree.cullFrustums(&views[f], 1, visible);
+      }
+      cullNanos = std::min(cullNanos, nanosSince(start));
+   }
+
+   printf("  \"walk\": {\"dataset\": \"%s\", \"frames\": %d, \"objectsFound\": %zu, \"sameObjects\": %s, "
+          "\"planeTestsPerFrame\": {\"coherent\": %.1f, \"fromScratch\": %.1f}, \"reusedCellsPerFrame\": %.1f, "
+          "\"seconds\": {\"coherent\": %.6f, \"fromScratch\": %.6f, \"cullFrustums\": %.6f}, \"speedupOverCullFrustums\": %.2f},\n",
+      data.name.c_str(), frames, coherentFound / frames, coherentFound == freshFound ? "true" : "false",
+      (double) coherentTests / frames, (double) freshTests / frames, (double) reused / frames,
+      coherentNanos / 1e9, freshNanos / 1e9, cullNanos / 1e9, cullNanos / coherentNanos);
+}
+
+// Spins, scales and moves a unit box per object each tick, then updates the tree. Once with
+// a matrix and eight corners per object and an update per object, once with the batch
+// transform and one batch update.
+static void runTransforms(Dataset& data, int maxDepth) {
+   int numObjects = data.boxes.size();
+   int ticks = 10;
+   std::vector<float> tx(numObjects), ty(numObjects), tz(numObjects);
+   std::vector<float> qw(numObjects), qx(numObjects), qy(numObjects), qz(numObjects);
+   std::vector<float> sx(numObjects), sy(numObjects), sz(numObjects);
+   std::vector<float> lowX(numObjects, -0.5f), lowY(numObjects, -0.5f), lowZ(numObjects, -0.5f);
+   std::vector<float> highX(numObjects, 0.5f), highY(numObjects, 0.5f), highZ(numObjects, 0.5f);
+   std::vector<float> outLowX(numObjects), outLowY(numObjects), outLowZ(numObjects);
+   std::vector<float> outHighX(numObjects), outHighY(numObjects), outHighZ(numObjects);
+   for (int i = 0; i < numObjects; i++) {
+      Vector3f center = (data.boxes[i].lowBound + data.boxes[i].highBound) / 2.0f;
+      Vector3f size = data.boxes[i].highBound - data.boxes[i].lowBound;
+      tx[i] = center(0); ty[i] = center(1); tz[i] = center(2);
+      sx[i] = size(0); sy[i] = size(1); sz[i] = size(2);
+   }
+   Mmath::TRSArray<float> trs(Mmath::Vec3Array<float>(&tx[0], &ty[0], &tz[0]),
+                              Mmath::QuatArray<float>(&qw[0], &qx[0], &qy[0], &qz[0]),
+                              Mmath::Vec3Array<float>(&sx[0], &sy[0], &sz[0]));
+   Mmath::Vec3Array<float> low(&lowX[0], &lowY[0], &lowZ[0]), high(&highX[0], &highY[0], &highZ[0]);
+   Mmath::Vec3Array<float> outLow(&outLowX[0], &outLowY[0], &outLowZ[0]), outHigh(&outHighX[0], &outHighY[0], &outHighZ[0]);
+
+   std::vector<AABBf> singleBoxes = data.boxes, batchBoxes = data.boxes;
+   Octree single(Vector3f(0,0,0), Vector3f(WORLD_SIZE, WORLD_SIZE, WORLD_SIZE), maxDepth, boxInCellTest);
+   Octree batch(Vector3f(0,0,0), Vector3f(WORLD_SIZE, WORLD_SIZE, WORLD_SIZE), maxDepth, boxInCellTest);
+   single.setObjectBoundsFunction(boxBounds);
+   batch.setObjectBoundsFunction(boxBounds);
+   std::vector<ObjectHandle> handles;
+   for (int i = 0; i < numObjects; i++) {
+      single.insert(&singleBoxes[i]);
+      handles.push_back(batch.insert(&batchBoxes[i]));
+   }
+
+   double singleTransformNanos = 0.0, batchTransformNanos = 0.0;
+   double singleUpdateNanos = 0.0, batchUpdateNanos = 0.0;
+   float maxDifference = 0.0f;
+   for (int t = 0; t < ticks; t++) {
+      for (int i = 0; i < numObjects; i++) {
+         Quaternionf rot = Mmath::AngleAxisQuat<float>(0.1f * t + i, Vector3f(1, i % 5, 2).normalized());
+         qw[i] = rot.w(); qx[i] = rot.x(); qy[i] = rot.y(); qz[i] = rot.z();
+         tx[i] += data.velocities[i](0) * 0.1f;
+      }
+
+      Clock::time_point start = Clock::now();
+      for (int i = 0; i < numObjects; i++) {
+         Matrix4f m = Mmath::TransformationMatrix<float>(Vector3f(tx[i], ty[i], tz[i]), Quaternionf(qw[i], qx[i], qy[i], qz[i]),
+                                                         Vector3f(sx[i], sy[i], sz[i]));
+         Vector3f boxLow( INFINITY,  INFINITY,  INFINITY), boxHigh(-INFINITY, -INFINITY, -INFINITY);
+         for (int c = 0; c < 8; c++) {
+            Vector3f corner(c & 4 ? 0.5f : -0.5f, c & 2 ? 0.5f : -0.5f, c & 1 ? 0.5f : -0.5f);
+            Vector3f moved = (m * Mmath::vec3To4(corner, 1.0f)).head<3>();
+            boxLow = boxLow.cwiseMin(moved);
+            boxHigh = boxHigh.cwiseMax(moved);
+         }
+         singleBoxes[i] = AABBf(boxLow, boxHigh);
+      }
+      singleTransformNanos += nanosSince(start);
+      start = Clock::now();
+      for (int i = 0; i < numObjects; i++) {
+         single.update(&singleBoxes[i]);
+      }
+      singleUpdateNanos += nanosSince(start);
+
+      start = Clock::now();
+      Mmath::TransformBoxes(trs, low, high, numObjects, outLow, outHigh);
+      for (int i = 0; i < numObjects; i++) {
+         batchBoxes[i].lowBound = Vector3f(outLowX[i], outLowY[i], outLowZ[i]);
+         batchBoxes[i].highBound = Vector3f(outHighX[i], outHighY[i], outHighZ[i]);
+      }
+      batchTransformNanos += nanosSince(start);
+      start = Clock::now();
+      batch.update(&handles[0], numObjects);
+      batchUpdateNanos += nanosSince(start);
+
+      for (int i = 0; i < numObjects; i++) {
+         maxDifference = std::max(maxDifference, (singleBoxes[i].lowBound - batchBoxes[i].lowBound).cwiseAbs().maxCoeff());
+         maxDifference = std::max(maxDifference, (singleBoxes[i].highBound - batchBoxes[i].highBound).cwiseAbs().maxCoeff());
+      }
+   }
+
+   printf("  \"transforms\": {\"dataset\": \"%s\", \"objects\": %d, \"ticks\": %d, \"maxBoxDifference\": %g, "
+          "\"transformSeconds\": {\"perObject\": %.6f, \"batch\": %.6f}, \"updateSeconds\": {\"perObject\": %.6f, \"batch\": %.6f}, "
+          "\"sameCells\": %s},\n",
+      data.name.c_str(), numObjects, ticks, maxDifference, singleTransformNanos / 1e9, batchTransformNanos / 1e9,
+      singleUpdateNanos / 1e9, batchUpdateNanos / 1e9, single.stats().numCells == batch.stats().numCells ? "true" : "false");
+}
+
+// Fast projectiles, found with one swept query each and with discrete queries at sub-steps
+static void runSweep(Dataset& data, int maxDepth, std::mt19937& rng) {
+   Octree tree(Vector3f(0,0,0), Vector3f(WORLD_SIZE, WORLD_SIZE, WORLD_SIZE), maxDepth, boxInCellTest);
+   tree.setObjectBoundsFunction(boxBounds);
+   for (size_t i = 0; i < data.boxes.size(); i++) {
+      tree.insert(&data.boxes[i]);
+   }
+
+   int numProjectiles = 2000, subSteps = 32;
+   float radius = 0.1f;
+   std::vector<Spheref> starts;
+   std::vector<Vector3f> motions;
+   for (int i = 0; i < numProjectiles; i++) {
+      starts.push_back(Spheref(randomPoint(rng, 0.0f, WORLD_SIZE), radius));
+      motions.push_back(randomPoint(rng, -1.0f, 1.0f).normalized() * (WORLD_SIZE / 10.0f));
+   }
+
+   SweptHitList hits;
+   size_t sweptFound = 0;
+   Clock::time_point start = Clock::now();
+   for (int i = 0; i < numProjectiles; i++) {
+      sweptFound += tree.sweepSphere(starts[i], motions[i], hits);
+   }
+   double sweptNanos = nanosSince(start);
+
+   // Each sub-step queries the projectile's box once, which misses whatever it passes between
+   ObjectList collisions;
+   size_t steppedFound = 0;
+   start = Clock::now();
+   for (int i = 0; i < numProjectiles; i++) {
+      collisions.clear();
+      for (int s = 0; s <= subSteps; s++) {
+         Vector3f center = starts[i].center + motions[i] * ((float) s / subSteps);
+         AABBf box(center - Vector3f(radius, radius, radius), center + Vector3f(radius, radius, radius));
+         tree.testIntersectionOutside(&box, boxInCellTest, boxBoxTest, &collisions);
+      }
+      std::sort(collisions.begin(), collisions.end());
+      steppedFound += std::unique(collisions.begin(), collisions.end()) - collisions.begin();
+   }
+   double steppedNanos = nanosSince(start);
+
+   printf("  \"sweep\": {\"dataset\": \"%s\", \"projectiles\": %d, \"subSteps\": %d, \"objectsFound\": {\"swept\": %zu, \"subStepped\": %zu}, "
+          "\"seconds\": {\"swept\": %.6f, \"subStepped\": %.6f}},\n",
+      data.name.c_str(), numProjectiles, subSteps, sweptFound, steppedFound, sweptNanos / 1e9, steppedNanos / 1e9);
+}
+
+int main(int argc, char ** argv) {
+   int numObjects = argc > 1 ? atoi(argv[1]) : 20000;
+   unsigned int seed = argc > 2 ? (unsigned int) atoi(argv[2]) : 1;
+   int maxDepth = argc > 3 ? atoi(argv[3]) : 6;
+   if (numObjects <= 0 || maxDepth < 0) {
+      fprintf(stderr, "usage: %s [numObjects] [seed] [maxDepth]\n", argv[0]);
+      return 1;
+   }
+
+   // Each dataset gets its own generator so adding one doesn't change the others
+   std::mt19937 rng(seed);
+   std::vector<Dataset> datasets;
+   datasets.push_back(makeUniform(numObjects, rng));
+   rng.seed(seed + 1);
+   datasets.push_back(makeClustered(numObjects, rng));
+   rng.seed(seed + 2);
+   datasets.push_back(makeMixed(numObjects, rng));
+   rng.seed(seed + 3);
+   datasets.push_back(makeMoving(numObjects, rng));
+
+   // Taken before the moving dataset's boxes move
+   Dataset cullData = datasets[0];
+   std::vector<std::vector<Spheref> > sphereSets;
+   for (int d = 0; d < 3; d++) {
+      sphereSets.push_back(spheresIn(datasets[d]));
+   }
+
+   printf("{\n");
+   printf("  \"config\": {\"objects\": %d, \"seed\": %u, \"maxDepth\": %d, \"worldSize\": %.1f, \"queries\": %d, \"perfCounters\": %s, \"simd\": \"%s\"},\n",
+      numObjects, seed, maxDepth, WORLD_SIZE, NUM_QUERIES, perfCounters.available() ? "true" : "false",
+      SimdLevelName(GetSimdLevel()));
+   printf("  \"datasets\": [\n");
+   for (size_t d = 0; d < datasets.size(); d++) {
+      rng.seed(seed + 100 + d);
+      runDataset(datasets[d], maxDepth, rng, d == datasets.size() - 1);
+   }
+   printf("  ],\n");
+   runCull(cullData, maxDepth);
+   runWalk(cullData, maxDepth);
+   runTransforms(cullData, maxDepth);
+   rng.seed(seed + 200);
+   runSweep(cullData, maxDepth, rng);
+   printf("  \"sphereCells\": [\n");
+   for (size_t d = 0; d < sphereSets.size(); d++) {
+      runSphereCells(datasets[d].name.c_str(), sphereSets[d], maxDepth, d == sphereSets.size() - 1);
+   }
+   printf("  ]\n");
+   printf("}\n");
+   return 0;
+}
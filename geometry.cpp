@@ -2,6 +2,17 @@
 #include "geometry.h"
 #include "matrix_math.h"
 
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef GEOM_MULTI_ISA
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 namespace Geom {
 
    // ================================================================== //
@@ -72,10 +83,14 @@ namespace Geom {
    AABBf::AABBf(Eigen::Vector3f lowBound, Eigen::Vector3f highBound)
    : lowBound(lowBound), highBound(highBound) {}
 
-   Frustumf::Frustumf() {}
+   Frustumf::Frustumf() {
+      packPlanes();
+   }
 
    Frustumf::Frustumf(Planef left, Planef right, Planef bottom, Planef top, Planef near, Planef far)
-   : left(left), right(right), bottom(bottom), top(top), near(near), far(far) {}
+   : left(left), right(right), bottom(bottom), top(top), near(near), far(far) {
+      packPlanes();
+   }
 
    Frustumf::Frustumf(Eigen::Vector3f nbl, Eigen::Vector3f nbr, Eigen::Vector3f ntl, Eigen::Vector3f ntr,
                       Eigen::Vector3f fbl, Eigen::Vector3f fbr, Eigen::Vector3f ftl, Eigen::Vector3f ftr) {
@@ -85,6 +100,39 @@ namespace Geom {
       top      = Planef(ntr, ntl, ftl);
       near     = Planef(ntl, ntr, nbr);
       far      = Planef(ftr, ftl, fbl);
+      packPlanes();
+   }
+
+   // With column vectors, a point p is inside the clip volume where -w < x, y, z < w, so each
+   // plane is the bottom row of the matrix plus or minus one of the others
+   Frustumf::Frustumf(const Eigen::Matrix4f& viewProjection) {
+      Planef * planes[NUM_PLANES] = { &left, &right, &bottom, &top, &near, &far };
+      Eigen::Vector4f w = viewProjection.row(3);
+      for (int i = 0; i < NUM_PLANES; i++) {
+         Eigen::Vector4f row = viewProjection.row(i / 2);
+         Eigen::Vector4f coefficients = w + row;
+         if (i % 2 == 1)
+            coefficients = w - row;
+         float length = coefficients.head<3>().norm();
+         planes[i]->normal = coefficients.head<3>() / length;
+         planes[i]->point = planes[i]->normal * (-coefficients(3) / length);
+      }
+      packPlanes();
+   }
+
+   void Frustumf::packPlanes() {
+      Planef * planes[NUM_PLANES] = { &left, &right, &bottom, &top, &near, &far };
+      for (int i = 0; i < NUM_PACKED_PLANES; i++) {
+         if (i < NUM_PLANES) {
+            planeX[i] = planes[i]->normal(0);
+            planeY[i] = planes[i]->normal(1);
+            planeZ[i] = planes[i]->normal(2);
+            planeD[i] = -planes[i]->normal.dot(planes[i]->point);
+         } else {
+            planeX[i] = planeY[i] = planeZ[i] = 0.0f;
+            planeD[i] = 1.0f;
+         }
+      }
    }
 
    Frustumf operator *(Eigen::Matrix4f transformM, Frustumf frustOp) {
@@ -94,9 +142,11 @@ namespace Geom {
    }
 
    bool Frustumf::contains(Eigen::Vector3f pnt) {
-      return left.distToPoint(pnt) > 0 && right.distToPoint(pnt) > 0 &&
-             bottom.distToPoint(pnt) > 0 && top.distToPoint(pnt) > 0 &&
-             near.distToPoint(pnt) > 0 && far.distToPoint(pnt) > 0;
+      for (int i = 0; i < NUM_PLANES; i++) {
+         if (!(planeX[i] * pnt(0) + planeY[i] * pnt(1) + planeZ[i] * pnt(2) + planeD[i] > 0.0f))
+            return false;
+      }
+      return true;
    }
 
    // ================================================================== //
@@ -108,10 +158,41 @@ namespace Geom {
    }
 
    bool DoesIntersect(Rayf& ray, Trianglef& triangle) {
-      float t = - triangle.normal.dot(ray.start - triangle.pA) /
-                  triangle.normal.dot(ray.direction);
-      Eigen::Vector3f interPnt = ray.getPointByDist(t);
-      return triangle.isPointInside(interPnt);
+      TriangleHitf hit;
+      return DoesIntersect(ray, triangle, INFINITY, hit);
+   }
+
+   // Solves start + t * dir = pA + u * (pB - pA) + v * (pC - pA) with Cramer's rule. det is
+   // zero for rays parallel to the triangle, and positive for rays hitting its front, the side
+   // its (counterclockwise) normal points to. The conditions are written so that NaNs miss.
+   bool DoesIntersect(Rayf& ray, Trianglef& triangle, float maxDist, TriangleHitf& hit, bool cullBackfaces) {
+      Eigen::Vector3f edge1 = triangle.pB - triangle.pA;
+      Eigen::Vector3f edge2 = triangle.pC - triangle.pA;
+      Eigen::Vector3f p = ray.direction.cross(edge2);
+      float det = edge1.dot(p);
+      bool facing = cullBackfaces ? det > 0.0f : (det > 0.0f || det < 0.0f);
+      if (!facing)
+         return false;
+
+      float invDet = 1.0f / det;
+      Eigen::Vector3f s = ray.start - triangle.pA;
+      float u = s.dot(p) * invDet;
+      if (!(u >= 0.0f && u <= 1.0f))
+         return false;
+
+      Eigen::Vector3f q = s.cross(edge1);
+      float v = ray.direction.dot(q) * invDet;
+      if (!(v >= 0.0f && u + v <= 1.0f))
+         return false;
+
+      float t = edge2.dot(q) * invDet;
+      if (!(t >= 0.0f && t <= maxDist))
+         return false;
+
+      hit.t = t;
+      hit.u = u;
+      hit.v = v;
+      return true;
    }
 
    bool DoesIntersect(Rayf& ray, Spheref& sphere) {
@@ -152,6 +233,12 @@ namespace Geom {
       float tmin = -100000.0;
       float tmax =  100000.0;
 
+      // A ray parallel to a slab misses unless it starts inside it
+      for (int i = 0; i < 3; i++) {
+         if (ray.direction(i) == 0.0 && (ray.start(i) < box.lowBound(i) || ray.start(i) > box.highBound(i)))
+            return false;
+      }
+
       if (ray.direction(0) != 0.0) {
          float tx1 = (box.lowBound(0) - ray.start(0)) / ray.direction(0);
          float tx2 = (box.highBound(0) - ray.start(0)) / ray.direction(0);
@@ -179,20 +266,102 @@ namespace Geom {
       return tmax >= tmin;
    }
 
+   // Squared distance from the point to the closest point of the range [low, high]
+   static inline float squaredDistToRange(float point, float low, float high) {
+      float d = point - Mmath::min(Mmath::max(point, low), high);
+      return d * d;
+   }
+
    bool DoesIntersect(Spheref& sphere, AABBf& box) {
-      // False positive when center of circle lies just above or below the corners,
-      // But whatever, we can fix it later
-      return sphere.center(0) + sphere.radius >= box.lowBound(0) &&
-             sphere.center(0) - sphere.radius <= box.highBound(0) &&
-             sphere.center(1) + sphere.radius >= box.lowBound(1) &&
-             sphere.center(1) - sphere.radius <= box.highBound(1) &&
-             sphere.center(2) + sphere.radius >= box.lowBound(2) &&
-             sphere.center(2) - sphere.radius <= box.highBound(2);
+      // The center's squared distance to the closest point of the box
+      float distSq = 0.0f;
+      for (int i = 0; i < 3; i++) {
+         distSq += squaredDistToRange(sphere.center(i), box.lowBound(i), box.highBound(i));
+      }
+      return distSq <= sphere.radius * sphere.radius;
    }
 
+   bool SweepIntersect(const AABBf& moving, const Eigen::Vector3f& motion, const AABBf& target, float& tEnter, float& tExit) {
+      tEnter = 0.0f;
+      tExit = 1.0f;
+      for (int i = 0; i < 3; i++) {
+         // Overlapping on this axis while moving.low + motion * t <= target.high and
+         // moving.high + motion * t >= target.low
+         if (motion(i) == 0.0f) {
+            if (moving.lowBound(i) > target.highBound(i) || moving.highBound(i) < target.lowBound(i))
+               return false;
+            continue;
+         }
+         float invMotion = 1.0f / motion(i);
+         float t1 = (target.lowBound(i) - moving.highBound(i)) * invMotion;
+         float t2 = (target.highBound(i) - moving.lowBound(i)) * invMotion;
+         tEnter = Mmath::max(tEnter, Mmath::min(t1, t2));
+         tExit = Mmath::min(tExit, Mmath::max(t1, t2));
+      }
+      return tEnter <= tExit;
+   }
+
+   // The squared distance to an octant is the sum of the distances to its half of the box on
+   // each axis, so six distances cover all eight octants
+   unsigned int IntersectingOctants(Spheref& sphere, AABBf& box) {
+      float halfDistSq[2][3];
+      for (int i = 0; i < 3; i++) {
+         float center = (box.lowBound(i) + box.highBound(i)) / 2.0f;
+         halfDistSq[0][i] = squaredDistToRange(sphere.center(i), box.lowBound(i), center);
+         halfDistSq[1][i] = squaredDistToRange(sphere.center(i), center, box.highBound(i));
+      }
+
+      float radiusSq = sphere.radius * sphere.radius;
+      unsigned int octants = 0;
+      for (int octant = 0; octant < 8; octant++) {
+         float distSq = 0.0f;
+         for (int i = 0; i < 3; i++) {
+            distSq += halfDistSq[(octant >> (2 - i)) & 1][i];
+         }
+         if (distSq <= radiusSq)
+            octants |= 1u << octant;
+      }
+      return octants;
+   }
+
+   // True if the projections of the triangle (moved so the box is centered on the origin)
+   // and of the box onto the axis overlap
+   static bool overlapsOnAxis(const Eigen::Vector3f& axis, const Eigen::Vector3f& v0, const Eigen::Vector3f& v1,
+                              const Eigen::Vector3f& v2, const Eigen::Vector3f& halfSize) {
+      float p0 = axis.dot(v0);
+      float p1 = axis.dot(v1);
+      float p2 = axis.dot(v2);
+      float r = halfSize.dot(axis.cwiseAbs());
+      return Mmath::min(p0, Mmath::min(p1, p2)) <= r && Mmath::max(p0, Mmath::max(p1, p2)) >= -r;
+   }
+
+   // Separating axis test: the two don't touch if and only if their projections are apart on
+   // one of the box's axes, the triangle's normal, or the cross products of the box's axes
+   // with the triangle's edges. Degenerate triangles give zero axes, which never separate.
    bool DoesIntersect(Trianglef& triangle, AABBf& box) {
-      // fill this out
-      return false;
+      Eigen::Vector3f center = (box.lowBound + box.highBound) / 2.0f;
+      Eigen::Vector3f halfSize = (box.highBound - box.lowBound) / 2.0f;
+      Eigen::Vector3f v0 = triangle.pA - center;
+      Eigen::Vector3f v1 = triangle.pB - center;
+      Eigen::Vector3f v2 = triangle.pC - center;
+      Eigen::Vector3f edges[3] = { v1 - v0, v2 - v1, v0 - v2 };
+
+      for (int i = 0; i < 3; i++) {
+         if (!overlapsOnAxis(Eigen::Vector3f::Unit(i), v0, v1, v2, halfSize))
+            return false;
+      }
+
+      if (!overlapsOnAxis(edges[0].cross(edges[1]), v0, v1, v2, halfSize))
+         return false;
+
+      for (int e = 0; e < 3; e++) {
+         for (int i = 0; i < 3; i++) {
+            if (!overlapsOnAxis(edges[e].cross(Eigen::Vector3f::Unit(i)), v0, v1, v2, halfSize))
+               return false;
+         }
+      }
+
+      return true;
    }
 
    Eigen::Vector3f Intersect(Rayf& ray, Planef& plane) {
@@ -267,4 +436,364 @@ namespace Geom {
    Eigen::Vector3f Intersect(Rayf& ray, AABBf& box) {
       return Eigen::Vector3f(0,0,0);
    }
-}
\ No newline at end of file
+
+   // ================================================================== //
+   // ========================== Batch Tests =========================== //
+   // ================================================================== //
+
+   void AABBSoAf::push(const AABBf& box) {
+      minX.push_back(box.lowBound(0));
+      minY.push_back(box.lowBound(1));
+      minZ.push_back(box.lowBound(2));
+      maxX.push_back(box.highBound(0));
+      maxY.push_back(box.highBound(1));
+      maxZ.push_back(box.highBound(2));
+   }
+
+   void AABBSoAf::clear() {
+      minX.clear(); minY.clear(); minZ.clear();
+      maxX.clear(); maxY.clear(); maxZ.clear();
+   }
+
+   int AABBSoAf::size() const {
+      return minX.size();
+   }
+
+   void SphereSoAf::push(const Spheref& sphere) {
+      x.push_back(sphere.center(0));
+      y.push_back(sphere.center(1));
+      z.push_back(sphere.center(2));
+      radius.push_back(sphere.radius);
+   }
+
+   void SphereSoAf::clear() {
+      x.clear(); y.clear(); z.clear();
+      radius.clear();
+   }
+
+   int SphereSoAf::size() const {
+      return x.size();
+   }
+
+   void RaySoAf::push(const Rayf& ray) {
+      startX.push_back(ray.start(0));
+      startY.push_back(ray.start(1));
+      startZ.push_back(ray.start(2));
+      dirX.push_back(ray.direction(0));
+      dirY.push_back(ray.direction(1));
+      dirZ.push_back(ray.direction(2));
+   }
+
+   void RaySoAf::clear() {
+      startX.clear(); startY.clear(); startZ.clear();
+      dirX.clear(); dirY.clear(); dirZ.clear();
+   }
+
+   int RaySoAf::size() const {
+      return startX.size();
+   }
+
+   void TriangleSoAf::push(const Trianglef& triangle) {
+      aX.push_back(triangle.pA(0)); aY.push_back(triangle.pA(1)); aZ.push_back(triangle.pA(2));
+      bX.push_back(triangle.pB(0)); bY.push_back(triangle.pB(1)); bZ.push_back(triangle.pB(2));
+      cX.push_back(triangle.pC(0)); cY.push_back(triangle.pC(1)); cZ.push_back(triangle.pC(2));
+   }
+
+   void TriangleSoAf::clear() {
+      aX.clear(); aY.clear(); aZ.clear();
+      bX.clear(); bY.clear(); bZ.clear();
+      cX.clear(); cY.clear(); cZ.clear();
+   }
+
+   int TriangleSoAf::size() const {
+      return aX.size();
+   }
+
+   void PointSoAf::push(const Eigen::Vector3f& point) {
+      x.push_back(point(0));
+      y.push_back(point(1));
+      z.push_back(point(2));
+   }
+
+   void PointSoAf::clear() {
+      x.clear(); y.clear(); z.clear();
+   }
+
+   int PointSoAf::size() const {
+      return x.size();
+   }
+
+   // The batch kernels of one instruction set
+   struct BatchKernels {
+      int (* rayBoxes)(const Rayf& ray, const AABBSoAf& boxes, BitMask& hits);
+      int (* raysBox)(const RaySoAf& rays, const AABBf& box, BitMask& hits);
+      int (* sphereBoxes)(const Spheref& sphere, const AABBSoAf& boxes, BitMask& hits);
+      int (* spheresBox)(const SphereSoAf& spheres, const AABBf& box, BitMask& hits);
+      int (* raySpheres)(const Rayf& ray, const SphereSoAf& spheres, BitMask& hits);
+      int (* raysSphere)(const RaySoAf& rays, const Spheref& sphere, BitMask& hits);
+      int (* pointsInFrustum)(const Frustumf& frustum, const PointSoAf& points, BitMask& hits);
+      int (* trianglesBox)(const TriangleSoAf& triangles, const AABBf& box, BitMask& hits);
+      int (* rayTriangles)(const Rayf& ray, const TriangleSoAf& triangles, float maxDist, bool cullBackfaces,
+                           BitMask& hits, TriangleHitSoAf& found);
+      void (* boxPlanes)(const Frustumf& frustum, const AABBf& box, unsigned int& outside, unsigned int& straddling);
+   };
+
+   // The range of t the single ray-box test accepts
+   #define RAY_T_LIMIT 100000.0f
+
+   // Each instruction set gets a Lanes class and its own copy of the kernels. Masks hold one
+   // flag per lane.
+   namespace Scalar {
+      struct Lanes {
+         typedef float Vec;
+         typedef bool Mask;
+         enum { WIDTH = 1 };
+
+         static inline Vec set1(float f) { return f; }
+         static inline Vec load(const float * p) { return *p; }
+         static inline void store(float * p, Vec v) { *p = v; }
+         static inline Vec add(Vec a, Vec b) { return a + b; }
+         static inline Vec sub(Vec a, Vec b) { return a - b; }
+         static inline Vec mul(Vec a, Vec b) { return a * b; }
+         static inline Vec div(Vec a, Vec b) { return a / b; }
+         static inline Vec min(Vec a, Vec b) { return a < b ? a : b; }
+         static inline Vec max(Vec a, Vec b) { return a > b ? a : b; }
+         static inline Mask le(Vec a, Vec b) { return a <= b; }
+         static inline Mask lt(Vec a, Vec b) { return a < b; }
+         static inline Mask eq(Vec a, Vec b) { return a == b; }
+         static inline Mask both(Mask a, Mask b) { return a && b; }
+         static inline Mask either(Mask a, Mask b) { return a || b; }
+         static inline Vec select(Mask m, Vec a, Vec b) { return m ? a : b; }
+         static inline unsigned int bits(Mask m) { return m ? 1 : 0; }
+      };
+
+      #include "geometry_batch.inc"
+   }
+
+#ifdef __SSE__
+   namespace Sse {
+      struct Lanes {
+         typedef __m128 Vec;
+         typedef __m128 Mask;
+         enum { WIDTH = 4 };
+
+         static inline Vec set1(float f) { return _mm_set1_ps(f); }
+         static inline Vec load(const float * p) { return _mm_loadu_ps(p); }
+         static inline void store(float * p, Vec v) { _mm_storeu_ps(p, v); }
+         static inline Vec add(Vec a, Vec b) { return _mm_add_ps(a, b); }
+         static inline Vec sub(Vec a, Vec b) { return _mm_sub_ps(a, b); }
+         static inline Vec mul(Vec a, Vec b) { return _mm_mul_ps(a, b); }
+         static inline Vec div(Vec a, Vec b) { return _mm_div_ps(a, b); }
+         static inline Vec min(Vec a, Vec b) { return _mm_min_ps(a, b); }
+         static inline Vec max(Vec a, Vec b) { return _mm_max_ps(a, b); }
+         static inline Mask le(Vec a, Vec b) { return _mm_cmple_ps(a, b); }
+         static inline Mask lt(Vec a, Vec b) { return _mm_cmplt_ps(a, b); }
+         static inline Mask eq(Vec a, Vec b) { return _mm_cmpeq_ps(a, b); }
+         static inline Mask both(Mask a, Mask b) { return _mm_and_ps(a, b); }
+         static inline Mask either(Mask a, Mask b) { return _mm_or_ps(a, b); }
+         static inline Vec select(Mask m, Vec a, Vec b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+         static inline unsigned int bits(Mask m) { return _mm_movemask_ps(m); }
+      };
+
+      #include "geometry_batch.inc"
+   }
+#endif
+
+#ifdef GEOM_MULTI_ISA
+   // Built for newer CPUs than the rest of the program; only called once cpuid says so
+   #pragma GCC push_options
+   #pragma GCC target("avx2")
+   namespace Avx2 {
+      struct Lanes {
+         typedef __m256 Vec;
+         typedef __m256 Mask;
+         enum { WIDTH = 8 };
+
+         static inline Vec set1(float f) { return _mm256_set1_ps(f); }
+         static inline Vec load(const float * p) { return _mm256_loadu_ps(p); }
+         static inline void store(float * p, Vec v) { _mm256_storeu_ps(p, v); }
+         static inline Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+         static inline Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+         static inline Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+         static inline Vec div(Vec a, Vec b) { return _mm256_div_ps(a, b); }
+         static inline Vec min(Vec a, Vec b) { return _mm256_min_ps(a, b); }
+         static inline Vec max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+         static inline Mask le(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+         static inline Mask lt(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+         static inline Mask eq(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+         static inline Mask both(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+         static inline Mask either(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+         static inline Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_ps(b, a, m); }
+         static inline unsigned int bits(Mask m) { return _mm256_movemask_ps(m); }
+      };
+
+      #include "geometry_batch.inc"
+   }
+   #pragma GCC pop_options
+
+   #pragma GCC push_options
+   #pragma GCC target("avx512f")
+   namespace Avx512 {
+      struct Lanes {
+         typedef __m512 Vec;
+         typedef __mmask16 Mask;
+         enum { WIDTH = 16 };
+
+         static inline Vec set1(float f) { return _mm512_set1_ps(f); }
+         static inline Vec load(const float * p) { return _mm512_loadu_ps(p); }
+         static inline void store(float * p, Vec v) { _mm512_storeu_ps(p, v); }
+         static inline Vec add(Vec a, Vec b) { return _mm512_add_ps(a, b); }
+         static inline Vec sub(Vec a, Vec b) { return _mm512_sub_ps(a, b); }
+         static inline Vec mul(Vec a, Vec b) { return _mm512_mul_ps(a, b); }
+         static inline Vec div(Vec a, Vec b) { return _mm512_div_ps(a, b); }
+         static inline Vec min(Vec a, Vec b) { return _mm512_min_ps(a, b); }
+         static inline Vec max(Vec a, Vec b) { return _mm512_max_ps(a, b); }
+         static inline Mask le(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+         static inline Mask lt(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+         static inline Mask eq(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+         static inline Mask both(Mask a, Mask b) { return a & b; }
+         static inline Mask either(Mask a, Mask b) { return a | b; }
+         static inline Vec select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_ps(m, b, a); }
+         static inline unsigned int bits(Mask m) { return m; }
+      };
+
+      #include "geometry_batch.inc"
+   }
+   #pragma GCC pop_options
+#endif
+
+   static const char * simdLevelNames[NUM_SIMD_LEVELS] = { "scalar", "sse", "avx2", "avx512" };
+
+   const char * SimdLevelName(SimdLevel level) {
+      return level < NUM_SIMD_LEVELS ? simdLevelNames[level] : "unknown";
+   }
+
+   // The kernels built for the level, or NULL if this build has none
+   static const BatchKernels * kernelsFor(SimdLevel level) {
+      switch (level) {
+      case SIMD_SCALAR:
+         return &Scalar::kernels;
+#ifdef __SSE__
+      case SIMD_SSE:
+         return &Sse::kernels;
+#endif
+#ifdef GEOM_MULTI_ISA
+      case SIMD_AVX2:
+         return &Avx2::kernels;
+      case SIMD_AVX512:
+         return &Avx512::kernels;
+#endif
+      default:
+         return NULL;
+      }
+   }
+
+   bool IsSimdLevelSupported(SimdLevel level) {
+      if (kernelsFor(level) == NULL)
+         return false;
+#ifdef GEOM_MULTI_ISA
+      __builtin_cpu_init();
+      if (level == SIMD_AVX2)
+         return __builtin_cpu_supports("avx2");
+      if (level == SIMD_AVX512)
+         return __builtin_cpu_supports("avx512f");
+#endif
+      return true;
+   }
+
+   // Picks the best level the CPU supports, or the one GEOM_SIMD names
+   static SimdLevel chooseSimdLevel() {
+      SimdLevel best = SIMD_SCALAR;
+      for (int level = 0; level < NUM_SIMD_LEVELS; level++) {
+         if (IsSimdLevelSupported((SimdLevel) level))
+            best = (SimdLevel) level;
+      }
+
+      const char * requested = getenv("GEOM_SIMD");
+      if (requested == NULL || requested[0] == '\0')
+         return best;
+      for (int level = 0; level < NUM_SIMD_LEVELS; level++) {
+         if (strcmp(requested, simdLevelNames[level]) == 0) {
+            if (IsSimdLevelSupported((SimdLevel) level))
+               return (SimdLevel) level;
+            fprintf(stderr, "Geom WARNING: GEOM_SIMD=%s is not supported here, using %s.\n", requested, simdLevelNames[best]);
+            return best;
+         }
+      }
+      fprintf(stderr, "Geom WARNING: unknown GEOM_SIMD=%s, using %s.\n", requested, simdLevelNames[best]);
+      return best;
+   }
+
+   static SimdLevel activeLevel = chooseSimdLevel();
+   static const BatchKernels * activeKernels = kernelsFor(activeLevel);
+
+   SimdLevel GetSimdLevel() {
+      return activeLevel;
+   }
+
+   bool SetSimdLevel(SimdLevel level) {
+      if (!IsSimdLevelSupported(level))
+         return false;
+      activeLevel = level;
+      activeKernels = kernelsFor(level);
+      return true;
+   }
+
+   int DoesIntersect(const Rayf& ray, const AABBSoAf& boxes, BitMask& hits) {
+      return activeKernels->rayBoxes(ray, boxes, hits);
+   }
+
+   int DoesIntersect(const RaySoAf& rays, const AABBf& box, BitMask& hits) {
+      return activeKernels->raysBox(rays, box, hits);
+   }
+
+   int DoesIntersect(const Spheref& sphere, const AABBSoAf& boxes, BitMask& hits) {
+      return activeKernels->sphereBoxes(sphere, boxes, hits);
+   }
+
+   int DoesIntersect(const SphereSoAf& spheres, const AABBf& box, BitMask& hits) {
+      return activeKernels->spheresBox(spheres, box, hits);
+   }
+
+   int DoesIntersect(const Rayf& ray, const SphereSoAf& spheres, BitMask& hits) {
+      return activeKernels->raySpheres(ray, spheres, hits);
+   }
+
+   int DoesIntersect(const RaySoAf& rays, const Spheref& sphere, BitMask& hits) {
+      return activeKernels->raysSphere(rays, sphere, hits);
+   }
+
+   int Contains(const Frustumf& frustum, const PointSoAf& points, BitMask& hits) {
+      return activeKernels->pointsInFrustum(frustum, points, hits);
+   }
+
+   int DoesIntersect(const TriangleSoAf& triangles, const AABBf& box, BitMask& hits) {
+      return activeKernels->trianglesBox(triangles, box, hits);
+   }
+
+   int DoesIntersect(const Rayf& ray, const TriangleSoAf& triangles, float maxDist, BitMask& hits,
+                     TriangleHitSoAf& found, bool cullBackfaces) {
+      return activeKernels->rayTriangles(ray, triangles, maxDist, cullBackfaces, hits, found);
+   }
+
+   void ClassifyPlanes(const Frustumf& frustum, const AABBf& box, unsigned int& outside, unsigned int& straddling) {
+      activeKernels->boxPlanes(frustum, box, outside, straddling);
+   }
+
+   FrustumClass Classify(const Frustumf& frustum, const AABBf& box) {
+      unsigned int outside, straddling;
+      activeKernels->boxPlanes(frustum, box, outside, straddling);
+      if (outside != 0)
+         return FRUSTUM_OUTSIDE;
+      return straddling != 0 ? FRUSTUM_INTERSECTS : FRUSTUM_INSIDE;
+   }
+
+   void PlaneDistances(const Frustumf& frustum, int plane, const AABBf& box, float& nearDist, float& farDist) {
+      float nx = frustum.planeX[plane], ny = frustum.planeY[plane], nz = frustum.planeZ[plane];
+      float lowX = nx * box.lowBound(0), highX = nx * box.highBound(0);
+      float lowY = ny * box.lowBound(1), highY = ny * box.highBound(1);
+      float lowZ = nz * box.lowBound(2), highZ = nz * box.highBound(2);
+      nearDist = std::min(lowX, highX) + std::min(lowY, highY) + std::min(lowZ, highZ) + frustum.planeD[plane];
+      farDist = std::max(lowX, highX) + std::max(lowY, highY) + std::max(lowZ, highZ) + frustum.planeD[plane];
+   }
+}
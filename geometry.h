@@ -1,9 +1,16 @@
 #ifndef __GEOMETRY_H__
 #define __GEOMETRY_H__
 
+#include <vector>
 #include <Eigen/Dense>
 #define EIGEN_DEFAULT_TO_COLUMN_MAJOR
 
+// GCC on x86 can build AVX2 and AVX-512 versions of the batch tests next to the baseline
+// ones, and pick one at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEOM_MULTI_ISA
+#endif
+
 namespace Geom {
 
    class Rayf {
@@ -67,29 +74,185 @@ namespace Geom {
 
    class Frustumf {
    public:
+      enum { NUM_PLANES = 6, NUM_PACKED_PLANES = 8 };
+
       Planef left, right;
       Planef bottom, top;
       Planef near, far;
 
+      // The planes in the order above, packed so that a point is inside plane i where
+      // planeX[i] * x + planeY[i] * y + planeZ[i] * z + planeD[i] > 0. The last two rows
+      // pass everything and only pad the rows out to a whole vector. The constructors fill
+      // them; call packPlanes() after changing the planes directly.
+      float planeX[NUM_PACKED_PLANES], planeY[NUM_PACKED_PLANES];
+      float planeZ[NUM_PACKED_PLANES], planeD[NUM_PACKED_PLANES];
+
       Frustumf();
       Frustumf(Planef left, Planef right, Planef bottom, Planef top, Planef near, Planef far);
       Frustumf(Eigen::Vector3f nbl, Eigen::Vector3f nbr, Eigen::Vector3f ntl, Eigen::Vector3f ntr,
                Eigen::Vector3f fbl, Eigen::Vector3f fbr, Eigen::Vector3f ftl, Eigen::Vector3f ftr);
+      // Extracts the planes from a projection times view matrix (Gribb and Hartmann), such
+      // as Mmath::PerspectiveMatrix(...) * Mmath::ViewMatrix(...)
+      explicit Frustumf(const Eigen::Matrix4f& viewProjection);
+
+      void packPlanes();
       bool contains(Eigen::Vector3f pnt);
    };
 
+   /* Where a ray hits a triangle: ray.start + t * ray.direction, which is also
+    * (1 - u - v) * pA + u * pB + v * pC */
+   class TriangleHitf {
+   public:
+      float t;
+      float u, v;
+   };
+
+   /* Where a box is relative to a frustum */
+   enum FrustumClass {
+      FRUSTUM_OUTSIDE,
+      FRUSTUM_INTERSECTS,
+      FRUSTUM_INSIDE
+   };
+
    // Find the point in which the ray intersects the plane
    bool DoesIntersect(Rayf& ray, Planef& plane);
-   bool DoesIntersect(Rayf& ray, Trianglef& triangle);
+   bool DoesIntersect(Rayf& ray, Trianglef& triangle);   // Only in front of the ray's start
+   // Moller-Trumbore. Only hits with 0 <= t <= maxDist count. With cullBackfaces, rays hitting
+   // the side the normal points away from miss.
+   bool DoesIntersect(Rayf& ray, Trianglef& triangle, float maxDist, TriangleHitf& hit, bool cullBackfaces = false);
    bool DoesIntersect(Rayf& ray, Spheref& sphere);
    bool DoesIntersect(Rayf& ray, AABBf& box);
    bool DoesIntersect(Spheref& sphere, AABBf& box);
-   bool DoesIntersect(Trianglef& triangle, AABBf& box);
+   // Bit i is set if the sphere touches octant i of the box: the half above the box's center
+   // on x if bit 2 of i is set, on y if bit 1 is, on z if bit 0 is (as Octree numbers its
+   // subcells). Same as testing each octant with DoesIntersect.
+   unsigned int IntersectingOctants(Spheref& sphere, AABBf& box);
+   bool DoesIntersect(Trianglef& triangle, AABBf& box);   // Touching counts as intersecting
+   // Sweeps the moving box by motion, from where it is at t = 0 to where it is at t = 1, and
+   // finds the times it overlaps the target: tEnter to tExit. The same slab math as a ray
+   // against a box, with the box's center as the ray and the target grown by the box's half
+   // size. Returns false if they don't overlap between t = 0 and 1. Touching counts.
+   bool SweepIntersect(const AABBf& moving, const Eigen::Vector3f& motion, const AABBf& target, float& tEnter, float& tExit);
 
    Eigen::Vector3f Intersect(Rayf& ray, Planef& plane);
    Eigen::Vector3f Intersect(Rayf& ray, Trianglef& triangle); // Aame as the above test (ignores the boundaries of the triangle)
    Eigen::Vector3f Intersect(Rayf& ray, Spheref& sphere);
    Eigen::Vector3f Intersect(Rayf& ray, AABBf& box);
+
+   // ================================================================== //
+   // ========================== Batch Tests =========================== //
+   // ================================================================== //
+
+   /* Structure-of-arrays versions of the primitives for the batch tests. Entry i of every
+    * array belongs to primitive i, so each coordinate is contiguous and can be loaded several
+    * primitives at a time. */
+   class AABBSoAf {
+   public:
+      void push(const AABBf& box);
+      void clear();
+      int size() const;
+
+      std::vector<float> minX, minY, minZ;
+      std::vector<float> maxX, maxY, maxZ;
+   };
+
+   class SphereSoAf {
+   public:
+      void push(const Spheref& sphere);
+      void clear();
+      int size() const;
+
+      std::vector<float> x, y, z;
+      std::vector<float> radius;
+   };
+
+   class RaySoAf {
+   public:
+      void push(const Rayf& ray);
+      void clear();
+      int size() const;
+
+      std::vector<float> startX, startY, startZ;
+      std::vector<float> dirX, dirY, dirZ;
+   };
+
+   class TriangleSoAf {
+   public:
+      void push(const Trianglef& triangle);
+      void clear();
+      int size() const;
+
+      std::vector<float> aX, aY, aZ;
+      std::vector<float> bX, bY, bZ;
+      std::vector<float> cX, cY, cZ;
+   };
+
+   class TriangleHitSoAf {
+   public:
+      std::vector<float> t;
+      std::vector<float> u, v;
+   };
+
+   class PointSoAf {
+   public:
+      void push(const Eigen::Vector3f& point);
+      void clear();
+      int size() const;
+
+      std::vector<float> x, y, z;
+   };
+
+   /* Result of a batch test: bit (i % 32) of word (i / 32) is set if primitive i passed */
+   typedef std::vector<unsigned int> BitMask;
+
+   inline bool TestBit(const BitMask& mask, int index) {
+      return (mask[index / 32] >> (index % 32)) & 1;
+   }
+
+   /* Instruction sets the batch tests can run with. The best one the CPU supports is picked
+    * at startup, unless the GEOM_SIMD environment variable names another (scalar, sse, avx2
+    * or avx512). */
+   enum SimdLevel {
+      SIMD_SCALAR,
+      SIMD_SSE,
+      SIMD_AVX2,
+      SIMD_AVX512,
+      NUM_SIMD_LEVELS
+   };
+
+   const char * SimdLevelName(SimdLevel level);
+   bool IsSimdLevelSupported(SimdLevel level);   // By both this build and this CPU
+   SimdLevel GetSimdLevel();
+   // Returns false, and changes nothing, if the level isn't supported. Not safe to call while
+   // other threads are running batch tests.
+   bool SetSimdLevel(SimdLevel level);
+
+   // Each batch test fills hits with one bit per primitive of its SoA argument and returns
+   // the number of bits set. They give the same answers as the single tests above.
+   // Ray directions must be unit vectors for the ray-sphere tests.
+   int DoesIntersect(const Rayf& ray, const AABBSoAf& boxes, BitMask& hits);
+   int DoesIntersect(const RaySoAf& rays, const AABBf& box, BitMask& hits);
+   int DoesIntersect(const Spheref& sphere, const AABBSoAf& boxes, BitMask& hits);
+   int DoesIntersect(const SphereSoAf& spheres, const AABBf& box, BitMask& hits);
+   int DoesIntersect(const Rayf& ray, const SphereSoAf& spheres, BitMask& hits);
+   int DoesIntersect(const RaySoAf& rays, const Spheref& sphere, BitMask& hits);
+   int Contains(const Frustumf& frustum, const PointSoAf& points, BitMask& hits);
+   int DoesIntersect(const TriangleSoAf& triangles, const AABBf& box, BitMask& hits);
+   // Same as the single Moller-Trumbore test. found holds each triangle's hit, and is only
+   // meaningful where the bit in hits is set.
+   int DoesIntersect(const Rayf& ray, const TriangleSoAf& triangles, float maxDist, BitMask& hits,
+                     TriangleHitSoAf& found, bool cullBackfaces = false);
+
+   // Tests the box against all of the frustum's planes at once, using the corner furthest
+   // along each plane's normal and the corner furthest against it. Bit i of outside is set
+   // if the box is entirely outside plane i, and bit i of straddling if it is partly inside.
+   // A box touching a plane is only partly inside it.
+   void ClassifyPlanes(const Frustumf& frustum, const AABBf& box, unsigned int& outside, unsigned int& straddling);
+   FrustumClass Classify(const Frustumf& frustum, const AABBf& box);
+   // The same test against plane i alone: nearDist is the value of the plane's function
+   // at the corner furthest against its normal and farDist at the corner furthest along it.
+   // The box is outside the plane if farDist < 0 and partly inside it if nearDist <= 0.
+   void PlaneDistances(const Frustumf& frustum, int plane, const AABBf& box, float& nearDist, float& farDist);
 }
 
 #endif // __GEOMETRY_H__
@@ -5,6 +5,15 @@
 #include <Eigen/Dense>
 #define EIGEN_DEFAULT_TO_COLUMN_MAJOR
 
+// Lets the compiler vectorize a batch loop without checking whether its arrays overlap
+#if defined(__clang__)
+#define MMATH_INDEPENDENT_LOOP _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define MMATH_INDEPENDENT_LOOP _Pragma("GCC ivdep")
+#else
+#define MMATH_INDEPENDENT_LOOP
+#endif
+
 namespace Mmath {
    template <typename T>
    T min(const T a, const T b) {
@@ -265,6 +274,197 @@ namespace Mmath {
    ) {
       return Eigen::Matrix<T,4,1>(vec3(0), vec3(1), vec3(2), elem);
    }
+
+   /* Batch transforms. Vectors are kept as separate x, y and z arrays so that each loop
+    * runs over contiguous floats and the compiler can vectorize it. Nothing is allocated;
+    * the caller owns every array. An output array may be the matching input array, but
+    * must not otherwise overlap the inputs. */
+   template <typename T>
+   class Vec3Array {
+   public:
+      Vec3Array(T * x, T * y, T * z) : x(x), y(y), z(z) {}
+      T * x;
+      T * y;
+      T * z;
+   };
+
+   template <typename T>
+   class QuatArray {
+   public:
+      QuatArray(T * w, T * x, T * y, T * z) : w(w), x(x), y(y), z(z) {}
+      T * w;
+      T * x;
+      T * y;
+      T * z;
+   };
+
+   /* Per object translation, rotation (unit quaternions) and scale, applied as
+    * TransformationMatrix(translation, rotation, scale) would */
+   template <typename T>
+   class TRSArray {
+   public:
+      TRSArray(Vec3Array<T> translations, QuatArray<T> rotations, Vec3Array<T> scales)
+         : translations(translations), rotations(rotations), scales(scales) {}
+      Vec3Array<T> translations;
+      QuatArray<T> rotations;
+      Vec3Array<T> scales;
+   };
+
+   // Row major rotation matrix of a unit quaternion, the same as Eigen's toRotationMatrix
+   template <typename T>
+   inline void QuatToRotation(T w, T x, T y, T z, T r[9]) {
+      r[0] = T(1) - T(2) * (y * y + z * z);
+      r[1] = T(2) * (x * y - z * w);
+      r[2] = T(2) * (x * z + y * w);
+      r[3] = T(2) * (x * y + z * w);
+      r[4] = T(1) - T(2) * (x * x + z * z);
+      r[5] = T(2) * (y * z - x * w);
+      r[6] = T(2) * (x * z - y * w);
+      r[7] = T(2) * (y * z + x * w);
+      r[8] = T(1) - T(2) * (x * x + y * y);
+   }
+
+   // The bottom row of m is taken to be 0 0 0 1, as it is for TransformationMatrix
+   template <typename T>
+   void TransformPoints(const Eigen::Matrix<T,4,4>& m, const Vec3Array<T>& in, int count, const Vec3Array<T>& out) {
+      const T * inX = in.x, * inY = in.y, * inZ = in.z;
+      T * outX = out.x, * outY = out.y, * outZ = out.z;
+      T m00 = m(0,0), m01 = m(0,1), m02 = m(0,2), m03 = m(0,3);
+      T m10 = m(1,0), m11 = m(1,1), m12 = m(1,2), m13 = m(1,3);
+      T m20 = m(2,0), m21 = m(2,1), m22 = m(2,2), m23 = m(2,3);
+      MMATH_INDEPENDENT_LOOP
+      for (int i = 0; i < count; i++) {
+         T x = inX[i], y = inY[i], z = inZ[i];
+         outX[i] = m00 * x + m01 * y + m02 * z + m03;
+         outY[i] = m10 * x + m11 * y + m12 * z + m13;
+         outZ[i] = m20 * x + m21 * y + m22 * z + m23;
+      }
+   }
+
+   // Directions: only the upper 3x3 of m applies
+   template <typename T>
+   void TransformVectors(const Eigen::Matrix<T,4,4>& m, const Vec3Array<T>& in, int count, const Vec3Array<T>& out) {
+      Eigen::Matrix<T,4,4> linear = m;
+      linear.template block<3,1>(0,3).setZero();
+      TransformPoints(linear, in, count, out);
+   }
+
+   // Uses the inverse transpose of the upper 3x3 of m. The normals aren't renormalized.
+   template <typename T>
+   void TransformNormals(const Eigen::Matrix<T,4,4>& m, const Vec3Array<T>& in, int count, const Vec3Array<T>& out) {
+      Eigen::Matrix<T,4,4> normalM = Eigen::Matrix<T,4,4>::Identity();
+      normalM.template block<3,3>(0,0) = m.template block<3,3>(0,0).inverse().transpose();
+      TransformPoints(normalM, in, count, out);
+   }
+
+   // Fits boxes around the transformed boxes (Arvo): the center goes through m and the
+   // half size through m with every entry made positive
+   template <typename T>
+   void TransformBoxes(const Eigen::Matrix<T,4,4>& m, const Vec3Array<T>& low, const Vec3Array<T>& high, int count,
+                       const Vec3Array<T>& outLow, const Vec3Array<T>& outHigh) {
+      const T * lowX = low.x, * lowY = low.y, * lowZ = low.z;
+      const T * highX = high.x, * highY = high.y, * highZ = high.z;
+      T * outLowX = outLow.x, * outLowY = outLow.y, * outLowZ = outLow.z;
+      T * outHighX = outHigh.x, * outHighY = outHigh.y, * outHighZ = outHigh.z;
+      T m00 = m(0,0), m01 = m(0,1), m02 = m(0,2), m03 = m(0,3);
+      T m10 = m(1,0), m11 = m(1,1), m12 = m(1,2), m13 = m(1,3);
+      T m20 = m(2,0), m21 = m(2,1), m22 = m(2,2), m23 = m(2,3);
+      T a00 = std::abs(m00), a01 = std::abs(m01), a02 = std::abs(m02);
+      T a10 = std::abs(m10), a11 = std::abs(m11), a12 = std::abs(m12);
+      T a20 = std::abs(m20), a21 = std::abs(m21), a22 = std::abs(m22);
+      MMATH_INDEPENDENT_LOOP
+      for (int i = 0; i < count; i++) {
+         T cx = (lowX[i] + highX[i]) * T(0.5), cy = (lowY[i] + highY[i]) * T(0.5), cz = (lowZ[i] + highZ[i]) * T(0.5);
+         T ex = (highX[i] - lowX[i]) * T(0.5), ey = (highY[i] - lowY[i]) * T(0.5), ez = (highZ[i] - lowZ[i]) * T(0.5);
+         T x = m00 * cx + m01 * cy + m02 * cz + m03;
+         T y = m10 * cx + m11 * cy + m12 * cz + m13;
+         T z = m20 * cx + m21 * cy + m22 * cz + m23;
+         T hx = a00 * ex + a01 * ey + a02 * ez;
+         T hy = a10 * ex + a11 * ey + a12 * ez;
+         T hz = a20 * ex + a21 * ey + a22 * ez;
+         outLowX[i] = x - hx;
+         outLowY[i] = y - hy;
+         outLowZ[i] = z - hz;
+         outHighX[i] = x + hx;
+         outHighY[i] = y + hy;
+         outHighZ[i] = z + hz;
+      }
+   }
+
+   // Point i goes through transform i
+   template <typename T>
+   void TransformPoints(const TRSArray<T>& trs, const Vec3Array<T>& in, int count, const Vec3Array<T>& out) {
+      const T * tx = trs.translations.x, * ty = trs.translations.y, * tz = trs.translations.z;
+      const T * qw = trs.rotations.w, * qx = trs.rotations.x;
+      const T * qy = trs.rotations.y, * qz = trs.rotations.z;
+      const T * sx = trs.scales.x, * sy = trs.scales.y, * sz = trs.scales.z;
+      const T * inX = in.x, * inY = in.y, * inZ = in.z;
+      T * outX = out.x, * outY = out.y, * outZ = out.z;
+      MMATH_INDEPENDENT_LOOP
+      for (int i = 0; i < count; i++) {
+         T r[9];
+         QuatToRotation(qw[i], qx[i], qy[i], qz[i], r);
+         T x = inX[i] * sx[i], y = inY[i] * sy[i], z = inZ[i] * sz[i];
+         outX[i] = r[0] * x + r[1] * y + r[2] * z + tx[i];
+         outY[i] = r[3] * x + r[4] * y + r[5] * z + ty[i];
+         outZ[i] = r[6] * x + r[7] * y + r[8] * z + tz[i];
+      }
+   }
+
+   // Normal i goes through the inverse transpose of transform i: rotation times inverse
+   // scale. The normals aren't renormalized.
+   template <typename T>
+   void TransformNormals(const TRSArray<T>& trs, const Vec3Array<T>& in, int count, const Vec3Array<T>& out) {
+      const T * qw = trs.rotations.w, * qx = trs.rotations.x;
+      const T * qy = trs.rotations.y, * qz = trs.rotations.z;
+      const T * sx = trs.scales.x, * sy = trs.scales.y, * sz = trs.scales.z;
+      const T * inX = in.x, * inY = in.y, * inZ = in.z;
+      T * outX = out.x, * outY = out.y, * outZ = out.z;
+      MMATH_INDEPENDENT_LOOP
+      for (int i = 0; i < count; i++) {
+         T r[9];
+         QuatToRotation(qw[i], qx[i], qy[i], qz[i], r);
+         T x = inX[i] / sx[i], y = inY[i] / sy[i], z = inZ[i] / sz[i];
+         outX[i] = r[0] * x + r[1] * y + r[2] * z;
+         outY[i] = r[3] * x + r[4] * y + r[5] * z;
+         outZ[i] = r[6] * x + r[7] * y + r[8] * z;
+      }
+   }
+
+   // Box i goes through transform i, fitted as in the single matrix version
+   template <typename T>
+   void TransformBoxes(const TRSArray<T>& trs, const Vec3Array<T>& low, const Vec3Array<T>& high, int count,
+                       const Vec3Array<T>& outLow, const Vec3Array<T>& outHigh) {
+      const T * tx = trs.translations.x, * ty = trs.translations.y, * tz = trs.translations.z;
+      const T * qw = trs.rotations.w, * qx = trs.rotations.x;
+      const T * qy = trs.rotations.y, * qz = trs.rotations.z;
+      const T * sx = trs.scales.x, * sy = trs.scales.y, * sz = trs.scales.z;
+      const T * lowX = low.x, * lowY = low.y, * lowZ = low.z;
+      const T * highX = high.x, * highY = high.y, * highZ = high.z;
+      T * outLowX = outLow.x, * outLowY = outLow.y, * outLowZ = outLow.z;
+      T * outHighX = outHigh.x, * outHighY = outHigh.y, * outHighZ = outHigh.z;
+      MMATH_INDEPENDENT_LOOP
+      for (int i = 0; i < count; i++) {
+         T r[9];
+         QuatToRotation(qw[i], qx[i], qy[i], qz[i], r);
+         // Scaling the box first keeps the rotation's entries for the half size
+         T cx = (lowX[i] + highX[i]) * T(0.5) * sx[i], ex = std::abs((highX[i] - lowX[i]) * T(0.5) * sx[i]);
+         T cy = (lowY[i] + highY[i]) * T(0.5) * sy[i], ey = std::abs((highY[i] - lowY[i]) * T(0.5) * sy[i]);
+         T cz = (lowZ[i] + highZ[i]) * T(0.5) * sz[i], ez = std::abs((highZ[i] - lowZ[i]) * T(0.5) * sz[i]);
+         T x = r[0] * cx + r[1] * cy + r[2] * cz + tx[i];
+         T y = r[3] * cx + r[4] * cy + r[5] * cz + ty[i];
+         T z = r[6] * cx + r[7] * cy + r[8] * cz + tz[i];
+         T hx = std::abs(r[0]) * ex + std::abs(r[1]) * ey + std::abs(r[2]) * ez;
+         T hy = std::abs(r[3]) * ex + std::abs(r[4]) * ey + std::abs(r[5]) * ez;
+         T hz = std::abs(r[6]) * ex + std::abs(r[7]) * ey + std::abs(r[8]) * ez;
+         outLowX[i] = x - hx;
+         outLowY[i] = y - hy;
+         outLowZ[i] = z - hz;
+         outHighX[i] = x + hx;
+         outHighY[i] = y + hy;
+         outHighZ[i] = z + hz;
+      }
+   }
 }
 
 #endif // __MATRIX_MATH_H__
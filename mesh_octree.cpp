@@ -0,0 +1,206 @@
+
+#include "mesh_octree.h"
+
+#include <math.h>
+#include <stdio.h>
+
+using namespace Geom;
+
+/* A ray cast in progress. tMax shrinks to the closest hit so far, so cells and triangles
+ * beyond it are skipped. */
+class MeshRayCast {
+public:
+   Rayf ray;
+   float tMax;
+   bool cullBackfaces;
+   bool found;
+   MeshHit hit;
+
+   // Scratch space for the batch test
+   BitMask hits;
+   TriangleHitSoAf cellHits;
+};
+
+// Narrows [tMin, tMax] to the part of the ray inside the box. Returns false if none is.
+static bool clipRayToBox(const Rayf& ray, const Eigen::Vector3f& low, const Eigen::Vector3f& high, float& tMin, float& tMax) {
+   for (int i = 0; i < 3; i++) {
+      if (ray.direction(i) == 0.0f) {
+         if (ray.start(i) < low(i) || ray.start(i) > high(i))
+            return false;
+         continue;
+      }
+
+      float t1 = (low(i) - ray.start(i)) / ray.direction(i);
+      float t2 = (high(i) - ray.start(i)) / ray.direction(i);
+      tMin = fmaxf(tMin, fminf(t1, t2));
+      tMax = fminf(tMax, fmaxf(t1, t2));
+   }
+   return tMin <= tMax;
+}
+
+static bool triangleInCellTest(void * object, Cell * cell) {
+   AABBf box(cell->lowBound, cell->highBound);
+   return DoesIntersect(((MeshTriangle *) object)->triangle, box);
+}
+
+static void triangleBounds(void * object, Eigen::Vector3f& lowBound, Eigen::Vector3f& highBound) {
+   Trianglef& triangle = ((MeshTriangle *) object)->triangle;
+   lowBound = triangle.pA.cwiseMin(triangle.pB).cwiseMin(triangle.pC);
+   highBound = triangle.pA.cwiseMax(triangle.pB).cwiseMax(triangle.pC);
+}
+
+MeshOctree::MeshOctree(
+   const float * vertices,
+   int numVertices,
+   const unsigned int * indices,
+   int numTriangles,
+   const FitParams& params
+) {
+   Eigen::Vector3f low(INFINITY, INFINITY, INFINITY);
+   Eigen::Vector3f high(-INFINITY, -INFINITY, -INFINITY);
+   int numSkipped = 0;
+
+   triangles.reserve(numTriangles);
+   for (int i = 0; i < numTriangles; i++) {
+      const unsigned int * corners = &indices[i * 3];
+      if (corners[0] >= (unsigned int) numVertices || corners[1] >= (unsigned int) numVertices ||
+          corners[2] >= (unsigned int) numVertices) {
+         numSkipped++;
+         continue;
+      }
+
+      Eigen::Vector3f points[3];
+      for (int c = 0; c < 3; c++) {
+         const float * vertex = &vertices[corners[c] * 3];
+         points[c] = Eigen::Vector3f(vertex[0], vertex[1], vertex[2]);
+         low = low.cwiseMin(points[c]);
+         high = high.cwiseMax(points[c]);
+      }
+
+      MeshTriangle triangle;
+      triangle.index = i;
+      triangle.triangle = Trianglef(points[0], points[1], points[2]);
+      triangles.push_back(triangle);
+   }
+
+   if (numSkipped > 0) {
+      fprintf(stderr, "MeshOctree WARNING: skipped %d triangles with vertex indices out of range.\n", numSkipped);
+   }
+   if (triangles.size() == 0) {
+      low = high = Eigen::Vector3f(0, 0, 0);
+   }
+
+   // Everything goes in the root first, then fitting picks the real bounds and depth
+   octree = new Octree(low, high, 0, triangleInCellTest);
+   octree->setObjectBoundsFunction(triangleBounds);
+   int numKept = triangles.size();
+   for (int i = 0; i < numKept; i++) {
+      octree->insert(&triangles[i]);
+   }
+   octree->fitToObjects(params);
+   nodes.resize(1);
+   copyCell(octree->rootCell, 0);
+}
+
+MeshOctree::~MeshOctree() {
+   delete(octree);
+}
+
+// Fills in the node for the cell, then gives its subcells a run of nodes and fills those
+void MeshOctree::copyCell(Cell * cell, int node) {
+   nodes[node].lowBound = cell->lowBound;
+   nodes[node].highBound = cell->highBound;
+   nodes[node].triangles = -1;
+
+   int numObjects = cell->objects.size();
+   if (numObjects > 0) {
+      nodes[node].triangles = cellTriangles.size();
+      cellTriangles.push_back(MeshCellTriangles());
+      MeshCellTriangles& copy = cellTriangles.back();
+      for (int i = 0; i < numObjects; i++) {
+         MeshTriangle * triangle = (MeshTriangle *) cell->objects[i];
+         copy.triangles.push(triangle->triangle);
+         copy.indices.push_back(triangle->index);
+      }
+   }
+
+   int numSubcells = cell->subcells.size();
+   int first = nodes.size();
+   nodes[node].firstSubnode = first;
+   nodes[node].numSubnodes = numSubcells;
+   nodes.resize(first + numSubcells);
+   for (int i = 0; i < numSubcells; i++) {
+      copyCell(cell->subcells[i], first + i);
+   }
+}
+
+// Tests the node's own triangles, then visits its subnodes nearest first, stopping at the
+// first one that starts past the closest hit
+void MeshOctree::raycastNode(int node, MeshRayCast& cast) {
+   if (nodes[node].triangles >= 0) {
+      MeshCellTriangles& copy = cellTriangles[nodes[node].triangles];
+      if (DoesIntersect(cast.ray, copy.triangles, cast.tMax, cast.hits, cast.cellHits, cast.cullBackfaces) > 0) {
+         int numTriangles = copy.indices.size();
+         for (int i = 0; i < numTriangles; i++) {
+            if (!TestBit(cast.hits, i) || (cast.found && cast.cellHits.t[i] >= cast.hit.t))
+               continue;
+            cast.found = true;
+            cast.hit.triangle = copy.indices[i];
+            cast.hit.t = cast.cellHits.t[i];
+            cast.hit.u = cast.cellHits.u[i];
+            cast.hit.v = cast.cellHits.v[i];
+            cast.tMax = cast.hit.t;
+         }
+      }
+   }
+
+   int order[8];
+   float entry[8];
+   int numOrdered = 0;
+   int first = nodes[node].firstSubnode, last = first + nodes[node].numSubnodes;
+   for (int subnode = first; subnode < last; subnode++) {
+      float tMin = 0.0f, tMax = cast.tMax;
+      if (!clipRayToBox(cast.ray, nodes[subnode].lowBound, nodes[subnode].highBound, tMin, tMax))
+         continue;
+
+      int slot = numOrdered++;
+      for (; slot > 0 && entry[slot - 1] > tMin; slot--) {
+         order[slot] = order[slot - 1];
+         entry[slot] = entry[slot - 1];
+      }
+      order[slot] = subnode;
+      entry[slot] = tMin;
+   }
+
+   for (int i = 0; i < numOrdered && entry[i] <= cast.tMax; i++) {
+      raycastNode(order[i], cast);
+   }
+}
+
+bool MeshOctree::raycast(const Rayf& ray, float maxDist, MeshHit& hit, bool cullBackfaces) {
+   MeshRayCast cast;
+   cast.ray = ray;
+   cast.tMax = maxDist;
+   cast.cullBackfaces = cullBackfaces;
+   cast.found = false;
+
+   float tMin = 0.0f, tMax = maxDist;
+   if (!clipRayToBox(ray, nodes[0].lowBound, nodes[0].highBound, tMin, tMax))
+      return false;
+
+   raycastNode(0, cast);
+   if (!cast.found)
+      return false;
+
+   hit = cast.hit;
+   hit.point = cast.ray.start + hit.t * cast.ray.direction;
+   return true;
+}
+
+int MeshOctree::getNumTriangles() const {
+   return triangles.size();
+}
+
+const Octree& MeshOctree::getOctree() const {
+   return *octree;
+}
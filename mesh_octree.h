@@ -0,0 +1,91 @@
+#ifndef __MESH_OCTREE_H__
+#define __MESH_OCTREE_H__
+
+#include <vector>
+#include <Eigen/Dense>
+#include "geometry.h"
+#include "octree.h"
+
+/* Where a ray hit a mesh. The hit point is (1 - u - v) * a + u * b + v * c, where a, b and c
+ * are the triangle's vertices in index order. */
+class MeshHit {
+public:
+   int triangle;            // Index of the triangle in the mesh's index list (index / 3)
+   float t;                 // Distance along the ray, in units of the ray's direction
+   float u, v;
+   Eigen::Vector3f point;
+};
+
+/* A triangle of the mesh, as stored in the octree */
+class MeshTriangle {
+public:
+   int index;
+   Geom::Trianglef triangle;
+};
+
+/* Copies of the triangles in one cell, laid out for the batch ray-triangle test */
+class MeshCellTriangles {
+public:
+   Geom::TriangleSoAf triangles;
+   std::vector<int> indices;   // indices[i] is the mesh index of triangle i
+};
+
+/* A cell of the tree as ray casts walk it. A node's subnodes are stored next to each other. */
+class MeshNode {
+public:
+   Eigen::Vector3f lowBound;
+   Eigen::Vector3f highBound;
+   int firstSubnode;
+   int numSubnodes;
+   int triangles;   // Index of the node's triangles in MeshOctree's list, or -1 if it has none
+};
+
+class MeshRayCast;
+
+/* Octree over the triangles of an indexed triangle mesh, for ray casts against the mesh.
+ * The triangles are copied, so the caller's arrays can go away after building.
+ */
+class MeshOctree {
+public:
+   /**
+    * Builds the tree over the triangles. vertices holds numVertices x,y,z triples and indices
+    * holds three vertex indices per triangle. Triangles with an index out of range are
+    * skipped. The root bounds, depth and leaf size are fitted to the triangles (see
+    * Octree::fitToObjects).
+    */
+   MeshOctree(
+      const float * vertices,
+      int numVertices,
+      const unsigned int * indices,
+      int numTriangles,
+      const FitParams& params = FitParams()
+   );
+   ~MeshOctree();
+
+   /**
+    * Finds the closest triangle the ray hits between t = 0 and t = maxDist. Both sides of
+    * the triangles are hit unless cullBackfaces is set (see Geom::DoesIntersect). Returns
+    * false, leaving hit alone, if there is none.
+    */
+   bool raycast(const Geom::Rayf& ray, float maxDist, MeshHit& hit, bool cullBackfaces = false);
+
+   int getNumTriangles() const;
+   // For the tree's const accessors, such as stats(). Ray casts walk their own copy of the
+   // cells, so the cells reachable through rootCell must not be changed.
+   const Octree& getOctree() const;
+
+private:
+   // The mesh owns its tree, so copies would delete it twice. Not implemented.
+   MeshOctree(const MeshOctree& other);
+   MeshOctree& operator=(const MeshOctree& other);
+
+   void copyCell(Cell * cell, int node);
+   void raycastNode(int node, MeshRayCast& cast);
+
+   std::vector<MeshTriangle> triangles;
+   std::vector<MeshNode> nodes;                     // nodes[0] is the root
+   std::vector<MeshCellTriangles> cellTriangles;
+   Octree * octree;
+};
+
+#endif
@@ -1,9 +1,57 @@
 
 #include "octree.h"
 
+#include "geometry.h"
 #include "matrix_math.h"
 
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdint.h>
+#ifdef GEOM_MULTI_ISA
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#ifdef OCTREE_STATS
+#define OCTREE_COUNT(counters, field, n) ((counters)->field += (n))
+#define OCTREE_COUNT_DEPTH(counters, depth) ((counters)->deepestLevel = std::max((counters)->deepestLevel, (int) (depth)))
+#define OCTREE_API(api) ApiScope apiScope(this, api)
+#else
+// counters is named but not evaluated, so functions that only count don't warn about it
+#define OCTREE_COUNT(counters, field, n) ((void) sizeof(counters))
+#define OCTREE_COUNT_DEPTH(counters, depth) ((void) sizeof(counters))
+#define OCTREE_API(api) ((void) 0)
+#endif
+
+// Counts (and traces) the rest of the scope as one call of the API, unless it is running
+// inside an outer API call
+class ApiScope {
+public:
+   ApiScope(Octree * tree, OctreeApi api) : tree(tree), outermost(tree->currentApi == API_OTHER) {
+      if (outermost)
+         tree->beginApi(api);
+   }
+   ~ApiScope() {
+      if (outermost)
+         tree->endApi();
+   }
+
+private:
+   Octree * tree;
+   bool outermost;
+};
+
+#ifdef OCTREE_STATS
+static int cellDepth(Cell * cell) {
+   int depth = 0;
+   for (cell = cell->parent; cell != NULL; cell = cell->parent) {
+      depth++;
+   }
+   return depth;
+}
+#endif
 
 /* subcell order:
  * 0: (-,-,-)
@@ -16,6 +64,133 @@
  * 7: (+,+,+)
  */
 
+void BoundsList::push(const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound) {
+   minX.push_back(lowBound(0));
+   minY.push_back(lowBound(1));
+   minZ.push_back(lowBound(2));
+   maxX.push_back(highBound(0));
+   maxY.push_back(highBound(1));
+   maxZ.push_back(highBound(2));
+}
+
+void BoundsList::swapRemove(int index) {
+   int last = size() - 1;
+   minX[index] = minX[last];
+   minY[index] = minY[last];
+   minZ[index] = minZ[last];
+   maxX[index] = maxX[last];
+   maxY[index] = maxY[last];
+   maxZ[index] = maxZ[last];
+   minX.pop_back();
+   minY.pop_back();
+   minZ.pop_back();
+   maxX.pop_back();
+   maxY.pop_back();
+   maxZ.pop_back();
+}
+
+void BoundsList::clear() {
+   minX.clear();
+   minY.clear();
+   minZ.clear();
+   maxX.clear();
+   maxY.clear();
+   maxZ.clear();
+}
+
+int BoundsList::size() {
+   return minX.size();
+}
+
+size_t BoundsList::heapBytes() {
+   return (minX.capacity() + minY.capacity() + minZ.capacity() +
+           maxX.capacity() + maxY.capacity() + maxZ.capacity()) * sizeof(float);
+}
+
+#ifdef GEOM_MULTI_ISA
+// Wider versions of the overlap loop below, used when Geom picked an instruction set that has
+// them. They return where they stopped, leaving fewer than a vector's worth of entries.
+__attribute__((target("avx2")))
+static int overlapMaskAvx2(BoundsList& list, int i, int start, int end,
+                           const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound, unsigned int& mask) {
+   __m256 qMinX = _mm256_set1_ps(lowBound(0)), qMaxX = _mm256_set1_ps(highBound(0));
+   __m256 qMinY = _mm256_set1_ps(lowBound(1)), qMaxY = _mm256_set1_ps(highBound(1));
+   __m256 qMinZ = _mm256_set1_ps(lowBound(2)), qMaxZ = _mm256_set1_ps(highBound(2));
+
+   for (; i + 8 <= end; i += 8) {
+      __m256 hit = _mm256_and_ps(
+         _mm256_cmp_ps(_mm256_loadu_ps(&list.minX[i]), qMaxX, _CMP_LE_OQ),
+         _mm256_cmp_ps(_mm256_loadu_ps(&list.maxX[i]), qMinX, _CMP_GE_OQ));
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_loadu_ps(&list.minY[i]), qMaxY, _CMP_LE_OQ));
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_loadu_ps(&list.maxY[i]), qMinY, _CMP_GE_OQ));
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_loadu_ps(&list.minZ[i]), qMaxZ, _CMP_LE_OQ));
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_loadu_ps(&list.maxZ[i]), qMinZ, _CMP_GE_OQ));
+      mask |= (unsigned int) _mm256_movemask_ps(hit) << (i - start);
+   }
+   return i;
+}
+
+__attribute__((target("avx512f")))
+static int overlapMaskAvx512(BoundsList& list, int i, int start, int end,
+                             const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound, unsigned int& mask) {
+   __m512 qMinX = _mm512_set1_ps(lowBound(0)), qMaxX = _mm512_set1_ps(highBound(0));
+   __m512 qMinY = _mm512_set1_ps(lowBound(1)), qMaxY = _mm512_set1_ps(highBound(1));
+   __m512 qMinZ = _mm512_set1_ps(lowBound(2)), qMaxZ = _mm512_set1_ps(highBound(2));
+
+   for (; i + 16 <= end; i += 16) {
+      __mmask16 hit = _mm512_cmp_ps_mask(_mm512_loadu_ps(&list.minX[i]), qMaxX, _CMP_LE_OQ);
+      hit &= _mm512_cmp_ps_mask(_mm512_loadu_ps(&list.maxX[i]), qMinX, _CMP_GE_OQ);
+      hit &= _mm512_cmp_ps_mask(_mm512_loadu_ps(&list.minY[i]), qMaxY, _CMP_LE_OQ);
+      hit &= _mm512_cmp_ps_mask(_mm512_loadu_ps(&list.maxY[i]), qMinY, _CMP_GE_OQ);
+      hit &= _mm512_cmp_ps_mask(_mm512_loadu_ps(&list.minZ[i]), qMaxZ, _CMP_LE_OQ);
+      hit &= _mm512_cmp_ps_mask(_mm512_loadu_ps(&list.maxZ[i]), qMinZ, _CMP_GE_OQ);
+      mask |= (unsigned int) hit << (i - start);
+   }
+   return i;
+}
+#endif
+
+unsigned int BoundsList::overlapMask(int start, const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound) {
+   int end = Mmath::min(size(), start + 32);
+   unsigned int mask = 0;
+   int i = start;
+   Geom::SimdLevel simd = Geom::GetSimdLevel();
+
+#ifdef GEOM_MULTI_ISA
+   if (simd >= Geom::SIMD_AVX512)
+      i = overlapMaskAvx512(*this, i, start, end, lowBound, highBound, mask);
+   else if (simd >= Geom::SIMD_AVX2)
+      i = overlapMaskAvx2(*this, i, start, end, lowBound, highBound, mask);
+#endif
+
+#ifdef __SSE__
+   __m128 qMinX = _mm_set1_ps(lowBound(0)), qMaxX = _mm_set1_ps(highBound(0));
+   __m128 qMinY = _mm_set1_ps(lowBound(1)), qMaxY = _mm_set1_ps(highBound(1));
+   __m128 qMinZ = _mm_set1_ps(lowBound(2)), qMaxZ = _mm_set1_ps(highBound(2));
+
+   for (; simd >= Geom::SIMD_SSE && i + 4 <= end; i += 4) {
+      __m128 hit = _mm_and_ps(
+         _mm_cmple_ps(_mm_loadu_ps(&minX[i]), qMaxX),
+         _mm_cmpge_ps(_mm_loadu_ps(&maxX[i]), qMinX));
+      hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_loadu_ps(&minY[i]), qMaxY));
+      hit = _mm_and_ps(hit, _mm_cmpge_ps(_mm_loadu_ps(&maxY[i]), qMinY));
+      hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_loadu_ps(&minZ[i]), qMaxZ));
+      hit = _mm_and_ps(hit, _mm_cmpge_ps(_mm_loadu_ps(&maxZ[i]), qMinZ));
+      mask |= (unsigned int) _mm_movemask_ps(hit) << (i - start);
+   }
+#endif
+
+   for (; i < end; i++) {
+      if (minX[i] <= highBound(0) && maxX[i] >= lowBound(0) &&
+          minY[i] <= highBound(1) && maxY[i] >= lowBound(1) &&
+          minZ[i] <= highBound(2) && maxZ[i] >= lowBound(2)) {
+         mask |= 1u << (i - start);
+      }
+   }
+
+   return mask;
+}
+
 Cell::Cell(Cell * parent, Eigen::Vector3f lowBound, Eigen::Vector3f highBound) {
    this->parent = parent;
    this->lowBound = lowBound;
@@ -25,67 +200,153 @@ Cell::Cell(Cell * parent, Eigen::Vector3f lowBound, Eigen::Vector3f highBound) {
       (lowBound(1) + highBound(1)) / 2.0f,
       (lowBound(2) + highBound(2)) / 2.0f
    );
+   this->octant = 0;
+   this->childMask = 0;
+   this->pendingIndex = -1;
    this->subcells = std::vector<Cell *>();
    this->objects = std::vector<void *>();
+   this->bounds = NULL;
+   this->cull = NULL;
 }
 
-Cell::~Cell() {}
+Cell::~Cell() {
+   delete(bounds);
+   delete(cull);
+}
+
+void Cell::reset(Cell * parent, const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound) {
+   this->parent = parent;
+   this->lowBound = lowBound;
+   this->highBound = highBound;
+   this->center = (lowBound + highBound) / 2.0f;
+   this->octant = 0;
+   this->childMask = 0;
+   this->pendingIndex = -1;
+   if (this->cull != NULL)
+      *this->cull = CellCullState();
+   this->subcells.clear();
+   this->objects.clear();
+   this->handles.clear();
+   if (this->bounds != NULL)
+      this->bounds->clear();
+}
 
 bool Cell::isLeaf() {
-   return subcells.size() == 0;
-}
-
-// Subdivide cell and move all objects into created subcells
-void Cell::split(ObjectCellIntersectionTest objectInCellTest) {
-   /* Create each octant/subcell */
-   // Octant: (-,-,-) <=> (0,0,0)
-   subcells.push_back(new Cell(
-      this,
-      lowBound,
-      center
-   ));
-   // Octant: (-,-,0) <=> (0,0,+)
-   subcells.push_back(new Cell(
-      this,
-      Eigen::Vector3f(lowBound(0), lowBound(1), center(2)),
-      Eigen::Vector3f(center(0), center(1), highBound(2))
-   ));
-   // Octant: (-,0,-) <=> (0,+,0)
-   subcells.push_back(new Cell(
-      this,
-      Eigen::Vector3f(lowBound(0), center(1), lowBound(2)),
-      Eigen::Vector3f(center(0), highBound(1), center(2))
-   ));
-   // Octant: (-,0,0) <=> (0,+,+)
-   subcells.push_back(new Cell(
-      this,
-      Eigen::Vector3f(lowBound(0), center(1), center(2)),
-      Eigen::Vector3f(center(0), highBound(1), highBound(2))
-   ));
-   // Octant: (0,-,-) <=> (+,0,0)
-   subcells.push_back(new Cell(
-      this,
-      Eigen::Vector3f(center(0), lowBound(1), lowBound(2)),
-      Eigen::Vector3f(highBound(0), center(1), center(2))
-   ));
-   // Octant: (0,-,0) <=> (+,0,+)
-   subcells.push_back(new Cell(
-      this,
-      Eigen::Vector3f(center(0), lowBound(1), center(2)),
-      Eigen::Vector3f(highBound(0), center(1), highBound(2))
-   ));
-   // Octant: (0,0,-) <=> (+,+,0)
-   subcells.push_back(new Cell(
-      this,
-      Eigen::Vector3f(center(0), center(1), lowBound(2)),
-      Eigen::Vector3f(highBound(0), highBound(1), center(2))
-   ));
-   // Octant: (0,0,0) <=> (+,+,+)
-   subcells.push_back(new Cell(
-      this,
-      center,
-      highBound
-   ));
+   return childMask == 0;
+}
+
+// Index of the octant's subcell inside the compact subcells list
+static inline int subcellIndex(unsigned char childMask, int octant) {
+   return __builtin_popcount(childMask & ((1u << octant) - 1));
+}
+
+bool Cell::hasSubcell(int octant) {
+   return (childMask >> octant) & 1;
+}
+
+Cell * Cell::getSubcell(int octant) {
+   if (!hasSubcell(octant))
+      return NULL;
+   return subcells[subcellIndex(childMask, octant)];
+}
+
+// Allocate the subcell for the given octant. The octant must not be occupied yet.
+Cell * Cell::addSubcell(int octant, CellPool * pool) {
+   Eigen::Vector3f low, high;
+   getSubcellBounds(octant, low, high);
+
+   Cell * subcell = pool != NULL ? pool->acquire(this, low, high) : new Cell(this, low, high);
+   subcell->octant = octant;
+   subcells.insert(subcells.begin() + subcellIndex(childMask, octant), subcell);
+   childMask |= (1u << octant);
+   return subcell;
+}
+
+// Make an existing cell the subcell for the given octant. The octant must not be occupied yet.
+void Cell::attachSubcell(int octant, Cell * subcell) {
+   subcell->parent = this;
+   subcell->octant = octant;
+   subcells.insert(subcells.begin() + subcellIndex(childMask, octant), subcell);
+   childMask |= (1u << octant);
+}
+
+// Delete the subcell for the given octant. The subcell must not have any subcells itself.
+void Cell::removeSubcell(int octant, CellPool * pool) {
+   if (!hasSubcell(octant))
+      return ;
+
+   int index = subcellIndex(childMask, octant);
+   if (pool != NULL)
+      pool->release(subcells[index]);
+   else
+      delete(subcells[index]);
+   subcells.erase(subcells.begin() + index);
+   childMask &= ~(1u << octant);
+}
+
+void Cell::getSubcellBounds(int octant, Eigen::Vector3f& low, Eigen::Vector3f& high) {
+   for (int axis = 0; axis < 3; axis++) {
+      bool positive = (octant >> (2 - axis)) & 1;
+      low(axis) = positive ? center(axis) : lowBound(axis);
+      high(axis) = positive ? highBound(axis) : center(axis);
+   }
+}
+
+CellPool::~CellPool() {
+   int numCells = freeCells.size();
+   for (int i = 0; i < numCells; i++) {
+      delete(freeCells[i]);
+   }
+}
+
+Cell * CellPool::acquire(Cell * parent, const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound) {
+   if (freeCells.size() == 0) {
+      return new Cell(parent, lowBound, highBound);
+   }
+
+   Cell * cell = freeCells.back();
+   freeCells.pop_back();
+   cell->reset(parent, lowBound, highBound);
+   return cell;
+}
+
+void CellPool::release(Cell * cell) {
+   freeCells.push_back(cell);
+}
+
+void CellPool::giveTo(CellPool& other, int count) {
+   count = Mmath::min(count, (int) freeCells.size());
+   other.freeCells.insert(other.freeCells.end(), freeCells.end() - count, freeCells.end());
+   freeCells.resize(freeCells.size() - count);
+}
+
+const char * OctreeApiName(OctreeApi api) {
+   static const char * names[NUM_OCTREE_APIS] = {
+      "insert", "remove", "update", "query", "rebuild", "compact", "other"
+   };
+   return api < NUM_OCTREE_APIS ? names[api] : "unknown";
+}
+
+void OctreeCounters::reset() {
+   cellsVisited = 0;
+   objectCellTests = 0;
+   objectObjectTests = 0;
+   splits = 0;
+   collapses = 0;
+   mapRehashes = 0;
+   bytesAllocated = 0;
+   deepestLevel = 0;
+}
+
+void OctreeCounters::add(const OctreeCounters& other) {
+   cellsVisited += other.cellsVisited;
+   objectCellTests += other.objectCellTests;
+   objectObjectTests += other.objectObjectTests;
+   splits += other.splits;
+   collapses += other.collapses;
+   mapRehashes += other.mapRehashes;
+   bytesAllocated += other.bytesAllocated;
+   deepestLevel = std::max(deepestLevel, other.deepestLevel);
 }
 
 Octree::Octree(
@@ -93,216 +354,1870 @@ Octree::Octree(
    Eigen::Vector3f highBound,
    unsigned int maxDepth,
    ObjectCellIntersectionTest objectInCellTest
-) {
+) : traceEvents(DEFAULT_TRACE_CAPACITY) {
    rootCell = new Cell(NULL, lowBound, highBound);
+   overflowCell = new Cell(NULL, lowBound, highBound);
    this->maxDepth = maxDepth;
    this->objectInCellTest = objectInCellTest;
-   cellMap = CellMap();
+   this->objectBounds = NULL;
+   this->looseness = 1.0f;
+   this->objectContainedTest = NULL;
+   this->objectOctantsTest = NULL;
+   this->leafCapacity = 0;
+   this->currentApi = API_OTHER;
+   this->traceStart = std::chrono::steady_clock::now();
+   this->rebuildThreads = std::thread::hardware_concurrency();
+   this->autoGrow = false;
+   this->keepOverflow = false;
+   this->deferCollapse = false;
+   this->autoCompactThreshold = 0;
+   handleMap = HandleMap();
 }
 
 Octree::~Octree() {
+   clearCellRecursive(rootCell);
+   delete(rootCell);
+   delete(overflowCell);
+}
 
+OctreeCounterStats Octree::getCounterStats() const {
+   OctreeCounterStats stats;
+   for (int api = 0; api < NUM_OCTREE_APIS; api++) {
+      stats.perApi[api] = apiCounters[api];
+      stats.total.add(apiCounters[api]);
+   }
+   return stats;
 }
 
+void Octree::resetCounters() {
+   for (int api = 0; api < NUM_OCTREE_APIS; api++) {
+      apiCounters[api].reset();
+   }
+}
 
-// Add the specified cell to the object's list of cell references in cellMap
-void Octree::addCellToMap(void * object, Cell * cell) {
-   CellMap::iterator it = cellMap.find(object);
-   if (it == cellMap.end()) {
-      // printf("adding cell to map for first time, cell = %p\n", cell);
-      CellList cells = CellList();
-      cells.push_back(cell);
-      cellMap.insert(ObjectCellPair(object, cells));
-   } else {
-      // printf("adding cell to map (not first time), cell = %p\n", cell);
-      it->second.push_back(cell);
-   }
-}
-
-// Recursive helper function that adds the object to each leafcell that will contain it.
-// Also splits any leaf cell that will contain the object and will have more than max objects in it
-void Octree::insertHelper(void * object, Cell * cell, int lvl) {
-   if (objectInCellTest(object, cell)) {
-      if (cell->isLeaf()) {   // Is a leaf cell
-         if (lvl == maxDepth) { // This cell is at max depth
-            // So, add the object to the cell and be done with this recursion
-            cell->objects.push_back(object);
-            addCellToMap(object, cell);
-         } else { // this cell can be split since not at max depth
-            // So, split the cell and recurse one more time
-            cell->split(objectInCellTest);
-            for (int i = 0; i < 8; i++) {
-               insertHelper(object, cell->subcells[i], lvl+1);
-            }
-         }
-      } else {                // Is not a leaf cell
-         // So, keep recursing
-         for (int i = 0; i < 8; i++) {
-            insertHelper(object, cell->subcells[i], lvl+1);
-         }
-      }
+const LatencyHistogram& Octree::getLatencyHistogram(OctreeApi api) const {
+   return latencies[api];
+}
+
+const TraceRing& Octree::getTraceEvents() const {
+   return traceEvents;
+}
+
+void Octree::setTraceCapacity(unsigned int capacity) {
+   traceEvents.setCapacity(capacity);
+}
+
+bool Octree::writeChromeTrace(const char * fileName) {
+   FILE * file = fopen(fileName, "w");
+   if (file == NULL) {
+      fprintf(stderr, "Octree::writeChromeTrace WARNING: could not open %s.\n", fileName);
+      return false;
    }
+
+   bool written = traceEvents.writeChromeTrace(file);
+   return fclose(file) == 0 && written;
+}
+
+void Octree::resetTrace() {
+   for (int api = 0; api < NUM_OCTREE_APIS; api++) {
+      latencies[api].reset();
+   }
+   traceEvents.clear();
+   traceStart = std::chrono::steady_clock::now();
+}
+
+void Octree::beginApi(OctreeApi api) {
+   currentApi = api;
+   callCounters.reset();
+#ifdef OCTREE_TRACE
+   callStart = std::chrono::steady_clock::now();
+#endif
+}
+
+void Octree::endApi() {
+#ifdef OCTREE_TRACE
+   std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+   TraceEvent event;
+   event.name = OctreeApiName((OctreeApi) currentApi);
+   event.startNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(callStart - traceStart).count();
+   event.durationNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(end - callStart).count();
+   event.depth = callCounters.deepestLevel;
+   event.cellsTouched = callCounters.cellsVisited;
+   latencies[currentApi].record(event.durationNanos);
+   traceEvents.push(event);
+#endif
+   apiCounters[currentApi].add(callCounters);
+   currentApi = API_OTHER;
+}
+
+// Counters of the API call currently running
+OctreeCounters * Octree::counters() {
+   return currentApi == API_OTHER ? &apiCounters[API_OTHER] : &callCounters;
+}
+
+// Context for inserting straight into the tree from the calling thread
+BuildContext Octree::serialContext() {
+   return BuildContext(&cellPool, NULL, counters());
+}
+
+Cell * Octree::newSubcell(Cell * cell, int octant, BuildContext& context) {
+   OCTREE_COUNT(context.counters, splits, 1);
+   OCTREE_COUNT(context.counters, bytesAllocated, context.pool->freeCells.size() == 0 ? sizeof(Cell) : 0);
+   return cell->addSubcell(octant, context.pool);
+}
+
+void Octree::deleteSubcell(Cell * cell, int octant, OctreeCounters * counters) {
+   OCTREE_COUNT(counters, collapses, 1);
+   cell->removeSubcell(octant, &cellPool);
 }
 
-void Octree::insert(void * object) {
-   insertHelper(object, rootCell, 0);
+#define HANDLE_MAP_MIN_SLOTS 16
+
+HandleMap::HandleMap() {
+   clear();
+}
+
+// Fibonacci hashing: the top bits of the pointer times 2^64 / phi
+size_t HandleMap::homeSlot(void * object) const {
+   return (size_t) (((unsigned long long) (uintptr_t) object * 0x9E3779B97F4A7C15ULL) >> shift);
+}
+
+ObjectHandle HandleMap::find(void * object) const {
+   size_t mask = slots.size() - 1;
+   for (size_t i = homeSlot(object); slots[i].handle != INVALID_HANDLE; i = (i + 1) & mask) {
+      if (slots[i].object == object)
+         return slots[i].handle;
+   }
+   return INVALID_HANDLE;
+}
+
+bool HandleMap::insert(void * object, ObjectHandle handle) {
+   bool grew = false;
+   if ((count + 1) * 2 > slots.size()) {
+      grow();
+      grew = true;
+   }
+
+   size_t mask = slots.size() - 1;
+   size_t i = homeSlot(object);
+   while (slots[i].handle != INVALID_HANDLE && slots[i].object != object) {
+      i = (i + 1) & mask;
+   }
+   if (slots[i].handle == INVALID_HANDLE)
+      count++;
+   slots[i].object = object;
+   slots[i].handle = handle;
+   return grew;
 }
 
-void Octree::removeSubcellsAndClimbIfEmpty(Cell * cell) {
-   // Check to see if we can delete further cells higher up
-   for (int i = 0; i < 8; i++) {
-      if (!cell->subcells[i]->isLeaf() || cell->subcells[i]->objects.size() > 0) {
-         return ;
+// Moves later entries of the probe run back into the hole, so lookups never need tombstones
+void HandleMap::erase(void * object) {
+   size_t mask = slots.size() - 1;
+   size_t hole = homeSlot(object);
+   while (slots[hole].object != object || slots[hole].handle == INVALID_HANDLE) {
+      if (slots[hole].handle == INVALID_HANDLE)
+         return;
+      hole = (hole + 1) & mask;
+   }
+
+   for (size_t i = (hole + 1) & mask; slots[i].handle != INVALID_HANDLE; i = (i + 1) & mask) {
+      // An entry can fill the hole if its home isn't cyclically between the hole and it
+      size_t home = homeSlot(slots[i].object);
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+         slots[hole] = slots[i];
+         hole = i;
       }
    }
+   slots[hole].handle = INVALID_HANDLE;
+   count--;
+}
+
+void HandleMap::clear() {
+   Slot empty;
+   empty.object = NULL;
+   empty.handle = INVALID_HANDLE;
+   slots.assign(HANDLE_MAP_MIN_SLOTS, empty);
+   count = 0;
+   shift = 64 - __builtin_ctzll(HANDLE_MAP_MIN_SLOTS);
+}
+
+size_t HandleMap::size() const {
+   return count;
+}
+
+size_t HandleMap::capacity() const {
+   return slots.size();
+}
+
+void HandleMap::grow() {
+   std::vector<Slot> old;
+   old.swap(slots);
+   Slot empty;
+   empty.object = NULL;
+   empty.handle = INVALID_HANDLE;
+   slots.assign(old.size() * 2, empty);
+   shift--;
+   count = 0;
+
+   size_t numOld = old.size();
+   for (size_t i = 0; i < numOld; i++) {
+      if (old[i].handle != INVALID_HANDLE)
+         insert(old[i].object, old[i].handle);
+   }
+}
 
-   // Will only get here if no subcells contain an object and all subcells are not leaves
-   for (int i = 0; i < 8; i++) {
-      delete(cell->subcells[i]);
+// Registers the object and returns its handle, reusing the slot of a removed object if possible
+ObjectHandle Octree::createHandle(void * object) {
+   ObjectHandle handle;
+   if (freeHandles.size() > 0) {
+      handle = freeHandles.back();
+      freeHandles.pop_back();
+   } else {
+      handle = objectEntries.size();
+#ifdef OCTREE_STATS
+      size_t capacity = objectEntries.capacity();
+#endif
+      objectEntries.push_back(ObjectEntry());
+      OCTREE_COUNT(counters(), bytesAllocated, (objectEntries.capacity() - capacity) * sizeof(ObjectEntry));
    }
-   cell->subcells.clear();
 
-   // Keep recursing if we're not at the root yet
-   if (cell->parent != NULL) {
-      removeSubcellsAndClimbIfEmpty(cell->parent);
+   ObjectEntry& entry = objectEntries[handle];
+   entry.object = object;
+   entry.cells.clear();
+   entry.used = true;
+
+   if (handleMap.insert(object, handle)) {
+      OCTREE_COUNT(counters(), mapRehashes, 1);
+      OCTREE_COUNT(counters(), bytesAllocated, handleMap.capacity() * (sizeof(void *) + sizeof(ObjectHandle)));
    }
+   return handle;
 }
 
-void Octree::remove(void * specObj) {
-   CellMap::iterator cellIt = cellMap.find(specObj);
-   if (cellIt == cellMap.end()) {
-      fprintf(stderr, "Octree::removeObjectFromCells WARNING: the specified object was not found in the tree.\n");
-      return ;
+void Octree::destroyHandle(ObjectHandle handle) {
+   ObjectEntry& entry = objectEntries[handle];
+   handleMap.erase(entry.object);
+   entry.object = NULL;
+   entry.cells.clear();
+   entry.used = false;
+   freeHandles.push_back(handle);
+}
+
+bool Octree::isValidHandle(ObjectHandle handle) const {
+   return handle < objectEntries.size() && objectEntries[handle].used;
+}
+
+ObjectHandle Octree::getHandle(void * object) const {
+   return handleMap.find(object);
+}
+
+void * Octree::getObject(ObjectHandle handle) const {
+   return isValidHandle(handle) ? objectEntries[handle].object : NULL;
+}
+
+// Appends the object to the cell and returns the slot it was put in
+int Octree::addObjectToCell(ObjectHandle handle, Cell * cell, OctreeCounters * counters) {
+   void * object = objectEntries[handle].object;
+#ifdef OCTREE_STATS
+   size_t capacity = cell->objects.capacity();
+#endif
+   cell->objects.push_back(object);
+   cell->handles.push_back(handle);
+   if (objectBounds != NULL) {
+      if (cell->bounds == NULL) {
+         cell->bounds = new BoundsList();
+         OCTREE_COUNT(counters, bytesAllocated, sizeof(BoundsList));
+      }
+      Eigen::Vector3f low, high;
+      objectBounds(object, low, high);
+      cell->bounds->push(low, high);
    }
 
-   CellList& cells = cellIt->second;
-   int numCells = cells.size();
-   for (int i = 0; i < numCells; i++) {
-      Cell * cell = cells[i];
+#ifdef OCTREE_STATS
+   // Each slot costs a pointer, a handle and, with bounds, six floats
+   size_t slotBytes = sizeof(void *) + sizeof(ObjectHandle) + (objectBounds != NULL ? 6 * sizeof(float) : 0);
+   OCTREE_COUNT(counters, bytesAllocated, (cell->objects.capacity() - capacity) * slotBytes);
+#endif
+   return cell->objects.size() - 1;
+}
 
-      ObjectList& objs = cell->objects;
-      objs.erase(std::remove(objs.begin(), objs.end(), specObj), objs.end());
+// Removes the object in the given slot by moving the cell's last object into it,
+// then points the moved object's reference to this cell at its new slot
+void Octree::removeObjectFromCell(int slot, Cell * cell) {
+   int last = cell->objects.size() - 1;
+   if (slot != last) {
+      ObjectHandle moved = cell->handles[last];
+      cell->objects[slot] = cell->objects[last];
+      cell->handles[slot] = moved;
 
-      if (cell->parent) {
-         removeSubcellsAndClimbIfEmpty(cell->parent);
+      CellList& movedCells = objectEntries[moved].cells;
+      int numCells = movedCells.size();
+      for (int i = 0; i < numCells; i++) {
+         if (movedCells[i].cell == cell) {
+            movedCells[i].slot = slot;
+            break;
+         }
       }
    }
 
-   cellMap.erase(specObj);
+   if (objectBounds != NULL) {
+      cell->bounds->swapRemove(slot);
+   }
+   cell->objects.pop_back();
+   cell->handles.pop_back();
 }
 
-void Octree::update(void * specObj) {
-   remove(specObj);
-   insert(specObj);
+// Without a bounds function the cell's list is freed, and with one it is only made for
+// cells that hold objects
+void Octree::fillBoundsRecursive(Cell * cell) {
+   int numObjects = cell->objects.size();
+   if (objectBounds == NULL) {
+      delete(cell->bounds);
+      cell->bounds = NULL;
+   } else if (numObjects > 0 || cell->bounds != NULL) {
+      if (cell->bounds == NULL)
+         cell->bounds = new BoundsList();
+      cell->bounds->clear();
+      for (int i = 0; i < numObjects; i++) {
+         Eigen::Vector3f low, high;
+         objectBounds(cell->objects[i], low, high);
+         cell->bounds->push(low, high);
+      }
+   }
+
+   int numSubcells = cell->subcells.size();
+   for (int i = 0; i < numSubcells; i++) {
+      fillBoundsRecursive(cell->subcells[i]);
+   }
 }
 
-void Octree::clearCellRecursive(Cell * cell) {
-   if (!cell->isLeaf()) {
-      for (int i = 0; i < 8; i++) {
-         clearCellRecursive(cell->subcells[i]);
+// Bytes of the cell itself, its subcell list and its cull state
+static size_t cellOwnBytes(Cell * cell) {
+   return sizeof(Cell) + cell->subcells.capacity() * sizeof(Cell *) +
+          (cell->cull != NULL ? sizeof(CellCullState) : 0);
+}
+
+// Bytes a cell's lists have allocated for objects
+static size_t cellObjectListBytes(Cell * cell) {
+   return cell->objects.capacity() * sizeof(void *) +
+          cell->handles.capacity() * sizeof(ObjectHandle) +
+          (cell->bounds != NULL ? sizeof(BoundsList) + cell->bounds->heapBytes() : 0);
+}
+
+void Octree::statsRecursive(Cell * cell, int depth, OctreeStats& stats) const {
+   if ((int) stats.cellsPerDepth.size() <= depth)
+      stats.cellsPerDepth.resize(depth + 1, 0);
+   stats.cellsPerDepth[depth]++;
+   stats.numCells++;
+   stats.cellBytes += cellOwnBytes(cell);
+   stats.objectListBytes += cellObjectListBytes(cell);
+
+   if (cell->isLeaf()) {
+      int numObjects = cell->objects.size();
+      if ((int) stats.leafOccupancy.size() <= numObjects)
+         stats.leafOccupancy.resize(numObjects + 1, 0);
+      stats.leafOccupancy[numObjects]++;
+      stats.numLeaves++;
+      if (numObjects == 0)
+         stats.emptyLeaves++;
+   }
+
+   int numSubcells = cell->subcells.size();
+   for (int i = 0; i < numSubcells; i++) {
+      statsRecursive(cell->subcells[i], depth + 1, stats);
+   }
+}
+
+OctreeStats Octree::stats() const {
+   OctreeStats stats;
+   stats.numCells = 0;
+   stats.numLeaves = 0;
+   stats.emptyLeaves = 0;
+   stats.cellBytes = 0;
+   stats.objectListBytes = 0;
+   statsRecursive(rootCell, 0, stats);
+
+   // The overflow cell isn't part of the tree, but its memory is
+   stats.cellBytes += sizeof(Cell);
+   stats.objectListBytes += cellObjectListBytes(overflowCell);
+   stats.numPooledCells = cellPool.freeCells.size();
+   for (int i = 0; i < stats.numPooledCells; i++) {
+      Cell * cell = cellPool.freeCells[i];
+      stats.cellBytes += cellOwnBytes(cell);
+      stats.objectListBytes += cellObjectListBytes(cell);
+   }
+   stats.cellBytes += cellPool.freeCells.capacity() * sizeof(Cell *);
+
+   stats.numObjects = 0;
+   stats.numOverflowObjects = overflowCell->objects.size();
+   stats.maxCellsPerObject = 0;
+   stats.registryBytes = objectEntries.capacity() * sizeof(ObjectEntry) + freeHandles.capacity() * sizeof(ObjectHandle);
+   int numPlaced = 0;
+   int numCellRefs = 0;
+   int numEntries = objectEntries.size();
+   for (int i = 0; i < numEntries; i++) {
+      const ObjectEntry& entry = objectEntries[i];
+      stats.registryBytes += entry.cells.heapBytes();
+      if (!entry.used)
+         continue;
+
+      stats.numObjects++;
+      int numCells = entry.cells.size();
+      if (numCells > 0 && entry.cells[0].cell != overflowCell) {
+         numPlaced++;
+         numCellRefs += numCells;
+         stats.maxCellsPerObject = std::max(stats.maxCellsPerObject, numCells);
       }
    }
-   if (cell != rootCell) {
-      delete(cell);
+   stats.averageCellsPerObject = numPlaced > 0 ? (float) numCellRefs / numPlaced : 0.0f;
+
+   stats.mapBytes = handleMap.capacity() * (sizeof(void *) + sizeof(ObjectHandle));
+
+   stats.totalBytes = stats.cellBytes + stats.objectListBytes + stats.registryBytes + stats.mapBytes;
+   return stats;
+}
+
+void Octree::setObjectBoundsFunction(ObjectBoundsFunction objectBounds) {
+   this->objectBounds = objectBounds;
+   fillBoundsRecursive(rootCell);
+   fillBoundsRecursive(overflowCell);
+   if (objectBounds == NULL) {
+      // Pooled cells would otherwise bring their unused lists back into the tree
+      int numPooled = cellPool.freeCells.size();
+      for (int i = 0; i < numPooled; i++) {
+         fillBoundsRecursive(cellPool.freeCells[i]);
+      }
    }
 }
 
-void Octree::clear() {
-   clearCellRecursive(rootCell);
-   rootCell->subcells.clear();
-   rootCell->objects.clear();
-   cellMap.clear();
+// Recursive helper function that adds the object to each max depth cell that will contain it.
+// The cell has already passed objectInCellTest. Subcells are only created for the octants
+// the object actually touches, so untouched space never gets allocated.
+// If the context has refs, the cell references are put there instead of in the object's entry,
+// which lets several threads fill separate subtrees at once.
+// With a leaf capacity, objects stay in leaves above max depth until a leaf gets too full.
+void Octree::placeInCell(ObjectHandle handle, Cell * cell, BuildContext& context) {
+   int slot = addObjectToCell(handle, cell, context.counters);
+   if (context.refs != NULL)
+      context.refs->push_back(PendingCellRef(handle, CellRef(cell, slot)));
+   else
+      objectEntries[handle].cells.push_back(CellRef(cell, slot));
 }
 
-void Octree::resetWithBounds(Eigen::Vector3f lowBound, Eigen::Vector3f highBound) {
-   clearCellRecursive(rootCell);
-   rootCell->subcells.clear();
-   rootCell->objects.clear();
+void Octree::insertHelper(ObjectHandle handle, Cell * cell, unsigned int lvl, BuildContext& context) {
+   OCTREE_COUNT(context.counters, cellsVisited, 1);
+   OCTREE_COUNT_DEPTH(context.counters, lvl);
+   bool keepHere = lvl == maxDepth ||
+                   (leafCapacity > 0 && cell->isLeaf() && cell->objects.size() < leafCapacity);
 
-   rootCell->lowBound = lowBound;
-   rootCell->highBound = highBound;
-   rootCell->center = Eigen::Vector3f(
-      (lowBound(0) + highBound(0)) / 2.0f,
-      (lowBound(1) + highBound(1)) / 2.0f,
-      (lowBound(2) + highBound(2)) / 2.0f
-   );
+   if (keepHere) { // This cell is at max depth, or is a leaf with room left
+      // So, add the object to the cell and be done with this recursion
+      placeInCell(handle, cell, context);
+      return ;
+   }
 
-   for (CellMap::iterator it = cellMap.begin(); it != cellMap.end(); it++) {
-      it->second.clear();
-      insert(it->first);
+   if (cell->isLeaf() && cell->objects.size() > 0) {
+      splitFullLeaf(cell, lvl, context);
    }
+   insertIntoSubcells(handle, cell, lvl, context);
 }
 
-bool Octree::testIntersectionOutsideHelper(
-   void * specObj,
-   Cell * cell,
-   ObjectCellIntersectionTest objCellTest,
-   ObjectObjectIntersectionTest objObjTest,
-   ObjectList * collisions
-) {
-   bool hasCollision = false;
+// With an octants test, all eight subcells are tested in one call up front
+void Octree::insertIntoSubcells(ObjectHandle handle, Cell * cell, unsigned int lvl, BuildContext& context) {
+   void * object = objectEntries[handle].object;
+   bool batched = objectOctantsTest != NULL;
+   unsigned int touched = 0xFF;
+   if (batched) {
+      OCTREE_COUNT(context.counters, objectCellTests, 1);
+      touched = objectOctantsTest(object, cell);
+   }
 
-   if (objCellTest(specObj, rootCell)) {
-      if (cell->isLeaf()) {
-         int numObjects = cell->objects.size();
-         for (int i = 0; i < numObjects; i++) {
-            void * obj = cell->objects[i];
-            if (obj != specObj && objObjTest(specObj, obj)) {
-               if (collisions != NULL) {
-                  collisions->push_back(obj);
-               }
-               hasCollision = true;
-            }
+   for (int octant = 0; octant < 8; octant++) {
+      if (!((touched >> octant) & 1))
+         continue;
+
+      Cell * subcell = cell->getSubcell(octant);
+      if (subcell != NULL) {
+         if (!batched) {
+            OCTREE_COUNT(context.counters, objectCellTests, 1);
+            if (!objectInCellTest(object, subcell))
+               continue;
          }
+         insertHelper(handle, subcell, lvl+1, context);
       } else {
-         for (int i = 0; i < 8; i++) {
-            hasCollision |= testIntersectionOutsideHelper(specObj, cell->subcells[i], objCellTest, objObjTest, collisions);
+         if (!batched) {
+            // Test against a temporary cell so nothing is allocated unless the object lands there
+            Eigen::Vector3f low, high;
+            cell->getSubcellBounds(octant, low, high);
+            Cell probe(cell, low, high);
+            OCTREE_COUNT(context.counters, objectCellTests, 1);
+            if (!objectInCellTest(object, &probe))
+               continue;
+         }
+         subcell = newSubcell(cell, octant, context);
+         insertHelper(handle, subcell, lvl+1, context);
+         if (subcell->isLeaf() && subcell->objects.size() == 0) {
+            OCTREE_COUNT(context.counters, collapses, 1);
+            cell->removeSubcell(octant, context.pool);
          }
       }
    }
+}
 
-   return hasCollision;
+// Moves every object of a full leaf into its subcells
+void Octree::splitFullLeaf(Cell * cell, unsigned int lvl, BuildContext& context) {
+   std::vector<ObjectHandle> moved(cell->handles);
+
+   // Taking objects off the end never moves another object's slot
+   while (cell->objects.size() > 0) {
+      CellList& cells = objectEntries[cell->handles.back()].cells;
+      int numCells = cells.size();
+      for (int i = 0; i < numCells; i++) {
+         if (cells[i].cell == cell) {
+            cells.swapRemove(i);
+            break;
+         }
+      }
+      removeObjectFromCell(cell->objects.size() - 1, cell);
+   }
+
+   int numMoved = moved.size();
+   for (int i = 0; i < numMoved; i++) {
+      insertIntoSubcells(moved[i], cell, lvl, context);
+   }
 }
 
-bool Octree::testIntersectionInside(
-   void * specObj,
-   ObjectObjectIntersectionTest objObjTest,
-   ObjectList * collisions
-) {
-   CellMap::iterator it = cellMap.find(specObj);
-   if (it == cellMap.end()) {
-      fprintf(stderr, "Octree::testIntersectionInside WARNING: the specified object was not found in the tree.\n");
-      return false;
+void Octree::setLeafCapacity(unsigned int leafCapacity) {
+   this->leafCapacity = leafCapacity;
+   resetWithBounds(rootCell->lowBound, rootCell->highBound);
+}
+
+FitReport Octree::fitToObjects(const FitParams& params) {
+   OCTREE_API(API_REBUILD);
+   FitReport report;
+   report.lowBound = rootCell->lowBound;
+   report.highBound = rootCell->highBound;
+   report.maxDepth = maxDepth;
+   report.leafCapacity = leafCapacity;
+   report.medianObjectSize = 0.0f;
+   report.minCellSize = 0.0f;
+   report.numObjects = 0;
+
+   if (objectBounds == NULL) {
+      fprintf(stderr, "Octree::fitToObjects WARNING: needs an ObjectBoundsFunction.\n");
+      return report;
    }
 
-   CellList& cells = it->second;
-   bool hasCollision = false;
+   Eigen::Vector3f low( INFINITY,  INFINITY,  INFINITY);
+   Eigen::Vector3f high(-INFINITY, -INFINITY, -INFINITY);
+   std::vector<float> sizes;
 
-   int numCells = cells.size();
-   for (int i = 0; i < numCells; i++) {
-      Cell * cell = cells[i];
-      int numObjs = cell->objects.size();
-      for (int j = 0; j < numObjs; j++) {
-         void * obj = cell->objects[j];
-         if (obj != specObj && objObjTest(specObj, obj)) {
-            if (collisions != NULL) {
-               collisions->push_back(obj);
-            }
-            hasCollision = true;
-         }
+   int numEntries = objectEntries.size();
+   for (int i = 0; i < numEntries; i++) {
+      if (objectEntries[i].used) {
+         Eigen::Vector3f objLow, objHigh;
+         objectBounds(objectEntries[i].object, objLow, objHigh);
+         low = low.cwiseMin(objLow);
+         high = high.cwiseMax(objHigh);
+         sizes.push_back((objHigh - objLow).maxCoeff());
       }
    }
 
-   return hasCollision;
+   report.numObjects = sizes.size();
+   if (sizes.size() == 0) {
+      return report;
+   }
+
+   std::nth_element(sizes.begin(), sizes.begin() + sizes.size() / 2, sizes.end());
+   report.medianObjectSize = sizes[sizes.size() / 2];
+
+   // Pad flat or point-like data so the root still has some volume
+   Eigen::Vector3f padding = (high - low) * params.padding;
+   for (int axis = 0; axis < 3; axis++) {
+      padding(axis) = Mmath::max(padding(axis), 1e-4f * Mmath::max(1.0f, fabsf(low(axis))));
+   }
+   low -= padding;
+   high += padding;
+
+   // Max depth cells shouldn't get much smaller than the objects they hold
+   report.minCellSize = params.minCellSizeRatio * report.medianObjectSize;
+   float cellSize = (high - low).maxCoeff();
+   unsigned int depth = 0;
+   while (depth < params.maxDepthLimit && cellSize / 2.0f >= report.minCellSize) {
+      cellSize /= 2.0f;
+      depth++;
+   }
+
+   report.lowBound = low;
+   report.highBound = high;
+   report.maxDepth = depth;
+   report.leafCapacity = params.targetObjectsPerLeaf;
+
+   maxDepth = depth;
+   leafCapacity = params.targetObjectsPerLeaf;
+   resetWithBounds(low, high);
+   return report;
 }
 
-bool Octree::testIntersectionOutside(
-   void * obj,
-   ObjectCellIntersectionTest objCellTest,
-   ObjectObjectIntersectionTest objObjTest,
-   ObjectList * collisions
-) {
-   return testIntersectionOutsideHelper(obj, rootCell, objCellTest, objObjTest, collisions);
+// Adds a registered object to every cell it belongs in, growing the root or putting the
+// object in the overflow list if it lies outside the tree and that is turned on.
+// Returns false if the object doesn't belong anywhere in the tree
+bool Octree::placeObject(ObjectHandle handle) {
+   if (placeObjectInTree(handle)) {
+      return true;
+   }
+
+   if (autoGrow) {
+      for (int i = 0; i < MAX_ROOT_GROWTH && growRootToward(objectEntries[handle].object); i++) {
+         if (placeObjectInTree(handle)) {
+            return true;
+         }
+      }
+   }
+
+   if (keepOverflow) {
+      int slot = addObjectToCell(handle, overflowCell, counters());
+      objectEntries[handle].cells.push_back(CellRef(overflowCell, slot));
+      return true;
+   }
+
+   return false;
+}
+
+bool Octree::placeObjectInTree(ObjectHandle handle) {
+   if (isLoose()) {
+      return placeObjectLoose(handle);
+   }
+   if (objectContainedTest != NULL) {
+      return placeObjectEnclosing(handle);
+   }
+
+   OCTREE_COUNT(counters(), objectCellTests, 1);
+   if (objectInCellTest(objectEntries[handle].object, rootCell)) {
+      BuildContext context = serialContext();
+      insertHelper(handle, rootCell, 0, context);
+      return true;
+   }
+   return false;
+}
+
+// Replaces the root with a cell twice its size that holds the old root as one of its
+// octants, picking the octant so the new root reaches toward the object. The rest of the
+// tree is kept as is. Returns false if the new root would pass the growth limits.
+bool Octree::growRootToward(void * object) {
+   int rootOctant = -1;
+
+   if (objectBounds != NULL) {
+      // The old root goes on the side facing away from the object
+      Eigen::Vector3f low, high;
+      objectBounds(object, low, high);
+      Eigen::Vector3f center = (low + high) / 2.0f;
+      rootOctant = (center(0) < rootCell->center(0) ? 4 : 0) |
+                   (center(1) < rootCell->center(1) ? 2 : 0) |
+                   (center(2) < rootCell->center(2) ? 1 : 0);
+   } else {
+      // Without bounds, look for a new root that touches the object
+      for (int octant = 0; octant < 8 && rootOctant < 0; octant++) {
+         Eigen::Vector3f low, high;
+         getGrownRootBounds(octant, low, high);
+         Cell probe(NULL, low, high);
+         OCTREE_COUNT(counters(), objectCellTests, 1);
+         if (objectInCellTest(object, &probe))
+            rootOctant = octant;
+      }
+      // Nothing touches it yet, so grow toward the side with more room before the limits
+      if (rootOctant < 0)
+         rootOctant = rootCell->lowBound(0) - growLowLimit(0) < growHighLimit(0) - rootCell->highBound(0) ? 0 : 7;
+   }
+
+   Eigen::Vector3f low, high;
+   getGrownRootBounds(rootOctant, low, high);
+   for (int axis = 0; axis < 3; axis++) {
+      if (low(axis) < growLowLimit(axis) || high(axis) > growHighLimit(axis))
+         return false;
+   }
+
+   Eigen::Vector3f oldLow = rootCell->lowBound, oldHigh = rootCell->highBound;
+   Cell * newRoot = new Cell(NULL, low, high);
+   OCTREE_COUNT(counters(), splits, 1);
+   OCTREE_COUNT(counters(), bytesAllocated, sizeof(Cell));
+   newRoot->attachSubcell(rootOctant, rootCell);
+   rootCell = newRoot;
+   maxDepth++;  // Keeps the max depth cells the same size
+   replaceStraddlers(oldLow, oldHigh);
+   return true;
+}
+
+// Objects that stuck out of the old root were only placed in it (or in its cells they
+// touch), so queries of the new space around it would miss them. They are placed again
+// from the new root. Needs the containment test or the bounds to tell which objects stick
+// out; without either, objects partly outside the tree stay where they are.
+void Octree::replaceStraddlers(const Eigen::Vector3f& oldLow, const Eigen::Vector3f& oldHigh) {
+   if (objectContainedTest == NULL && objectBounds == NULL)
+      return;
+
+   Cell oldRoot(NULL, oldLow, oldHigh);
+   float scale = isLoose() ? looseness : 1.0f;
+   Eigen::Vector3f halfSize = (oldHigh - oldLow) * (scale / 2.0f);
+   Eigen::Vector3f boxLow = oldRoot.center - halfSize, boxHigh = oldRoot.center + halfSize;
+
+   std::vector<ObjectHandle> straddlers;
+   int numEntries = objectEntries.size();
+   for (int i = 0; i < numEntries; i++) {
+      ObjectEntry& entry = objectEntries[i];
+      if (!entry.used || entry.cells.size() == 0 || entry.cells[0].cell == overflowCell)
+         continue;
+
+      bool inside;
+      OCTREE_COUNT(counters(), objectCellTests, 1);
+      if (objectContainedTest != NULL && !isLoose()) {
+         inside = objectContainedTest(entry.object, &oldRoot);
+      } else {
+         Eigen::Vector3f low, high;
+         objectBounds(entry.object, low, high);
+         inside = (low.array() >= boxLow.array()).all() && (high.array() <= boxHigh.array()).all();
+      }
+      if (!inside)
+         straddlers.push_back(i);
+   }
+
+   int numStraddlers = straddlers.size();
+   for (int i = 0; i < numStraddlers; i++) {
+      unplaceObject(straddlers[i]);
+      placeObjectInTree(straddlers[i]);
+   }
+}
+
+// Bounds of a root twice the current size that has the current root in the given octant
+void Octree::getGrownRootBounds(int rootOctant, Eigen::Vector3f& low, Eigen::Vector3f& high) {
+   Eigen::Vector3f size = rootCell->highBound - rootCell->lowBound;
+   for (int axis = 0; axis < 3; axis++) {
+      bool positive = (rootOctant >> (2 - axis)) & 1;
+      low(axis) = positive ? rootCell->lowBound(axis) - size(axis) : rootCell->lowBound(axis);
+      high(axis) = positive ? rootCell->highBound(axis) : rootCell->highBound(axis) + size(axis);
+   }
+}
+
+void Octree::setAutoGrow(bool autoGrow, Eigen::Vector3f lowLimit, Eigen::Vector3f highLimit) {
+   this->autoGrow = autoGrow;
+   this->growLowLimit = lowLimit;
+   this->growHighLimit = highLimit;
+}
+
+void Octree::setKeepOverflow(bool keepOverflow) {
+   this->keepOverflow = keepOverflow;
+}
+
+ObjectList& Octree::getOverflowObjects() {
+   return overflowCell->objects;
+}
+
+bool Octree::isLoose() {
+   return looseness > 1.0f && objectBounds != NULL;
+}
+
+// Puts the object in the deepest cell whose loose bounds are sure to contain it:
+// the cell holding its center, at the depth where the cell's slack still covers its size
+bool Octree::placeObjectLoose(ObjectHandle handle) {
+   Eigen::Vector3f low, high;
+   objectBounds(objectEntries[handle].object, low, high);
+   Eigen::Vector3f center = (low + high) / 2.0f;
+   float radius = ((high - low) / 2.0f).maxCoeff();
+
+   for (int axis = 0; axis < 3; axis++) {
+      if (center(axis) < rootCell->lowBound(axis) || center(axis) > rootCell->highBound(axis))
+         return false;
+   }
+
+   // The loose bounds stick out (looseness - 1) * halfSize past the cell on every side
+   float slack = (looseness - 1.0f) * ((rootCell->highBound - rootCell->lowBound) / 2.0f).minCoeff();
+   BuildContext context = serialContext();
+   Cell * cell = rootCell;
+   for (unsigned int lvl = 0; lvl < maxDepth && radius <= slack / 2.0f; lvl++) {
+      int octant = (center(0) >= cell->center(0) ? 4 : 0) |
+                   (center(1) >= cell->center(1) ? 2 : 0) |
+                   (center(2) >= cell->center(2) ? 1 : 0);
+      Cell * subcell = cell->getSubcell(octant);
+      cell = subcell != NULL ? subcell : newSubcell(cell, octant, context);
+      slack /= 2.0f;
+      OCTREE_COUNT(context.counters, cellsVisited, 1);
+      OCTREE_COUNT_DEPTH(context.counters, lvl + 1);
+   }
+
+   int slot = addObjectToCell(handle, cell, context.counters);
+   objectEntries[handle].cells.push_back(CellRef(cell, slot));
+   return true;
+}
+
+// Puts the object in the deepest cell that fully contains it. Objects that stick out of the
+// root but still touch it are stored in the root.
+bool Octree::placeObjectEnclosing(ObjectHandle handle) {
+   void * object = objectEntries[handle].object;
+   OCTREE_COUNT(counters(), objectCellTests, 1);
+   if (!objectInCellTest(object, rootCell)) {
+      return false;
+   }
+
+   BuildContext context = serialContext();
+   Cell * cell = rootCell;
+   for (unsigned int lvl = 0; lvl < maxDepth; lvl++) {
+      Cell * next = NULL;
+      OCTREE_COUNT(context.counters, cellsVisited, 1);
+      OCTREE_COUNT_DEPTH(context.counters, lvl);
+      for (int octant = 0; octant < 8 && next == NULL; octant++) {
+         Cell * subcell = cell->getSubcell(octant);
+         OCTREE_COUNT(context.counters, objectCellTests, 1);
+         if (subcell != NULL) {
+            if (objectContainedTest(object, subcell))
+               next = subcell;
+         } else {
+            Eigen::Vector3f low, high;
+            cell->getSubcellBounds(octant, low, high);
+            Cell probe(cell, low, high);
+            if (objectContainedTest(object, &probe))
+               next = newSubcell(cell, octant, context);
+         }
+      }
+
+      if (next == NULL)
+         break;
+      cell = next;
+   }
+
+   int slot = addObjectToCell(handle, cell, context.counters);
+   objectEntries[handle].cells.push_back(CellRef(cell, slot));
+   return true;
+}
+
+void Octree::setContainmentTest(ObjectCellContainmentTest objectContainedTest) {
+   this->objectContainedTest = objectContainedTest;
+   resetWithBounds(rootCell->lowBound, rootCell->highBound);
+}
+
+void Octree::setOctantsTest(ObjectOctantsTest objectOctantsTest) {
+   this->objectOctantsTest = objectOctantsTest;
+}
+
+// Runs the cell test against the loose bounds of the cell when loose cells are on
+bool Octree::objectTouchesCell(void * object, Cell * cell, ObjectCellIntersectionTest objCellTest) {
+   OCTREE_COUNT(counters(), objectCellTests, 1);
+   if (!isLoose()) {
+      return objCellTest(object, cell);
+   }
+
+   Eigen::Vector3f halfSize = (cell->highBound - cell->lowBound) * (looseness / 2.0f);
+   Cell probe(cell->parent, cell->center - halfSize, cell->center + halfSize);
+   return objCellTest(object, &probe);
+}
+
+bool Octree::boxTouchesCell(const Eigen::Vector3f& low, const Eigen::Vector3f& high, Cell * cell) {
+   float scale = isLoose() ? looseness : 1.0f;
+   Eigen::Vector3f halfSize = (cell->highBound - cell->lowBound) * (scale / 2.0f);
+   Eigen::Vector3f cellLow = cell->center - halfSize;
+   Eigen::Vector3f cellHigh = cell->center + halfSize;
+   return low(0) <= cellHigh(0) && high(0) >= cellLow(0) &&
+          low(1) <= cellHigh(1) && high(1) >= cellLow(1) &&
+          low(2) <= cellHigh(2) && high(2) >= cellLow(2);
+}
+
+void Octree::setLooseness(float looseness) {
+   this->looseness = looseness;
+   resetWithBounds(rootCell->lowBound, rootCell->highBound);
+}
+
+// Takes a registered object out of all its cells, but keeps it registered
+void Octree::unplaceObject(ObjectHandle handle) {
+   CellList& cells = objectEntries[handle].cells;
+   int numCells = cells.size();
+   for (int i = 0; i < numCells; i++) {
+      Cell * cell = cells[i].cell;
+      OCTREE_COUNT(counters(), cellsVisited, 1);
+      OCTREE_COUNT_DEPTH(counters(), cellDepth(cell));
+      removeObjectFromCell(cells[i].slot, cell);
+      if (deferCollapse) {
+         markPendingCollapse(cell);
+      } else {
+         removeCellAndClimbIfEmpty(cell);
+      }
+   }
+   cells.clear();
+
+   if (autoCompactThreshold > 0 && pendingCells.size() >= autoCompactThreshold) {
+      compact(0);
+   }
+}
+
+ObjectHandle Octree::insert(void * object) {
+   OCTREE_API(API_INSERT);
+   ObjectHandle handle = getHandle(object);
+   if (handle != INVALID_HANDLE) {
+      return handle;
+   }
+
+   handle = createHandle(object);
+   if (!placeObject(handle)) {
+      destroyHandle(handle);
+      return INVALID_HANDLE;
+   }
+   return handle;
+}
+
+// Deletes the cell if it holds nothing, then does the same for its parent
+void Octree::removeCellAndClimbIfEmpty(Cell * cell) {
+   while (cell->parent != NULL && cell->isLeaf() && cell->objects.size() == 0) {
+      Cell * parent = cell->parent;
+      OCTREE_COUNT(counters(), cellsVisited, 1);
+      unmarkPendingCollapse(cell);
+      deleteSubcell(parent, cell->octant, counters());
+      cell = parent;
+   }
+}
+
+// Remembers an emptied cell so compact() can collapse it later
+void Octree::markPendingCollapse(Cell * cell) {
+   if (cell->pendingIndex < 0 && cell->parent != NULL && cell->objects.size() == 0) {
+      cell->pendingIndex = pendingCells.size();
+      pendingCells.push_back(cell);
+   }
+}
+
+void Octree::unmarkPendingCollapse(Cell * cell) {
+   int index = cell->pendingIndex;
+   if (index < 0)
+      return ;
+
+   Cell * last = pendingCells.back();
+   pendingCells[index] = last;
+   last->pendingIndex = index;
+   pendingCells.pop_back();
+   cell->pendingIndex = -1;
+}
+
+void Octree::setDeferredCollapse(bool deferred, unsigned int autoCompactThreshold) {
+   this->deferCollapse = deferred;
+   this->autoCompactThreshold = autoCompactThreshold;
+   if (!deferred) {
+      compact(0);
+   }
+}
+
+int Octree::compact(unsigned int maxMicros) {
+   OCTREE_API(API_COMPACT);
+   std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::microseconds(maxMicros);
+
+   // Cells that got objects again since being marked are skipped by the climb
+   for (int n = 0; pendingCells.size() > 0; n++) {
+      if (maxMicros > 0 && (n & 7) == 7 && std::chrono::steady_clock::now() >= deadline)
+         break;
+
+      Cell * cell = pendingCells.back();
+      unmarkPendingCollapse(cell);
+      removeCellAndClimbIfEmpty(cell);
+   }
+
+   return pendingCells.size();
+}
+
+void Octree::remove(void * specObj) {
+   OCTREE_API(API_REMOVE);
+   ObjectHandle handle = getHandle(specObj);
+   if (handle == INVALID_HANDLE) {
+      fprintf(stderr, "Octree::remove WARNING: the specified object was not found in the tree.\n");
+      return ;
+   }
+
+   remove(handle);
+}
+
+void Octree::remove(ObjectHandle handle) {
+   OCTREE_API(API_REMOVE);
+   if (!isValidHandle(handle)) {
+      fprintf(stderr, "Octree::remove WARNING: the specified handle is not in use.\n");
+      return ;
+   }
+
+   unplaceObject(handle);
+   destroyHandle(handle);
+}
+
+void Octree::update(void * specObj) {
+   OCTREE_API(API_UPDATE);
+   ObjectHandle handle = getHandle(specObj);
+   if (handle == INVALID_HANDLE) {
+      insert(specObj);
+   } else {
+      update(handle);
+   }
+}
+
+void Octree::update(ObjectHandle handle) {
+   OCTREE_API(API_UPDATE);
+   if (!isValidHandle(handle)) {
+      fprintf(stderr, "Octree::update WARNING: the specified handle is not in use.\n");
+      return ;
+   }
+
+   unplaceObject(handle);
+   if (!placeObject(handle)) {
+      destroyHandle(handle);
+   }
+}
+
+void Octree::update(const ObjectHandle * handles, int count) {
+   OCTREE_API(API_UPDATE);
+   bool deferred = deferCollapse;
+   deferCollapse = true;
+
+   for (int i = 0; i < count; i++) {
+      if (!isValidHandle(handles[i])) {
+         fprintf(stderr, "Octree::update WARNING: the specified handle is not in use.\n");
+         continue;
+      }
+      unplaceObject(handles[i]);
+   }
+   for (int i = 0; i < count; i++) {
+      if (isValidHandle(handles[i]) && objectEntries[handles[i]].cells.size() == 0 && !placeObject(handles[i]))
+         destroyHandle(handles[i]);
+   }
+
+   deferCollapse = deferred;
+   if (!deferred)
+      compact(0);
+}
+
+void Octree::clearCellRecursive(Cell * cell) {
+   int numSubcells = cell->subcells.size();
+   for (int i = 0; i < numSubcells; i++) {
+      clearCellRecursive(cell->subcells[i]);
+   }
+   if (cell != rootCell) {
+      cellPool.release(cell);
+   }
+}
+
+// Deletes every cell below the root and empties the root and the overflow list
+void Octree::clearCells() {
+   clearCellRecursive(rootCell);
+   rootCell->subcells.clear();
+   rootCell->childMask = 0;
+   rootCell->objects.clear();
+   rootCell->handles.clear();
+   if (rootCell->bounds != NULL)
+      rootCell->bounds->clear();
+   overflowCell->objects.clear();
+   overflowCell->handles.clear();
+   if (overflowCell->bounds != NULL)
+      overflowCell->bounds->clear();
+   pendingCells.clear();
+}
+
+void Octree::clear() {
+   clearCells();
+   objectEntries.clear();
+   freeHandles.clear();
+   handleMap.clear();
+}
+
+void Octree::resetWithBounds(Eigen::Vector3f lowBound, Eigen::Vector3f highBound) {
+   OCTREE_API(API_REBUILD);
+   clearCells();
+
+   rootCell->lowBound = lowBound;
+   rootCell->highBound = highBound;
+   rootCell->center = Eigen::Vector3f(
+      (lowBound(0) + highBound(0)) / 2.0f,
+      (lowBound(1) + highBound(1)) / 2.0f,
+      (lowBound(2) + highBound(2)) / 2.0f
+   );
+   if (rootCell->cull != NULL)
+      *rootCell->cull = CellCullState();   // What it knew about its old box doesn't hold for the new one
+
+   int numEntries = objectEntries.size();
+   for (int i = 0; i < numEntries; i++) {
+      objectEntries[i].cells.clear();
+   }
+
+   int numObjects = objectEntries.size() - freeHandles.size();
+   if (rebuildThreads > 1 && numObjects >= PARALLEL_REBUILD_MIN_OBJECTS) {
+      rebuildParallel();
+   }
+
+   // Places everything on one thread, or whatever the threads couldn't place
+   for (int i = 0; i < numEntries; i++) {
+      if (objectEntries[i].used && objectEntries[i].cells.size() == 0) {
+         placeObject(i);
+      }
+   }
+}
+
+void Octree::setRebuildThreads(unsigned int numThreads) {
+   this->rebuildThreads = numThreads;
+}
+
+// Whether placing the object would start at the root at all
+bool Octree::reachesRoot(ObjectHandle handle, OctreeCounters * counters) {
+   void * object = objectEntries[handle].object;
+   if (isLoose()) {
+      Eigen::Vector3f low, high;
+      objectBounds(object, low, high);
+      Eigen::Vector3f center = (low + high) / 2.0f;
+      return (center.array() >= rootCell->lowBound.array()).all() && (center.array() <= rootCell->highBound.array()).all();
+   }
+   OCTREE_COUNT(counters, objectCellTests, 1);
+   return objectInCellTest(object, rootCell);
+}
+
+// The cell's octants the bulk build sends the object on to, the way placing it alone would.
+// 0 keeps it in the cell.
+unsigned int Octree::buildOctants(ObjectHandle handle, Cell * cell, unsigned int lvl, OctreeCounters * counters) {
+   void * object = objectEntries[handle].object;
+   if (lvl >= maxDepth)
+      return 0;
+
+   if (isLoose()) {
+      Eigen::Vector3f low, high;
+      objectBounds(object, low, high);
+      Eigen::Vector3f center = (low + high) / 2.0f;
+      float radius = ((high - low) / 2.0f).maxCoeff();
+      // Halved per level from the root's, exactly as placeObjectLoose does
+      float slack = (looseness - 1.0f) * ((rootCell->highBound - rootCell->lowBound) / 2.0f).minCoeff();
+      if (radius > ldexpf(slack, -(int) lvl) / 2.0f)
+         return 0;
+      return 1u << ((center(0) >= cell->center(0) ? 4 : 0) |
+                    (center(1) >= cell->center(1) ? 2 : 0) |
+                    (center(2) >= cell->center(2) ? 1 : 0));
+   }
+
+   if (objectOctantsTest != NULL && objectContainedTest == NULL) {
+      OCTREE_COUNT(counters, objectCellTests, 1);
+      return objectOctantsTest(object, cell);
+   }
+
+   unsigned int octants = 0;
+   for (int octant = 0; octant < 8; octant++) {
+      Eigen::Vector3f low, high;
+      cell->getSubcellBounds(octant, low, high);
+      Cell probe(cell, low, high);
+      OCTREE_COUNT(counters, objectCellTests, 1);
+      if (objectContainedTest != NULL) {
+         if (objectContainedTest(object, &probe))
+            return 1u << octant;   // The first that contains it, like placeObjectEnclosing
+      } else if (objectInCellTest(object, &probe)) {
+         octants |= 1u << octant;
+      }
+   }
+   return octants;
+}
+
+// Fills masks[begin, end) with where the task's objects go. BUILD_OUTSIDE_ROOT marks objects
+// that don't reach the root, which are left for placeObject.
+void Octree::classifyTask(const BuildTask * task, int begin, int end, unsigned int * masks, OctreeCounters * counters) {
+   // Touching placement keeps everything in a cell that doesn't fill up, and nothing otherwise
+   bool touching = !isLoose() && objectContainedTest == NULL;
+   bool keepAll = touching && leafCapacity > 0 && task->handles.size() <= leafCapacity;
+   for (int i = begin; i < end; i++) {
+      ObjectHandle handle = task->handles[i];
+      if (task->cell == rootCell && !reachesRoot(handle, counters))
+         masks[i] = BUILD_OUTSIDE_ROOT;
+      else
+         masks[i] = keepAll ? 0 : buildOctants(handle, task->cell, task->lvl, counters);
+   }
+}
+
+// Adds the objects that stay in the task's cell and sorts the rest into tasks for its subcells
+void Octree::partitionTask(BuildTask& task, const unsigned int * masks, std::vector<BuildTask>& subtasks, BuildContext& context) {
+   OCTREE_COUNT(context.counters, cellsVisited, 1);
+   OCTREE_COUNT_DEPTH(context.counters, task.lvl);
+   bool touching = !isLoose() && objectContainedTest == NULL;
+   bool keepAll = task.lvl >= maxDepth || (leafCapacity > 0 && task.handles.size() <= leafCapacity);
+   std::vector<ObjectHandle> buckets[8];
+   int numHandles = task.handles.size();
+   for (int i = 0; i < numHandles; i++) {
+      if (masks[i] == BUILD_OUTSIDE_ROOT)
+         continue;
+      // An object touching none of a full cell's subcells goes nowhere, as in insertIntoSubcells
+      if (masks[i] == 0 && (!touching || keepAll))
+         placeInCell(task.handles[i], task.cell, context);
+      for (unsigned int octants = masks[i]; octants != 0; octants &= octants - 1) {
+         buckets[__builtin_ctz(octants)].push_back(task.handles[i]);
+      }
+   }
+
+   for (int octant = 0; octant < 8; octant++) {
+      if (buckets[octant].size() == 0)
+         continue;
+      subtasks.push_back(BuildTask());
+      BuildTask& subtask = subtasks.back();
+      subtask.cell = task.cell->getSubcell(octant);
+      if (subtask.cell == NULL)
+         subtask.cell = newSubcell(task.cell, octant, context);
+      subtask.lvl = task.lvl + 1;
+      subtask.handles.swap(buckets[octant]);
+   }
+}
+
+// Runs tasks off the shared list until it is empty, building each one's whole subtree
+void Octree::buildTasks(std::vector<BuildTask> * tasks, std::atomic<int> * next, BuildContext * context) {
+   std::vector<BuildTask> stack;
+   std::vector<unsigned int> masks;
+   for (int t = (*next)++; t < (int) tasks->size(); t = (*next)++) {
+      stack.push_back(BuildTask());
+      stack.back().cell = (*tasks)[t].cell;
+      stack.back().lvl = (*tasks)[t].lvl;
+      stack.back().handles.swap((*tasks)[t].handles);
+      while (stack.size() > 0) {
+         BuildTask task;
+         task.cell = stack.back().cell;
+         task.lvl = stack.back().lvl;
+         task.handles.swap(stack.back().handles);
+         stack.pop_back();
+
+         masks.resize(task.handles.size());
+         classifyTask(&task, 0, task.handles.size(), masks.data(), context->counters);
+         partitionTask(task, masks.data(), stack, *context);
+      }
+   }
+}
+
+// Classifies a task's objects on every thread, then sorts them into subtasks on this one
+void Octree::partitionTaskParallel(BuildTask& task, int numThreads, std::vector<BuildTask>& subtasks) {
+   int numHandles = task.handles.size();
+   std::vector<unsigned int> masks(numHandles);
+   std::vector<OctreeCounters> threadCounters(numThreads);
+   std::vector<std::thread> threads;
+   int chunk = (numHandles + numThreads - 1) / numThreads;
+   for (int t = 1; t < numThreads; t++) {
+      int begin = Mmath::min(numHandles, t * chunk), end = Mmath::min(numHandles, (t + 1) * chunk);
+      threads.push_back(std::thread(&Octree::classifyTask, this, &task, begin, end, masks.data(), &threadCounters[t]));
+   }
+   classifyTask(&task, 0, Mmath::min(numHandles, chunk), masks.data(), &threadCounters[0]);
+   for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+   }
+   for (int t = 0; t < numThreads; t++) {
+      counters()->add(threadCounters[t]);
+   }
+
+   BuildContext context = serialContext();
+   partitionTask(task, masks.data(), subtasks, context);
+}
+
+static bool moreObjects(const BuildTask& a, const BuildTask& b) {
+   return a.handles.size() > b.handles.size();
+}
+
+// Builds the whole tree from one pass over the objects per level. The largest pending cells
+// are split on this thread (classifying their objects on all threads) until there are a few
+// subtrees per thread; the threads then take subtrees, largest first, until none are left.
+// Places every object the way placeObjectInTree would, in any placement mode.
+void Octree::rebuildParallel() {
+   int numThreads = rebuildThreads;
+
+   std::vector<BuildTask> tasks(1);
+   tasks[0].cell = rootCell;
+   tasks[0].lvl = 0;
+   int numEntries = objectEntries.size();
+   for (int i = 0; i < numEntries; i++) {
+      if (objectEntries[i].used)
+         tasks[0].handles.push_back(i);
+   }
+
+   while ((int) tasks.size() < numThreads * BUILD_TASKS_PER_THREAD) {
+      std::vector<BuildTask>::iterator largest = std::min_element(tasks.begin(), tasks.end(), moreObjects);
+      if (largest->handles.size() < BUILD_MIN_SPLIT_OBJECTS || largest->lvl >= maxDepth)
+         break;
+      BuildTask task;
+      task.cell = largest->cell;
+      task.lvl = largest->lvl;
+      task.handles.swap(largest->handles);
+      tasks.erase(largest);
+      partitionTaskParallel(task, numThreads, tasks);
+   }
+   std::sort(tasks.begin(), tasks.end(), moreObjects);
+
+   std::vector<CellPool> pools(numThreads);
+   std::vector<std::vector<PendingCellRef> > refs(numThreads);
+   std::vector<OctreeCounters> threadCounters(numThreads);
+   std::vector<BuildContext> contexts;
+   int cellsPerThread = cellPool.freeCells.size() / numThreads;
+   for (int t = 0; t < numThreads; t++) {
+      cellPool.giveTo(pools[t], cellsPerThread);
+      contexts.push_back(BuildContext(&pools[t], &refs[t], &threadCounters[t]));
+   }
+
+   std::atomic<int> next(0);
+   std::vector<std::thread> threads;
+   for (int t = 1; t < numThreads; t++) {
+      threads.push_back(std::thread(&Octree::buildTasks, this, &tasks, &next, &contexts[t]));
+   }
+   buildTasks(&tasks, &next, &contexts[0]);
+   for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+   }
+
+   for (int t = 0; t < numThreads; t++) {
+      int numRefs = refs[t].size();
+      for (int i = 0; i < numRefs; i++) {
+         objectEntries[refs[t][i].handle].cells.push_back(refs[t][i].ref);
+      }
+      pools[t].giveTo(cellPool, pools[t].freeCells.size());
+      counters()->add(threadCounters[t]);
+   }
+   pruneEmptyLeaves(rootCell);
+}
+
+// Deletes the empty leaves the bulk build made for objects that ended up in no subcell
+void Octree::pruneEmptyLeaves(Cell * cell) {
+   for (int octant = 7; octant >= 0; octant--) {
+      Cell * subcell = cell->getSubcell(octant);
+      if (subcell == NULL)
+         continue;
+      pruneEmptyLeaves(subcell);
+      if (subcell->isLeaf() && subcell->objects.size() == 0)
+         deleteSubcell(cell, octant, counters());
+   }
+}
+
+// Runs objObjTest between the specified object and every other object in the cell.
+// If the cell keeps object bounds, only objects whose boxes overlap specLow/specHigh are tested.
+bool Octree::testObjectsInCell(
+   void * specObj,
+   Cell * cell,
+   const Eigen::Vector3f& specLow,
+   const Eigen::Vector3f& specHigh,
+   ObjectObjectIntersectionTest objObjTest,
+   ObjectList * collisions
+) {
+   bool hasCollision = false;
+   int numObjects = cell->objects.size();
+   OCTREE_COUNT(counters(), cellsVisited, 1);
+   OCTREE_COUNT_DEPTH(counters(), cellDepth(cell));
+
+   if (objectBounds != NULL) {
+      for (int start = 0; start < numObjects; start += 32) {
+         unsigned int mask = cell->bounds->overlapMask(start, specLow, specHigh);
+         for (; mask; mask &= mask - 1) {
+            void * obj = cell->objects[start + __builtin_ctz(mask)];
+            OCTREE_COUNT(counters(), objectObjectTests, obj != specObj);
+            if (obj != specObj && objObjTest(specObj, obj)) {
+               if (collisions != NULL) {
+                  collisions->push_back(obj);
+               }
+               hasCollision = true;
+            }
+         }
+      }
+   } else {
+      for (int i = 0; i < numObjects; i++) {
+         void * obj = cell->objects[i];
+         OCTREE_COUNT(counters(), objectObjectTests, obj != specObj);
+         if (obj != specObj && objObjTest(specObj, obj)) {
+            if (collisions != NULL) {
+               collisions->push_back(obj);
+            }
+            hasCollision = true;
+         }
+      }
+   }
+
+   return hasCollision;
+}
+
+bool Octree::testIntersectionOutsideHelper(
+   void * specObj,
+   Cell * cell,
+   const Eigen::Vector3f& specLow,
+   const Eigen::Vector3f& specHigh,
+   ObjectCellIntersectionTest objCellTest,
+   ObjectObjectIntersectionTest objObjTest,
+   ObjectList * collisions
+) {
+   bool hasCollision = false;
+
+   if (objectTouchesCell(specObj, cell, objCellTest)) {
+      // Only loose cells keep objects above the leaves
+      hasCollision = testObjectsInCell(specObj, cell, specLow, specHigh, objObjTest, collisions);
+
+      int numSubcells = cell->subcells.size();
+      for (int i = 0; i < numSubcells; i++) {
+         hasCollision |= testIntersectionOutsideHelper(specObj, cell->subcells[i], specLow, specHigh, objCellTest, objObjTest, collisions);
+      }
+   }
+
+   return hasCollision;
+}
+
+// Same as testIntersectionOutsideHelper, but tests cells against the object's bounding box
+bool Octree::testIntersectionBoxHelper(
+   void * specObj,
+   Cell * cell,
+   const Eigen::Vector3f& specLow,
+   const Eigen::Vector3f& specHigh,
+   ObjectObjectIntersectionTest objObjTest,
+   ObjectList * collisions
+) {
+   bool hasCollision = false;
+
+   if (boxTouchesCell(specLow, specHigh, cell)) {
+      hasCollision = testObjectsInCell(specObj, cell, specLow, specHigh, objObjTest, collisions);
+
+      int numSubcells = cell->subcells.size();
+      for (int i = 0; i < numSubcells; i++) {
+         hasCollision |= testIntersectionBoxHelper(specObj, cell->subcells[i], specLow, specHigh, objObjTest, collisions);
+      }
+   }
+
+   return hasCollision;
+}
+
+bool Octree::testIntersectionInside(
+   void * specObj,
+   ObjectObjectIntersectionTest objObjTest,
+   ObjectList * collisions
+) {
+   OCTREE_API(API_QUERY);
+   ObjectHandle handle = getHandle(specObj);
+   if (handle == INVALID_HANDLE) {
+      fprintf(stderr, "Octree::testIntersectionInside WARNING: the specified object was not found in the tree.\n");
+      return false;
+   }
+
+   return testIntersectionInside(handle, objObjTest, collisions);
+}
+
+bool Octree::testIntersectionInside(
+   ObjectHandle handle,
+   ObjectObjectIntersectionTest objObjTest,
+   ObjectList * collisions
+) {
+   OCTREE_API(API_QUERY);
+   if (!isValidHandle(handle)) {
+      fprintf(stderr, "Octree::testIntersectionInside WARNING: the specified handle is not in use.\n");
+      return false;
+   }
+
+   void * specObj = objectEntries[handle].object;
+   Eigen::Vector3f specLow, specHigh;
+   if (objectBounds != NULL) {
+      objectBounds(specObj, specLow, specHigh);
+   }
+
+   CellList& cells = objectEntries[handle].cells;
+   bool hasCollision = false;
+
+   if (cells.size() > 0 && cells[0].cell == overflowCell) {
+      // Overflowed objects have no cells to start from, so search the whole tree
+      if (isLoose()) {
+         hasCollision = testIntersectionBoxHelper(specObj, rootCell, specLow, specHigh, objObjTest, collisions);
+      } else {
+         hasCollision = testIntersectionOutsideHelper(specObj, rootCell, specLow, specHigh, objectInCellTest, objObjTest, collisions);
+      }
+   } else if (cells.size() > 0) {
+      hasCollision = testIntersectionInsideHelper(handle, specLow, specHigh, objObjTest, collisions);
+   }
+
+   hasCollision |= testObjectsInCell(specObj, overflowCell, specLow, specHigh, objObjTest, collisions);
+   return hasCollision;
+}
+
+bool Octree::testIntersectionInsideHelper(
+   ObjectHandle handle,
+   const Eigen::Vector3f& specLow,
+   const Eigen::Vector3f& specHigh,
+   ObjectObjectIntersectionTest objObjTest,
+   ObjectList * collisions
+) {
+   void * specObj = objectEntries[handle].object;
+   CellList& cells = objectEntries[handle].cells;
+   bool hasCollision = false;
+
+   // A loose object can touch objects in any cell whose loose bounds overlap it
+   if (isLoose()) {
+      return testIntersectionBoxHelper(specObj, rootCell, specLow, specHigh, objObjTest, collisions);
+   }
+
+   // An enclosed object can touch the objects of every cell above it, and the objects
+   // below it that objectInCellTest leads to
+   if (objectContainedTest != NULL) {
+      Cell * cell = cells[0].cell;
+      hasCollision = testIntersectionOutsideHelper(specObj, cell, specLow, specHigh, objectInCellTest, objObjTest, collisions);
+      for (Cell * above = cell->parent; above != NULL; above = above->parent) {
+         hasCollision |= testObjectsInCell(specObj, above, specLow, specHigh, objObjTest, collisions);
+      }
+      return hasCollision;
+   }
+
+   int numCells = cells.size();
+   for (int i = 0; i < numCells; i++) {
+      hasCollision |= testObjectsInCell(specObj, cells[i].cell, specLow, specHigh, objObjTest, collisions);
+   }
+
+   return hasCollision;
+}
+
+bool Octree::testIntersectionOutside(
+   void * obj,
+   ObjectCellIntersectionTest objCellTest,
+   ObjectObjectIntersectionTest objObjTest,
+   ObjectList * collisions
+) {
+   OCTREE_API(API_QUERY);
+   Eigen::Vector3f specLow, specHigh;
+   if (objectBounds != NULL) {
+      objectBounds(obj, specLow, specHigh);
+   }
+
+   bool hasCollision = testIntersectionOutsideHelper(obj, rootCell, specLow, specHigh, objCellTest, objObjTest, collisions);
+   hasCollision |= testObjectsInCell(obj, overflowCell, specLow, specHigh, objObjTest, collisions);
+   return hasCollision;
+}
+
+int Octree::cullFrustums(const Geom::Frustumf * frustums, int numFrustums, CullList& visible) {
+   OCTREE_API(API_QUERY);
+   visible.clear();
+   if (objectBounds == NULL) {
+      fprintf(stderr, "Octree::cullFrustums WARNING: needs an ObjectBoundsFunction.\n");
+      return 0;
+   }
+   if (numFrustums > MAX_CULL_VIEWS) {
+      fprintf(stderr, "Octree::cullFrustums WARNING: only the first %d of %d frustums are used.\n", MAX_CULL_VIEWS, numFrustums);
+      numFrustums = MAX_CULL_VIEWS;
+   }
+   if (numFrustums <= 0)
+      return 0;
+
+   if (handleSlots.size() < objectEntries.size())
+      handleSlots.resize(objectEntries.size(), -1);
+
+   ViewMask allViews = numFrustums == MAX_CULL_VIEWS ? ~0ULL : (1ULL << numFrustums) - 1;
+   cullHelper(rootCell, frustums, allViews, 0, visible);
+   cullObjectsInCell(overflowCell, frustums, allViews, 0, visible);
+
+   int numVisible = visible.size();
+   for (int i = 0; i < numVisible; i++) {
+      handleSlots[visible[i].handle] = -1;
+   }
+   return numVisible;
+}
+
+// partial holds the views that see some of the parent cell, inside the views that see all of it
+void Octree::cullHelper(Cell * cell, const Geom::Frustumf * frustums, ViewMask partial, ViewMask inside, CullList& visible) {
+   float scale = isLoose() ? looseness : 1.0f;
+   Eigen::Vector3f halfSize = (cell->highBound - cell->lowBound) * (scale / 2.0f);
+   Geom::AABBf box(cell->center - halfSize, cell->center + halfSize);
+   for (ViewMask views = partial; views != 0; views &= views - 1) {
+      ViewMask view = views & (~views + 1);
+      OCTREE_COUNT(counters(), objectCellTests, 1);
+      Geom::FrustumClass where = Geom::Classify(frustums[__builtin_ctzll(views)], box);
+      if (where != Geom::FRUSTUM_INTERSECTS)
+         partial &= ~view;
+      if (where == Geom::FRUSTUM_INSIDE)
+         inside |= view;
+   }
+   if ((partial | inside) == 0)
+      return;
+
+   cullObjectsInCell(cell, frustums, partial, inside, visible);
+   int numSubcells = cell->subcells.size();
+   for (int i = 0; i < numSubcells; i++) {
+      cullHelper(cell->subcells[i], frustums, partial, inside, visible);
+   }
+}
+
+// An object in several cells is listed once, with the views found in every cell
+void Octree::cullObjectsInCell(Cell * cell, const Geom::Frustumf * frustums, ViewMask partial, ViewMask inside, CullList& visible) {
+   int numObjects = cell->objects.size();
+   OCTREE_COUNT(counters(), cellsVisited, 1);
+   OCTREE_COUNT_DEPTH(counters(), cellDepth(cell));
+   if (numObjects == 0)
+      return;
+
+   BoundsList& bounds = *cell->bounds;
+   for (int i = 0; i < numObjects; i++) {
+      ViewMask seenBy = inside;
+      if (partial != 0) {
+         Geom::AABBf box(Eigen::Vector3f(bounds.minX[i], bounds.minY[i], bounds.minZ[i]),
+                         Eigen::Vector3f(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i]));
+         for (ViewMask views = partial; views != 0; views &= views - 1) {
+            OCTREE_COUNT(counters(), objectObjectTests, 1);
+            if (Geom::Classify(frustums[__builtin_ctzll(views)], box) != Geom::FRUSTUM_OUTSIDE)
+               seenBy |= views & (~views + 1);
+         }
+      }
+      if (seenBy != 0)
+         addCulledObject(cell, i, seenBy, visible);
+   }
+}
+
+void Octree::addCulledObject(Cell * cell, int index, ViewMask views, CullList& visible) {
+   ObjectHandle handle = cell->handles[index];
+   int& slot = handleSlots[handle];
+   if (slot < 0) {
+      slot = visible.size();
+      CulledObject culled;
+      culled.object = cell->objects[index];
+      culled.handle = handle;
+      culled.views = views;
+      visible.push_back(culled);
+   } else {
+      visible[slot].views |= views;
+   }
+}
+
+// Shared by every cache, so a cell can tell which cull last tested it
+static std::atomic<unsigned int> nextCullStamp(1);
+
+CullCache::CullCache() {
+   clear();
+}
+
+void CullCache::clear() {
+   frame = 0;
+   stamp = lastStamp = 0;
+   normalMoved = offsetMoved = 0.0f;
+   planeTests = 0;
+   reusedCells = 0;
+}
+
+int Octree::cullFrustumCoherent(const Geom::Frustumf& frustum, CullCache& cache, CullList& visible) {
+   OCTREE_API(API_QUERY);
+   visible.clear();
+   cache.planeTests = 0;
+   cache.reusedCells = 0;
+   if (objectBounds == NULL) {
+      fprintf(stderr, "Octree::cullFrustumCoherent WARNING: needs an ObjectBoundsFunction.\n");
+      return 0;
+   }
+
+   // Where the left, bottom and near planes meet. Distances to the planes change by at most
+   // normalMoved * |p - reference| + offsetMoved since last frame, which is tight near the view.
+   Eigen::Matrix3f corner;
+   corner << frustum.planeX[0], frustum.planeY[0], frustum.planeZ[0],
+             frustum.planeX[2], frustum.planeY[2], frustum.planeZ[2],
+             frustum.planeX[4], frustum.planeY[4], frustum.planeZ[4];
+   Eigen::Vector3f reference = corner.fullPivLu().solve(-Eigen::Vector3f(frustum.planeD[0], frustum.planeD[2], frustum.planeD[4]));
+   cache.reference = reference.allFinite() ? reference : Eigen::Vector3f::Zero();
+
+   cache.frame++;
+   cache.lastStamp = cache.stamp;
+   cache.stamp = nextCullStamp++;
+   cache.normalMoved = cache.offsetMoved = 0.0f;
+   for (int i = 0; i < NUM_CULL_PLANES; i++) {
+      float plane[4] = { frustum.planeX[i], frustum.planeY[i], frustum.planeZ[i], frustum.planeD[i] };
+      if (cache.frame > 1) {
+         Eigen::Vector3f normalChange(plane[0] - cache.lastPlanes[i][0], plane[1] - cache.lastPlanes[i][1],
+                                      plane[2] - cache.lastPlanes[i][2]);
+         float offsetChange = normalChange.dot(cache.reference) + plane[3] - cache.lastPlanes[i][3];
+         cache.normalMoved = std::max(cache.normalMoved, normalChange.norm());
+         cache.offsetMoved = std::max(cache.offsetMoved, fabsf(offsetChange));
+      }
+      std::copy(plane, plane + 4, cache.lastPlanes[i]);
+   }
+
+   if (handleSlots.size() < objectEntries.size())
+      handleSlots.resize(objectEntries.size(), -1);
+
+   unsigned int allPlanes = (1u << NUM_CULL_PLANES) - 1;
+   coherentCullHelper(rootCell, frustum, allPlanes, INFINITY, cache, visible);
+   coherentCullObjects(overflowCell, frustum, allPlanes, cache, visible);
+
+   int numVisible = visible.size();
+   for (int i = 0; i < numVisible; i++) {
+      handleSlots[visible[i].handle] = -1;
+   }
+   return numVisible;
+}
+
+// planes holds the planes the parent cell straddles. The cell is inside the others by at
+// least margin. Returns how far outside a plane the cell is, or 0 if it isn't.
+float Octree::coherentCullHelper(Cell * cell, const Geom::Frustumf& frustum, unsigned int planes, float margin, CullCache& cache, CullList& visible) {
+   float scale = isLoose() ? looseness : 1.0f;
+   Eigen::Vector3f halfSize = (cell->highBound - cell->lowBound) * (scale / 2.0f);
+   Geom::AABBf box(cell->center - halfSize, cell->center + halfSize);
+   OCTREE_COUNT(counters(), objectCellTests, 1);
+
+   // What was true last frame still is if the planes moved less than the margin it held by.
+   // Subcells lie inside the cell, so what bounds the cell's move bounds theirs too. Cells are
+   // reset when reused, so a stamp from last frame is about this box.
+   if (cell->cull == NULL)
+      cell->cull = new CellCullState();
+   CellCullState& state = *cell->cull;
+   bool lastFrame = cache.frame > 1 && state.stamp == cache.lastStamp;
+   float reach = (cell->center - cache.reference).norm() + halfSize.norm();
+   float moved = cache.normalMoved * reach + cache.offsetMoved;
+   float wasOutside[8];
+   std::copy(state.subcellOutside, state.subcellOutside + 8, wasOutside);
+   std::fill(state.subcellOutside, state.subcellOutside + 8, 0.0f);
+   state.stamp = cache.stamp;
+   if (lastFrame && moved < state.insideMargin) {
+      state.insideMargin -= moved;
+      cache.reusedCells++;
+      addVisibleSubtree(cell, visible);
+      return 0.0f;
+   }
+   state.insideMargin = 0.0f;
+
+   // The plane that rejected the cell before is the likeliest to reject it again, so it goes first
+   int plane = state.rejectPlane >= 0 && (planes >> state.rejectPlane & 1) ? state.rejectPlane : -1;
+   unsigned int straddling = 0;
+   for (unsigned int untested = planes; untested != 0; plane = -1) {
+      if (plane < 0)
+         plane = __builtin_ctz(untested);
+      untested &= ~(1u << plane);
+
+      float nearDist, farDist;
+      cache.planeTests++;
+      Geom::PlaneDistances(frustum, plane, box, nearDist, farDist);
+      if (farDist < 0.0f) {
+         state.rejectPlane = plane;
+         return -farDist;
+      }
+      if (nearDist <= 0.0f)
+         straddling |= 1u << plane;
+      else
+         margin = std::min(margin, nearDist);
+   }
+
+   if (straddling == 0) {
+      state.insideMargin = margin;
+      addVisibleSubtree(cell, visible);
+      return 0.0f;
+   }
+
+   coherentCullObjects(cell, frustum, straddling, cache, visible);
+   // Subcells still outside are passed over without reading them; subcells are in octant order
+   int i = 0;
+   for (unsigned int octants = cell->childMask; octants != 0; octants &= octants - 1, i++) {
+      int octant = __builtin_ctz(octants);
+      if (lastFrame && moved < wasOutside[octant]) {
+         state.subcellOutside[octant] = wasOutside[octant] - moved;
+         cache.reusedCells++;
+         continue;
+      }
+      state.subcellOutside[octant] = coherentCullHelper(cell->subcells[i], frustum, straddling, margin, cache, visible);
+   }
+   return 0.0f;
+}
+
+// Objects are only tested against the planes their cell straddles, a plane at a time over
+// the cell's bounds lists
+void Octree::coherentCullObjects(Cell * cell, const Geom::Frustumf& frustum, unsigned int planes, CullCache& cache, CullList& visible) {
+   int numObjects = cell->objects.size();
+   OCTREE_COUNT(counters(), cellsVisited, 1);
+   OCTREE_COUNT_DEPTH(counters(), cellDepth(cell));
+   if (numObjects == 0)
+      return;
+   OCTREE_COUNT(counters(), objectObjectTests, numObjects);
+
+   BoundsList& bounds = *cell->bounds;
+   cache.farDists.assign(numObjects, INFINITY);
+   float * farDists = &cache.farDists[0];
+   for (unsigned int untested = planes; untested != 0; untested &= untested - 1) {
+      int plane = __builtin_ctz(untested);
+      float nx = frustum.planeX[plane], ny = frustum.planeY[plane], nz = frustum.planeZ[plane];
+      float d = frustum.planeD[plane];
+      // The corner farthest along the normal, as in Geom::PlaneDistances
+      const float * xs = nx >= 0.0f ? &bounds.maxX[0] : &bounds.minX[0];
+      const float * ys = ny >= 0.0f ? &bounds.maxY[0] : &bounds.minY[0];
+      const float * zs = nz >= 0.0f ? &bounds.maxZ[0] : &bounds.minZ[0];
+      cache.planeTests += numObjects;
+      MMATH_INDEPENDENT_LOOP
+      for (int i = 0; i < numObjects; i++) {
+         farDists[i] = std::min(farDists[i], nx * xs[i] + ny * ys[i] + nz * zs[i] + d);
+      }
+   }
+
+   for (int i = 0; i < numObjects; i++) {
+      if (farDists[i] >= 0.0f)
+         addCulledObject(cell, i, 1, visible);
+   }
+}
+
+void Octree::addVisibleSubtree(Cell * cell, CullList& visible) {
+   OCTREE_COUNT(counters(), cellsVisited, 1);
+   OCTREE_COUNT_DEPTH(counters(), cellDepth(cell));
+   int numObjects = cell->objects.size();
+   for (int i = 0; i < numObjects; i++) {
+      addCulledObject(cell, i, 1, visible);
+   }
+   int numSubcells = cell->subcells.size();
+   for (int i = 0; i < numSubcells; i++) {
+      addVisibleSubtree(cell->subcells[i], visible);
+   }
+}
+
+static bool enteredSooner(const SweptHit& a, const SweptHit& b) {
+   return a.tEnter < b.tEnter;
+}
+
+int Octree::sweepBox(const Geom::AABBf& box, const Eigen::Vector3f& motion, SweptHitList& hits) {
+   OCTREE_API(API_QUERY);
+   hits.clear();
+   if (objectBounds == NULL) {
+      fprintf(stderr, "Octree::sweepBox WARNING: needs an ObjectBoundsFunction.\n");
+      return 0;
+   }
+
+   if (handleSlots.size() < objectEntries.size())
+      handleSlots.resize(objectEntries.size(), -1);
+
+   sweepHelper(rootCell, box, motion, hits);
+   sweepObjectsInCell(overflowCell, box, motion, hits);
+
+   int numHits = hits.size();
+   for (int i = 0; i < numHits; i++) {
+      handleSlots[hits[i].handle] = -1;
+   }
+   std::sort(hits.begin(), hits.end(), enteredSooner);
+   return numHits;
+}
+
+int Octree::sweepSphere(const Geom::Spheref& sphere, const Eigen::Vector3f& motion, SweptHitList& hits) {
+   Eigen::Vector3f extent(sphere.radius, sphere.radius, sphere.radius);
+   return sweepBox(Geom::AABBf(sphere.center - extent, sphere.center + extent), motion, hits);
+}
+
+void Octree::sweepHelper(Cell * cell, const Geom::AABBf& box, const Eigen::Vector3f& motion, SweptHitList& hits) {
+   float scale = isLoose() ? looseness : 1.0f;
+   Eigen::Vector3f halfSize = (cell->highBound - cell->lowBound) * (scale / 2.0f);
+   Geom::AABBf cellBox(cell->center - halfSize, cell->center + halfSize);
+   float tEnter, tExit;
+   OCTREE_COUNT(counters(), objectCellTests, 1);
+   if (!Geom::SweepIntersect(box, motion, cellBox, tEnter, tExit))
+      return;
+
+   sweepObjectsInCell(cell, box, motion, hits);
+   int numSubcells = cell->subcells.size();
+   for (int i = 0; i < numSubcells; i++) {
+      sweepHelper(cell->subcells[i], box, motion, hits);
+   }
+}
+
+void Octree::sweepObjectsInCell(Cell * cell, const Geom::AABBf& box, const Eigen::Vector3f& motion, SweptHitList& hits) {
+   int numObjects = cell->objects.size();
+   OCTREE_COUNT(counters(), cellsVisited, 1);
+   OCTREE_COUNT_DEPTH(counters(), cellDepth(cell));
+   if (numObjects == 0)
+      return;
+
+   BoundsList& bounds = *cell->bounds;
+   for (int i = 0; i < numObjects; i++) {
+      ObjectHandle handle = cell->handles[i];
+      if (handleSlots[handle] >= 0)
+         continue;
+
+      Geom::AABBf objectBox(Eigen::Vector3f(bounds.minX[i], bounds.minY[i], bounds.minZ[i]),
+                            Eigen::Vector3f(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i]));
+      SweptHit hit;
+      OCTREE_COUNT(counters(), objectObjectTests, 1);
+      if (!Geom::SweepIntersect(box, motion, objectBox, hit.tEnter, hit.tExit))
+         continue;
+
+      hit.object = cell->objects[i];
+      hit.handle = handle;
+      handleSlots[handle] = hits.size();
+      hits.push_back(hit);
+   }
 }
 
 /**
@@ -320,7 +2235,7 @@ bool Octree::testIntersection(
    ObjectObjectIntersectionTest objObjTest,
    ObjectList * collisions
 ) {
-   if (objCellTest == NULL || cellMap.find(object) != cellMap.end()) {
+   if (objCellTest == NULL || handleMap.find(object) != INVALID_HANDLE) {
       return testIntersectionInside(object, objObjTest, collisions);
    } else {
       return testIntersectionOutside(object, objCellTest, objObjTest, collisions);
@@ -1,38 +1,397 @@
 #ifndef __OCTREE_H__
 #define __OCTREE_H__
 
+#include <atomic>
+#include <chrono>
 #include <unordered_map>
 #include <vector>
 #include <Eigen/Dense>
+#include "octree_trace.h"
+
+// Tracing reports the cells and depth each call reached, which come from the counters
+#if defined(OCTREE_TRACE) && !defined(OCTREE_STATS)
+#define OCTREE_STATS
+#endif
 
 class Cell;
+namespace Geom { class AABBf; class Frustumf; class Spheref; }
 
 typedef bool(* ObjectCellIntersectionTest)(void * object, Cell * cell);
+typedef bool(* ObjectCellContainmentTest)(void * object, Cell * cell);  // true if cell fully contains object
 typedef bool(* ObjectObjectIntersectionTest)(void * objectOut, void * objectIn);
+typedef unsigned int(* ObjectOctantsTest)(void * object, Cell * cell);  // bit i set if object touches octant i of cell
+typedef void(* ObjectBoundsFunction)(void * object, Eigen::Vector3f& lowBound, Eigen::Vector3f& highBound);
+
+/* Handle returned by Octree::insert. Handles are dense indices into the octree's object
+ * registry and are reused after the object is removed. */
+typedef unsigned int ObjectHandle;
+static const ObjectHandle INVALID_HANDLE = 0xFFFFFFFF;
+
+/* Vector that stores its first N elements inline, so short lists never touch the heap */
+template <typename T, int N>
+class SmallList {
+public:
+   SmallList() : count(0) {}
+
+   int size() const {
+      return count;
+   }
+
+   T& operator[](int index) {
+      return index < N ? inlineItems[index] : overflow[index - N];
+   }
+
+   const T& operator[](int index) const {
+      return index < N ? inlineItems[index] : overflow[index - N];
+   }
+
+   void push_back(const T& item) {
+      if (count < N)
+         inlineItems[count] = item;
+      else
+         overflow.push_back(item);
+      count++;
+   }
+
+   void clear() {
+      overflow.clear();
+      count = 0;
+   }
+
+   // Moves the last item into index
+   void swapRemove(int index) {
+      (*this)[index] = (*this)[count - 1];
+      if (count > N)
+         overflow.pop_back();
+      count--;
+   }
+
+   // Bytes allocated on the heap once more than N items were added
+   size_t heapBytes() const {
+      return overflow.capacity() * sizeof(T);
+   }
+
+private:
+   T inlineItems[N];
+   std::vector<T> overflow;
+   int count;
+};
+
+/* A cell holding an object, and the index of the object inside that cell's objects list */
+class CellRef {
+public:
+   CellRef() : cell(NULL), slot(0) {}
+   CellRef(Cell * cell, int slot) : cell(cell), slot(slot) {}
+
+   Cell * cell;
+   int slot;
+};
 
 typedef std::vector<void *> ObjectList;
-typedef std::vector<Cell *> CellList;
-typedef std::unordered_map<void *, CellList> CellMap;
-typedef std::pair<void *, CellList> ObjectCellPair;
+typedef SmallList<CellRef, 2> CellList;
+
+/* Object -> handle lookup for the void* overloads. Open addressing with linear probing in
+ * one flat array, kept at most half full, so a lookup is a multiply and usually one probe
+ * with no node to chase. */
+class HandleMap {
+public:
+   HandleMap();
+
+   ObjectHandle find(void * object) const;   // INVALID_HANDLE if the object isn't there
+   bool insert(void * object, ObjectHandle handle);   // Returns true if the table grew
+   void erase(void * object);
+   void clear();
+   size_t size() const;
+   size_t capacity() const;
+
+private:
+   class Slot {
+   public:
+      void * object;
+      ObjectHandle handle;   // INVALID_HANDLE if the slot is empty
+   };
+
+   size_t homeSlot(void * object) const;
+   void grow();
+
+   std::vector<Slot> slots;
+   size_t count;
+   int shift;   // 64 minus log2 of the capacity
+};
+
+/* Registry entry for an object in the octree, indexed by its handle */
+class ObjectEntry {
+public:
+   ObjectEntry() : object(NULL), used(false) {}
+
+   void * object;
+   CellList cells;          // Every cell that holds the object
+   bool used;
+};
+
+/* Structure-of-arrays copy of the bounding boxes of a cell's objects. Entry i belongs to
+ * Cell::objects[i]. Keeping each coordinate contiguous lets queries reject 4 objects at a
+ * time before calling the (expensive, indirect) object-object test.
+ */
+class BoundsList {
+public:
+   void push(const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound);
+   void swapRemove(int index);   // Moves the last entry into index
+   void clear();
+   int size();
+   size_t heapBytes();
+
+   /* Sets bit (i - start) of the returned mask if entry i overlaps the given box, for the
+    * (at most 32) entries starting at start */
+   unsigned int overlapMask(int start, const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound);
+
+   std::vector<float> minX, minY, minZ;
+   std::vector<float> maxX, maxY, maxZ;
+};
+
+/* What Octree::cullFrustumCoherent remembers about a cell from the last frame that tested it.
+ * A cell only gets one once a coherent cull reaches it, so other trees don't pay for it. */
+class CellCullState {
+public:
+   CellCullState() : stamp(0), insideMargin(0.0f), rejectPlane(-1) {
+      for (int i = 0; i < 8; i++) {
+         subcellOutside[i] = 0.0f;
+      }
+   }
+
+   unsigned int stamp;   // CullCache::stamp of the last cull that tested the cell, or 0
+   float insideMargin;   // How far inside every plane the cell was, or 0 if it wasn't
+   int rejectPlane;      // Plane the cell was last entirely outside of, or -1
+   float subcellOutside[8];   // How far outside a plane each octant's subcell was, or 0
+};
+
+class CellPool;
 
 class Cell {
 public:
    Cell(Cell * parent, Eigen::Vector3f lowBound, Eigen::Vector3f highBound);
    ~Cell();
 
+   // Makes the cell look newly constructed, but keeps the memory of its lists
+   void reset(Cell * parent, const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound);
+
    bool isLeaf();
-   void split(ObjectCellIntersectionTest objectInCellTest);
+
+   // Subcells are only allocated once something occupies them. childMask has one bit per
+   // octant (see the subcell order in octree.cpp) and subcells holds only the present
+   // children, sorted by octant.
+   bool hasSubcell(int octant);
+   Cell * getSubcell(int octant);
+   // If pool is not NULL, cells are taken from and given back to it instead of the heap
+   Cell * addSubcell(int octant, CellPool * pool = NULL);
+   void attachSubcell(int octant, Cell * subcell);
+   void removeSubcell(int octant, CellPool * pool = NULL);
+   void getSubcellBounds(int octant, Eigen::Vector3f& low, Eigen::Vector3f& high);
 
    Eigen::Vector3f lowBound;
    Eigen::Vector3f highBound;
    Eigen::Vector3f center;
 
    Cell * parent;
+   unsigned char octant;    // Which octant of the parent this cell occupies
+   unsigned char childMask;
+   int pendingIndex;        // Index in the octree's list of cells waiting to collapse, or -1
+   CellCullState * cull;    // Left by the last Octree::cullFrustumCoherent to reach the cell, or NULL
 
    std::vector<Cell *> subcells;
    std::vector<void *> objects;
+   std::vector<ObjectHandle> handles;  // handles[i] is the handle of objects[i]
+   BoundsList * bounds;     // NULL until the cell holds objects and the octree has an ObjectBoundsFunction
+
+private:
+   // The cell owns its bounds list and cull state, so copies would free them twice. Not implemented.
+   Cell(const Cell& other);
+   Cell& operator=(const Cell& other);
+};
+
+/* Keeps deleted cells, so cells (and the capacity of their lists) can be handed out again
+ * without allocating. Not thread safe; each thread building cells needs its own pool. */
+class CellPool {
+public:
+   ~CellPool();
+
+   Cell * acquire(Cell * parent, const Eigen::Vector3f& lowBound, const Eigen::Vector3f& highBound);
+   void release(Cell * cell);
+
+   // Moves up to count cells from this pool into another
+   void giveTo(CellPool& other, int count);
+
+   std::vector<Cell *> freeCells;
+};
+
+/* A cell reference that a rebuild thread made, waiting to be added to the object's entry */
+class PendingCellRef {
+public:
+   PendingCellRef(ObjectHandle handle, CellRef ref) : handle(handle), ref(ref) {}
+
+   ObjectHandle handle;
+   CellRef ref;
+};
+
+/* The octree API calls that work is counted under. Work done inside another API call
+ * (e.g. the removal inside update) counts toward the outer call. */
+enum OctreeApi {
+   API_INSERT,
+   API_REMOVE,
+   API_UPDATE,
+   API_QUERY,
+   API_REBUILD,   // resetWithBounds, fitToObjects and the setters that place everything again
+   API_COMPACT,
+   API_OTHER,
+   NUM_OCTREE_APIS
+};
+
+const char * OctreeApiName(OctreeApi api);
+
+/* Work counters. Only counted when built with OCTREE_STATS defined; otherwise the counting
+ * compiles to nothing and these stay 0. */
+class OctreeCounters {
+public:
+   OctreeCounters() { reset(); }
+
+   void reset();
+   void add(const OctreeCounters& other);
+
+   unsigned long long cellsVisited;
+   unsigned long long objectCellTests;     // Calls to any object-cell callback
+   unsigned long long objectObjectTests;   // Calls to objObjTest
+   unsigned long long splits;              // Subcells created
+   unsigned long long collapses;           // Subcells deleted
+   unsigned long long mapRehashes;         // Times the object -> handle map grew
+   unsigned long long bytesAllocated;      // Bytes of cells, lists and map buckets allocated
+   int deepestLevel;                       // Deepest cell level reached (adding keeps the larger)
+};
+
+class OctreeCounterStats {
+public:
+   OctreeCounters perApi[NUM_OCTREE_APIS];
+   OctreeCounters total;
+};
+
+/* Where inserting puts the cells, cell references and counts it makes. Each rebuild thread
+ * gets its own, so threads never share anything they write to. */
+class BuildContext {
+public:
+   BuildContext(CellPool * pool, std::vector<PendingCellRef> * refs, OctreeCounters * counters)
+   : pool(pool), refs(refs), counters(counters) {}
+
+   CellPool * pool;
+   std::vector<PendingCellRef> * refs;   // NULL to add cell references straight to the entries
+   OctreeCounters * counters;
+};
+
+/* A cell the bulk build still has to fill, with every object that reaches it */
+class BuildTask {
+public:
+   Cell * cell;
+   unsigned int lvl;
+   std::vector<ObjectHandle> handles;
+};
+
+/* Shape and memory use of the tree, from Octree::stats */
+class OctreeStats {
+public:
+   std::vector<int> cellsPerDepth;   // cellsPerDepth[d] is the number of cells at depth d (the root is 0)
+   std::vector<int> leafOccupancy;   // leafOccupancy[n] is the number of leaves holding n objects
+   int numCells;
+   int numLeaves;
+   int emptyLeaves;
+   int numPooledCells;               // Deleted cells kept for reuse
+
+   int numObjects;
+   int numOverflowObjects;
+   float averageCellsPerObject;      // Over the objects placed in the tree
+   int maxCellsPerObject;
+
+   size_t cellBytes;                 // Cells, pooled ones included, with their subcell lists and cull state
+   size_t objectListBytes;           // The cells' object, handle and bounds lists
+   size_t registryBytes;             // Object entries, their cell lists and the free handles
+   size_t mapBytes;                  // Slots of the object -> handle map
+   size_t totalBytes;
+};
+
+/* Targets for Octree::fitToObjects */
+class FitParams {
+public:
+   FitParams() : targetObjectsPerLeaf(8), minCellSizeRatio(2.0f), maxDepthLimit(16), padding(0.01f) {}
+
+   unsigned int targetObjectsPerLeaf;  // Leaves split once they hold more objects than this
+   float minCellSizeRatio;             // Smallest cell size, relative to the median object size
+   unsigned int maxDepthLimit;         // maxDepth is never chosen above this
+   float padding;                      // Root bounds grow by this fraction of the data's extent
+};
+
+/* The parameters Octree::fitToObjects picked, and the statistics it picked them from */
+class FitReport {
+public:
+   Eigen::Vector3f lowBound;
+   Eigen::Vector3f highBound;
+   unsigned int maxDepth;
+   unsigned int leafCapacity;
+   float medianObjectSize;   // Largest extent of the median object
+   float minCellSize;
+   int numObjects;
+};
+
+/* Views that see an object in Octree::cullFrustums: bit i is set if frustum i does */
+typedef unsigned long long ViewMask;
+#define MAX_CULL_VIEWS 64
+
+/* An object found by Octree::cullFrustums */
+class CulledObject {
+public:
+   void * object;
+   ObjectHandle handle;
+   ViewMask views;
+};
+
+typedef std::vector<CulledObject> CullList;
+
+/* An object found by a swept query. The moving box overlaps the object's bounding box from
+ * tEnter to tExit, as fractions of the motion: 0 is the start and 1 the end. */
+class SweptHit {
+public:
+   void * object;
+   ObjectHandle handle;
+   float tEnter;
+   float tExit;
+};
+
+typedef std::vector<SweptHit> SweptHitList;
+
+#define NUM_CULL_PLANES 6   // Planes in a Geom::Frustumf
+
+/* State Octree::cullFrustumCoherent keeps for one view of one tree between frames. The
+ * per-cell part is in the cells, so views that take turns over one tree start over each time. */
+class CullCache {
+public:
+   CullCache();
+   void clear();   // Forgets every frame, so the next cull starts from scratch
+
+   unsigned int frame;                        // Frames culled since the last clear
+   unsigned int stamp, lastStamp;             // This and last frame's cull, distinct over every cache
+   float lastPlanes[NUM_CULL_PLANES][4];      // Last frame's planes as x, y, z, d
+   Eigen::Vector3f reference;                 // A corner of this frame's frustum
+   float normalMoved, offsetMoved;            // Most any plane's normal, and its distance to reference, changed by since
+
+   unsigned long long planeTests;   // Box-plane tests the last cull did
+   unsigned long long reusedCells;  // Cells the last cull passed or rejected because of the last frame
+
+   std::vector<float> farDists;     // Scratch for the objects of one cell
 };
 
+#define MAX_ROOT_GROWTH 32   // Most times the root may double in size for one object
+#define PARALLEL_REBUILD_MIN_OBJECTS 4096   // Smaller trees are rebuilt on one thread
+#define BUILD_TASKS_PER_THREAD 8   // Subtrees split off per rebuild thread, so threads even out
+#define BUILD_MIN_SPLIT_OBJECTS 256   // Cells with fewer objects are left whole for one thread
+#define BUILD_OUTSIDE_ROOT 0x100
+#define DEFAULT_TRACE_CAPACITY 4096   // Trace events kept before the oldest are overwritten
+
 /* Class for efficiently accessing generic objects by location in 3D space.
  */
 class Octree {
@@ -45,17 +404,108 @@ public:
    );
    ~Octree();
 
-   /* Inserts the object to the quadtree and creates nodes as necessary */
-   void insert(void * object);
+   /**
+    * Inserts the object to the octree and creates nodes as necessary. Returns the object's
+    * handle, which can be passed to the other functions instead of the object to skip the
+    * object lookup. Returns INVALID_HANDLE if the object lies outside the octree.
+    * Inserting an object that is already in the tree just returns its handle.
+    */
+   ObjectHandle insert(void * object);
 
-   /* Removes the object from the quadtree */
+   /* Removes the object from the octree. The void * overloads here and below first find the
+    * object's handle in a hash table; only the handle overloads go straight to the object. */
    void remove(void * object);
+   void remove(ObjectHandle handle);
 
    /**
     * Moves the specified object into the correct cells. You must call this if the object is
     * warped or shifted in some way that alters the result of an intersection test.
+    * The object keeps its handle, unless it moved where insert would have returned
+    * INVALID_HANDLE: then it is removed from the tree and its handle freed.
     */
    void update(void * object);
+   void update(ObjectHandle handle);
+
+   /**
+    * Updates count objects at once, as update(handle) does for each. Every object is taken
+    * out before any is placed again, and emptied cells are only collapsed at the end, so a
+    * cell one object leaves and another enters isn't deleted and created again. Handles
+    * that appear more than once are placed once.
+    */
+   void update(const ObjectHandle * handles, int count);
+
+   /* Returns the handle of an object in the tree, or INVALID_HANDLE if it isn't in the tree */
+   ObjectHandle getHandle(void * object) const;
+
+   /* Returns the object of a handle returned by insert */
+   void * getObject(ObjectHandle handle) const;
+
+   /**
+    * Makes every cell keep a copy of its objects' bounding boxes, which queries use to skip
+    * the object-object test for objects whose boxes don't overlap the query's box.
+    * Query objects are passed to the bounds function as well, so it must understand them.
+    * Pass NULL to turn this off.
+    */
+   void setObjectBoundsFunction(ObjectBoundsFunction objectBounds);
+
+   /**
+    * Switches the octree to loose cells: every cell is treated as if it were looseness
+    * times its size (around the same center), and every object is stored in exactly one
+    * cell, picked from the object's bounding box center and size. This avoids copying
+    * large objects into many cells. Needs an ObjectBoundsFunction. objectInCellTest is not
+    * used for placement then, and cell tests passed to testIntersectionOutside are given
+    * cells with the loose bounds. A looseness of 1 or less turns loose cells off.
+    * All objects are placed again.
+    */
+   void setLooseness(float looseness);
+
+   /**
+    * Makes the octree store every object once, in the deepest cell that fully contains it
+    * (which may be an internal cell), instead of in every max depth cell it touches.
+    * Queries test the objects of the internal cells they pass through. Ignored while loose
+    * cells are on. Pass NULL to go back to storing objects in max depth cells.
+    * All objects are placed again.
+    */
+   void setContainmentTest(ObjectCellContainmentTest objectContainedTest);
+
+   /**
+    * Gives the octree a test that finds every subcell an object touches in one call (bit i
+    * for octant i, see Cell::getSubcellBounds), used when placing objects instead of calling
+    * objectInCellTest on each of the eight. It must agree with objectInCellTest. Pass NULL to
+    * go back to testing the subcells one at a time.
+    */
+   void setOctantsTest(ObjectOctantsTest objectOctantsTest);
+
+   /**
+    * When on, inserting or updating an object that lies outside the root grows the tree:
+    * a new root twice as big is made with the old root as one of its octants, until the
+    * object fits. The existing cells are kept, and maxDepth goes up by one for each growth
+    * so max depth cells keep their size. The root never grows past lowLimit/highLimit.
+    */
+   void setAutoGrow(bool autoGrow, Eigen::Vector3f lowLimit, Eigen::Vector3f highLimit);
+
+   /**
+    * When on, objects that can't be placed in the tree (even after growing) are kept in an
+    * overflow list instead of being dropped. Queries test them one by one.
+    */
+   void setKeepOverflow(bool keepOverflow);
+   ObjectList& getOverflowObjects();
+
+   /**
+    * When deferred, removing objects no longer deletes the cells they leave empty right away.
+    * The empty cells are only remembered, and get deleted by compact(), so an object that is
+    * removed and inserted again doesn't make the tree collapse and re-split the same cells.
+    * If autoCompactThreshold is not 0, compact() runs by itself once that many cells are
+    * waiting to be collapsed. Turning deferral off collapses everything that is waiting.
+    */
+   void setDeferredCollapse(bool deferred, unsigned int autoCompactThreshold);
+
+   /**
+    * Deletes empty cells left behind by removals while in deferred collapse mode.
+    * Stops after roughly maxMicros microseconds; 0 means no limit.
+    * Returns the number of cells still waiting to be collapsed.
+    */
+   int compact(unsigned int maxMicros);
 
    /**
     * Removes all data from the octree.
@@ -63,10 +513,50 @@ public:
    void clear();
 
    /**
-    *
+    * Changes the bounds of the root and places every object again. Objects keep their
+    * handles, and the memory of the old cells is reused. With max depth placement and
+    * enough objects, the subtrees of the root's octants are rebuilt on separate threads,
+    * so the tree's callbacks must be safe to call from several threads at once.
     */
    void resetWithBounds(Eigen::Vector3f lowBound, Eigen::Vector3f highBound);
 
+   /**
+    * Lets leaves above max depth hold objects until they hold leafCapacity of them, at which
+    * point they split. Dense regions then get deep leaves while sparse regions stay shallow.
+    * 0 (the default) stores objects in max depth cells only. All objects are placed again.
+    */
+   void setLeafCapacity(unsigned int leafCapacity);
+
+   /**
+    * Picks the root bounds, maxDepth and leaf capacity from the objects in the tree, then
+    * places everything again. The root tightly wraps the objects' bounding boxes, maxDepth
+    * stops cells from getting smaller than minCellSizeRatio times the median object, and
+    * leaves split past targetObjectsPerLeaf objects. Needs an ObjectBoundsFunction.
+    * Returns what was picked.
+    */
+   FitReport fitToObjects(const FitParams& params);
+
+   /* Most threads resetWithBounds may use. 1 rebuilds on the calling thread only. */
+   void setRebuildThreads(unsigned int numThreads);
+
+   /* Work counted since the last resetCounters, per API call. Needs OCTREE_STATS. */
+   OctreeCounterStats getCounterStats() const;
+   void resetCounters();
+
+   /* Walks the tree and reports its shape and the memory it uses */
+   OctreeStats stats() const;
+
+   /**
+    * Latencies of the API calls since the last resetTrace, and the most recent calls as trace
+    * events carrying the depth they reached and the cells they touched. Only recorded when
+    * built with OCTREE_TRACE. Calls made inside another API call are part of the outer one.
+    */
+   const LatencyHistogram& getLatencyHistogram(OctreeApi api) const;
+   const TraceRing& getTraceEvents() const;
+   void setTraceCapacity(unsigned int capacity);
+   bool writeChromeTrace(const char * fileName);   // Returns false if the file couldn't be written
+   void resetTrace();
+
    /**
     * Tests for intersection between a specified object already inside the tree, and any other
     * objects within the tree. This is faster than calling testIntersectionOutside.
@@ -79,6 +569,11 @@ public:
       ObjectObjectIntersectionTest objObjTest,
       ObjectList * collisions
    );
+   bool testIntersectionInside(
+      ObjectHandle handle,
+      ObjectObjectIntersectionTest objObjTest,
+      ObjectList * collisions
+   );
 
    /**
     * Tests for intersection between a specified object that is not present inside the tree,
@@ -112,24 +607,169 @@ public:
       ObjectList * collisions
    );
 
+   /**
+    * Finds the objects whose bounding boxes are at least partly inside any of the frustums
+    * (at most MAX_CULL_VIEWS), in one pass over the tree. Each cell is only tested against
+    * the views that still see part of it: views that see none of it are dropped for its
+    * subtree, and views that see all of it pass everything below without more tests. Each
+    * object is listed once in visible (which is cleared first), with every view that sees
+    * it. Needs an ObjectBoundsFunction. Returns the number of objects found.
+    */
+   int cullFrustums(const Geom::Frustumf * frustums, int numFrustums, CullList& visible);
+
+   /**
+    * Finds the objects whose bounding boxes are at least partly inside the frustum, like
+    * cullFrustums with one view, using what the cache remembers from the last frame. A cell
+    * that was outside a plane is tested against that plane first. A cell that was inside
+    * the frustum last frame, by more than its planes have moved since, is passed whole
+    * without any tests, and a subcell that was outside a plane by more is skipped without
+    * reading it. Below that, cells and objects are only tested against the planes their
+    * parent straddles. The cells keep what the last cull to reach them found, so coherence
+    * holds for one view per tree; culling another view in between is correct but makes
+    * this one start over. Needs an ObjectBoundsFunction. Returns the number of objects found.
+    */
+   int cullFrustumCoherent(const Geom::Frustumf& frustum, CullCache& cache, CullList& visible);
+
+   /**
+    * Finds the objects whose bounding boxes the box touches as it moves by motion, so fast
+    * objects can't pass through thin ones between steps. Only cells the swept box touches
+    * are visited. Each object is listed once in hits (which is cleared first), in order of
+    * tEnter. The times are exact for the bounding boxes, so the object itself can only be
+    * hit between its tEnter and tExit. Needs an ObjectBoundsFunction. Returns the number of
+    * objects found.
+    */
+   int sweepBox(const Geom::AABBf& box, const Eigen::Vector3f& motion, SweptHitList& hits);
+
+   /* The same for a sphere, which is swept as its bounding box. Hits are candidates: the
+    * sphere can touch nothing before tEnter, but may miss near the box's corners. */
+   int sweepSphere(const Geom::Spheref& sphere, const Eigen::Vector3f& motion, SweptHitList& hits);
+
    Cell * rootCell;
 
 private:
-   void addCellToMap(void * object, Cell * cell);
-   void insertHelper(void * object, Cell * cell, int lvl);
-   void removeSubcellsAndClimbIfEmpty(Cell * cell);
+   // The tree owns its cells, so copies would free them twice. Not implemented.
+   Octree(const Octree& other);
+   Octree& operator=(const Octree& other);
+
+   ObjectHandle createHandle(void * object);
+   void destroyHandle(ObjectHandle handle);
+   bool isValidHandle(ObjectHandle handle) const;
+   bool placeObject(ObjectHandle handle);
+   bool placeObjectInTree(ObjectHandle handle);
+   bool growRootToward(void * object);
+   void getGrownRootBounds(int rootOctant, Eigen::Vector3f& low, Eigen::Vector3f& high);
+   void replaceStraddlers(const Eigen::Vector3f& oldLow, const Eigen::Vector3f& oldHigh);
+   void clearCells();
+   bool placeObjectLoose(ObjectHandle handle);
+   bool placeObjectEnclosing(ObjectHandle handle);
+   bool isLoose();
+   bool objectTouchesCell(void * object, Cell * cell, ObjectCellIntersectionTest objCellTest);
+   bool boxTouchesCell(const Eigen::Vector3f& low, const Eigen::Vector3f& high, Cell * cell);
+   bool testIntersectionBoxHelper(
+      void * specObj,
+      Cell * cell,
+      const Eigen::Vector3f& specLow,
+      const Eigen::Vector3f& specHigh,
+      ObjectObjectIntersectionTest objObjTest,
+      ObjectList * collisions
+   );
+   void unplaceObject(ObjectHandle handle);
+   int addObjectToCell(ObjectHandle handle, Cell * cell, OctreeCounters * counters);
+   void removeObjectFromCell(int slot, Cell * cell);
+   void fillBoundsRecursive(Cell * cell);
+   void statsRecursive(Cell * cell, int depth, OctreeStats& stats) const;
+   bool testObjectsInCell(
+      void * specObj,
+      Cell * cell,
+      const Eigen::Vector3f& specLow,
+      const Eigen::Vector3f& specHigh,
+      ObjectObjectIntersectionTest objObjTest,
+      ObjectList * collisions
+   );
+   BuildContext serialContext();
+   OctreeCounters * counters();
+   Cell * newSubcell(Cell * cell, int octant, BuildContext& context);
+   void deleteSubcell(Cell * cell, int octant, OctreeCounters * counters);
+   void insertHelper(ObjectHandle handle, Cell * cell, unsigned int lvl, BuildContext& context);
+   void insertIntoSubcells(ObjectHandle handle, Cell * cell, unsigned int lvl, BuildContext& context);
+   void splitFullLeaf(Cell * cell, unsigned int lvl, BuildContext& context);
+   void placeInCell(ObjectHandle handle, Cell * cell, BuildContext& context);
+   bool reachesRoot(ObjectHandle handle, OctreeCounters * counters);
+   unsigned int buildOctants(ObjectHandle handle, Cell * cell, unsigned int lvl, OctreeCounters * counters);
+   void classifyTask(const BuildTask * task, int begin, int end, unsigned int * masks, OctreeCounters * counters);
+   void partitionTask(BuildTask& task, const unsigned int * masks, std::vector<BuildTask>& subtasks, BuildContext& context);
+   void partitionTaskParallel(BuildTask& task, int numThreads, std::vector<BuildTask>& subtasks);
+   void buildTasks(std::vector<BuildTask> * tasks, std::atomic<int> * next, BuildContext * context);
+   void rebuildParallel();
+   void pruneEmptyLeaves(Cell * cell);
+   void removeCellAndClimbIfEmpty(Cell * cell);
+   void markPendingCollapse(Cell * cell);
+   void unmarkPendingCollapse(Cell * cell);
    void clearCellRecursive(Cell * cell);
+   bool testIntersectionInsideHelper(
+      ObjectHandle handle,
+      const Eigen::Vector3f& specLow,
+      const Eigen::Vector3f& specHigh,
+      ObjectObjectIntersectionTest objObjTest,
+      ObjectList * collisions
+   );
    bool testIntersectionOutsideHelper(
       void * specObj,
       Cell * cell,
+      const Eigen::Vector3f& specLow,
+      const Eigen::Vector3f& specHigh,
       ObjectCellIntersectionTest objCellTest,
       ObjectObjectIntersectionTest objObjTest,
       ObjectList * collisions
    );
 
-   CellMap cellMap;
+   void cullHelper(Cell * cell, const Geom::Frustumf * frustums, ViewMask partial, ViewMask inside, CullList& visible);
+   void cullObjectsInCell(Cell * cell, const Geom::Frustumf * frustums, ViewMask partial, ViewMask inside, CullList& visible);
+   void addCulledObject(Cell * cell, int index, ViewMask views, CullList& visible);
+   float coherentCullHelper(Cell * cell, const Geom::Frustumf& frustum, unsigned int planes, float margin, CullCache& cache, CullList& visible);
+   void coherentCullObjects(Cell * cell, const Geom::Frustumf& frustum, unsigned int planes, CullCache& cache, CullList& visible);
+   void addVisibleSubtree(Cell * cell, CullList& visible);
+   void sweepHelper(Cell * cell, const Geom::AABBf& box, const Eigen::Vector3f& motion, SweptHitList& hits);
+   void sweepObjectsInCell(Cell * cell, const Geom::AABBf& box, const Eigen::Vector3f& motion, SweptHitList& hits);
+
+   std::vector<ObjectEntry> objectEntries;
+   std::vector<ObjectHandle> freeHandles;
+   HandleMap handleMap;
    unsigned int maxDepth;
    ObjectCellIntersectionTest objectInCellTest;
+   ObjectBoundsFunction objectBounds;
+   float looseness;
+   ObjectCellContainmentTest objectContainedTest;
+   ObjectOctantsTest objectOctantsTest;
+
+   bool autoGrow;
+   Eigen::Vector3f growLowLimit;
+   Eigen::Vector3f growHighLimit;
+   bool keepOverflow;
+   Cell * overflowCell;     // Not part of the tree. Holds the objects that fit nowhere.
+
+   unsigned int leafCapacity;
+   CellPool cellPool;
+   unsigned int rebuildThreads;
+
+   friend class ApiScope;
+   void beginApi(OctreeApi api);
+   void endApi();
+
+   OctreeCounters apiCounters[NUM_OCTREE_APIS];
+   OctreeCounters callCounters;       // Counts of the API call running now
+   int currentApi;
+
+   LatencyHistogram latencies[NUM_OCTREE_APIS];
+   TraceRing traceEvents;
+   std::chrono::steady_clock::time_point traceStart;
+   std::chrono::steady_clock::time_point callStart;
+
+   bool deferCollapse;
+   unsigned int autoCompactThreshold;
+   std::vector<Cell *> pendingCells;
+
+   std::vector<int> handleSlots;   // Index of each handle in the list a cull or sweep is filling, or -1
 };
 
 #endif // __OCTREE_H__
\ No newline at end of file
@@ -0,0 +1,140 @@
+
+#include "octree_trace.h"
+
+#include <algorithm>
+#include <math.h>
+
+#define SUB_BUCKET_BITS 5
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+
+LatencyHistogram::LatencyHistogram() {
+   reset();
+}
+
+// Values below SUB_BUCKETS are their own index. Larger values are found by their highest
+// set bit, then by the SUB_BUCKET_BITS bits below it.
+int LatencyHistogram::bucketIndex(unsigned long long nanos) {
+   if (nanos < SUB_BUCKETS)
+      return (int) nanos;
+   int highBit = 63 - __builtin_clzll(nanos);
+   int shift = highBit - SUB_BUCKET_BITS;
+   int subBucket = (int) (nanos >> shift) - SUB_BUCKETS;
+   return (shift + 1) * SUB_BUCKETS + subBucket;
+}
+
+// Largest value that lands in the bucket
+unsigned long long LatencyHistogram::bucketHighValue(int index) {
+   if (index < SUB_BUCKETS)
+      return index;
+   int shift = index / SUB_BUCKETS - 1;
+   unsigned long long subBucket = index % SUB_BUCKETS + SUB_BUCKETS;
+   return ((subBucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(unsigned long long nanos) {
+   int index = bucketIndex(nanos);
+   if ((int) counts.size() <= index)
+      counts.resize(index + 1, 0);
+   counts[index]++;
+
+   totalCount++;
+   minValue = std::min(minValue, nanos);
+   maxValue = std::max(maxValue, nanos);
+   sum += nanos;
+}
+
+void LatencyHistogram::add(const LatencyHistogram& other) {
+   if (counts.size() < other.counts.size())
+      counts.resize(other.counts.size(), 0);
+   for (size_t i = 0; i < other.counts.size(); i++) {
+      counts[i] += other.counts[i];
+   }
+
+   totalCount += other.totalCount;
+   minValue = std::min(minValue, other.minValue);
+   maxValue = std::max(maxValue, other.maxValue);
+   sum += other.sum;
+}
+
+void LatencyHistogram::reset() {
+   counts.clear();
+   totalCount = 0;
+   minValue = ~0ULL;
+   maxValue = 0;
+   sum = 0.0;
+}
+
+unsigned long long LatencyHistogram::count() const {
+   return totalCount;
+}
+
+unsigned long long LatencyHistogram::min() const {
+   return totalCount > 0 ? minValue : 0;
+}
+
+unsigned long long LatencyHistogram::max() const {
+   return maxValue;
+}
+
+double LatencyHistogram::mean() const {
+   return totalCount > 0 ? sum / totalCount : 0.0;
+}
+
+unsigned long long LatencyHistogram::valueAtPercentile(double p) const {
+   if (totalCount == 0)
+      return 0;
+
+   unsigned long long target = (unsigned long long) ceil(p * totalCount);
+   target = std::max(target, 1ULL);
+   unsigned long long seen = 0;
+   for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= target)
+         return std::min(bucketHighValue(i), maxValue);
+   }
+   return maxValue;
+}
+
+TraceRing::TraceRing(unsigned int capacity) : events(capacity), next(0), count(0) {}
+
+void TraceRing::push(const TraceEvent& event) {
+   if (events.size() == 0)
+      return;
+
+   events[next] = event;
+   next = (next + 1) % events.size();
+   count = std::min(count + 1, (unsigned int) events.size());
+}
+
+void TraceRing::clear() {
+   next = 0;
+   count = 0;
+}
+
+void TraceRing::setCapacity(unsigned int capacity) {
+   events.resize(capacity);
+   clear();
+}
+
+unsigned int TraceRing::size() const {
+   return count;
+}
+
+const TraceEvent& TraceRing::operator[](unsigned int index) const {
+   unsigned int oldest = (next + events.size() - count) % events.size();
+   return events[(oldest + index) % events.size()];
+}
+
+bool TraceRing::writeChromeTrace(FILE * file) const {
+   fprintf(file, "{\"traceEvents\": [\n");
+   for (unsigned int i = 0; i < count; i++) {
+      const TraceEvent& event = (*this)[i];
+      // Chrome wants microseconds
+      fprintf(file, "  {\"name\": \"%s\", \"cat\": \"octree\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"depth\": %d, \"cells\": %llu}}%s\n",
+         event.name, event.startNanos / 1000.0, event.durationNanos / 1000.0,
+         event.depth, event.cellsTouched, i + 1 < count ? "," : "");
+   }
+   fprintf(file, "], \"displayTimeUnit\": \"ns\"}\n");
+   return !ferror(file);
+}
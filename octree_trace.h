@@ -0,0 +1,69 @@
+#ifndef __OCTREE_TRACE_H__
+#define __OCTREE_TRACE_H__
+
+#include <stdio.h>
+#include <vector>
+
+/* Histogram of latencies in nanoseconds with a fixed relative error. Values below 32 get a
+ * bucket each; above that every power of two is split into 32 buckets, so a reported value
+ * is never more than about 3% above the value recorded. */
+class LatencyHistogram {
+public:
+   LatencyHistogram();
+
+   void record(unsigned long long nanos);
+   void add(const LatencyHistogram& other);
+   void reset();
+
+   unsigned long long count() const;
+   unsigned long long min() const;
+   unsigned long long max() const;
+   double mean() const;
+
+   /* Smallest value that at least the fraction p (0 to 1) of the recorded values are at or below */
+   unsigned long long valueAtPercentile(double p) const;
+
+private:
+   static int bucketIndex(unsigned long long nanos);
+   static unsigned long long bucketHighValue(int index);
+
+   std::vector<unsigned long long> counts;
+   unsigned long long totalCount;
+   unsigned long long minValue;
+   unsigned long long maxValue;
+   double sum;
+};
+
+/* One traced API call */
+class TraceEvent {
+public:
+   const char * name;
+   unsigned long long startNanos;      // Since the trace started
+   unsigned long long durationNanos;
+   int depth;                          // Deepest level the call reached
+   unsigned long long cellsTouched;
+};
+
+/* Keeps the most recent trace events, overwriting the oldest once full */
+class TraceRing {
+public:
+   TraceRing(unsigned int capacity);
+
+   void push(const TraceEvent& event);
+   void clear();
+   void setCapacity(unsigned int capacity);   // Drops every event
+
+   unsigned int size() const;
+   const TraceEvent& operator[](unsigned int index) const;   // 0 is the oldest event
+
+   /* Writes the events in Chrome's trace event format (chrome://tracing or Perfetto).
+    * Returns false if the file couldn't be written. */
+   bool writeChromeTrace(FILE * file) const;
+
+private:
+   std::vector<TraceEvent> events;
+   unsigned int next;    // Where the next event goes
+   unsigned int count;
+};
+
+#endif
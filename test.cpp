@@ -1,11 +1,60 @@
 
 #include "test.h"
+#include <algorithm>
+#include <string>
 #include "geometry.h"
+#include "matrix_math.h"
+#include "mesh_octree.h"
 #include "octree.h"
 
 using namespace Eigen;
 using namespace Geom;
 
+static bool boxInCellTest(void * object, Cell * cell) {
+   AABBf * box = (AABBf *) object;
+   return box->lowBound(0) <= cell->highBound(0) && box->highBound(0) >= cell->lowBound(0) &&
+          box->lowBound(1) <= cell->highBound(1) && box->highBound(1) >= cell->lowBound(1) &&
+          box->lowBound(2) <= cell->highBound(2) && box->highBound(2) >= cell->lowBound(2);
+}
+
+static bool boxBoxTest(void * objectOut, void * objectIn) {
+   AABBf * a = (AABBf *) objectOut;
+   AABBf * b = (AABBf *) objectIn;
+   return a->lowBound(0) <= b->highBound(0) && a->highBound(0) >= b->lowBound(0) &&
+          a->lowBound(1) <= b->highBound(1) && a->highBound(1) >= b->lowBound(1) &&
+          a->lowBound(2) <= b->highBound(2) && a->highBound(2) >= b->lowBound(2);
+}
+
+static void boxBounds(void * object, Vector3f& lowBound, Vector3f& highBound) {
+   AABBf * box = (AABBf *) object;
+   lowBound = box->lowBound;
+   highBound = box->highBound;
+}
+
+static bool sphereInCellTest(void * object, Cell * cell) {
+   AABBf box(cell->lowBound, cell->highBound);
+   return DoesIntersect(*(Spheref *) object, box);
+}
+
+static unsigned int sphereOctantsTest(void * object, Cell * cell) {
+   AABBf box(cell->lowBound, cell->highBound);
+   return IntersectingOctants(*(Spheref *) object, box);
+}
+
+static int numBoxBoxTests = 0;
+
+static bool countingBoxBoxTest(void * objectOut, void * objectIn) {
+   numBoxBoxTests++;
+   return boxBoxTest(objectOut, objectIn);
+}
+
+static bool boxInsideCellTest(void * object, Cell * cell) {
+   AABBf * box = (AABBf *) object;
+   return box->lowBound(0) >= cell->lowBound(0) && box->highBound(0) <= cell->highBound(0) &&
+          box->lowBound(1) >= cell->lowBound(1) && box->highBound(1) <= cell->highBound(1) &&
+          box->lowBound(2) >= cell->lowBound(2) && box->highBound(2) <= cell->highBound(2);
+}
+
 int main() {
    printf("Testing geometry\n");
 
@@ -103,6 +152,26 @@ int main() {
       boolCheck(DoesIntersect(ray, tri), true);
    }
 
+   // Test DoesIntersect (ray and triangle, with the hit)
+   {
+      Trianglef tri(Vector3f(-2,0,0), Vector3f(2,0,0), Vector3f(0,0,2));   // Faces -y
+      Rayf front(Vector3f(0,-2,1), Vector3f(0,1,0));
+      Rayf back(Vector3f(0,2,1), Vector3f(0,-1,0));
+      Rayf behind(Vector3f(0,2,1), Vector3f(0,1,0));
+      Rayf parallel(Vector3f(0,0,-1), Vector3f(0,0,1));
+      TriangleHitf hit;
+      boolCheck(DoesIntersect(front, tri, 10, hit), true);
+      equalityFloatCheck(hit.t, 2, 1e-5);
+      equalityFloatCheck(hit.u, 0.25, 1e-5);
+      equalityFloatCheck(hit.v, 0.5, 1e-5);
+      boolCheck(DoesIntersect(front, tri, 10, hit, true), true);
+      boolCheck(DoesIntersect(back, tri, 10, hit), true);
+      boolCheck(DoesIntersect(back, tri, 10, hit, true), false);
+      boolCheck(DoesIntersect(front, tri, 1.5, hit), false);
+      boolCheck(DoesIntersect(behind, tri, 10, hit), false);
+      boolCheck(DoesIntersect(parallel, tri, 10, hit), false);
+   }
+
    // Test DoesIntersect (ray and sphere)
    {
       Rayf ray(Vector3f(1,1,0), Vector3f(1,0,0));
@@ -196,6 +265,364 @@ int main() {
       boolCheck(DoesIntersect(sphere, box), false);
    }
 
+   // Test DoesIntersect (triangle and box)
+   {
+      AABBf box(Vector3f(0,0,0), Vector3f(1,1,1));
+      Trianglef inside(Vector3f(0.2,0.2,0.5), Vector3f(0.8,0.2,0.5), Vector3f(0.5,0.8,0.5));
+      Trianglef beside(Vector3f(2,0,0), Vector3f(3,0,0), Vector3f(2,1,0));
+      Trianglef pastCorner(Vector3f(3.2,0,0), Vector3f(0,3.2,0), Vector3f(0,0,3.2));   // Only its normal separates
+      Trianglef pastEdge(Vector3f(2,0.2,0.5), Vector3f(0.2,2,0.5), Vector3f(2,2,-3));    // Only an edge cross product separates
+      Trianglef touching(Vector3f(1,0.5,0.5), Vector3f(2,0.5,0.5), Vector3f(2,0.6,0.5));
+      Trianglef through(Vector3f(-5,-5,0.5), Vector3f(5,-5,0.5), Vector3f(0,10,0.5));   // No corner inside
+      boolCheck(DoesIntersect(inside, box), true);
+      boolCheck(DoesIntersect(beside, box), false);
+      boolCheck(DoesIntersect(pastCorner, box), false);
+      boolCheck(DoesIntersect(pastEdge, box), false);
+      boolCheck(DoesIntersect(touching, box), true);
+      boolCheck(DoesIntersect(through, box), true);
+   }
+
+   // Test DoesIntersect (ray parallel to a face, outside the box)
+   {
+      Rayf ray(Vector3f(0,2,0), Vector3f(1,0,0));
+      AABBf box(Vector3f(0,0,0), Vector3f(1,1,1));
+      boolCheck(DoesIntersect(ray, box), false);
+   }
+
+   printf("Testing batch functions\n");
+
+   // Test that the batch tests agree with the single tests, including the partial last lanes
+   {
+      unsigned int seed = 7;
+      float values[37 * 12];
+      for (int i = 0; i < 37 * 12; i++) {
+         seed = seed * 1103515245 + 12345;
+         values[i] = (seed >> 8) % 2000 / 500.0f - 2.0f;   // -2 to 2
+      }
+
+      AABBSoAf boxes;
+      SphereSoAf spheres;
+      RaySoAf rays;
+      PointSoAf points;
+      std::vector<AABBf> boxList;
+      std::vector<Rayf> rayList;
+      std::vector<Spheref> sphereList;
+      for (int i = 0; i < 37; i++) {
+         float * v = &values[i * 12];
+         Vector3f low(v[0], v[1], v[2]);
+         AABBf box(low, low + Vector3f(fabs(v[3]), fabs(v[4]), fabs(v[5])));
+         Vector3f dir(v[6], v[7], (i % 5 == 0) ? 0.0f : v[8]);   // Some rays parallel to z slabs
+         Rayf ray(Vector3f(v[9], v[10], v[11]) * 2.0f, dir.normalized());
+         Spheref sphere(Vector3f(v[9], v[10], v[11]), fabs(v[3]));
+         boxes.push(box);
+         rays.push(ray);
+         spheres.push(sphere);
+         points.push(low);
+         boxList.push_back(box);
+         rayList.push_back(ray);
+         sphereList.push_back(sphere);
+      }
+
+      AABBf unitBox(Vector3f(0,0,0), Vector3f(1,1,1));
+      Spheref unitSphere(Vector3f(0.5,0.5,0.5), 1);
+      Rayf diagonal(Vector3f(-1,-1,-1), Vector3f(1,1,1).normalized());
+      Frustumf frustum(Vector3f(-1,-1,1), Vector3f(1,-1,1), Vector3f(-1,1,1), Vector3f(1,1,1),
+                       Vector3f(-2,-2,-1), Vector3f(2,-2,-1), Vector3f(-2,2,-1), Vector3f(2,2,-1));
+
+      BitMask rayBoxHits, raysBoxHits, raySphereHits, raysSphereHits, frustumHits;
+      int numRayBox = DoesIntersect(diagonal, boxes, rayBoxHits);
+      int numRaysBox = DoesIntersect(rays, unitBox, raysBoxHits);
+      int numRaySphere = DoesIntersect(diagonal, spheres, raySphereHits);
+      int numRaysSphere = DoesIntersect(rays, unitSphere, raysSphereHits);
+      int numFrustum = Contains(frustum, points, frustumHits);
+      equalityIntCheck(rayBoxHits.size(), 2);
+
+      int mismatches = 0;
+      int expRayBox = 0, expRaysBox = 0, expRaySphere = 0, expRaysSphere = 0, expFrustum = 0;
+      for (int i = 0; i < 37; i++) {
+         Vector3f point = boxList[i].lowBound;
+         bool rayBox = DoesIntersect(diagonal, boxList[i]);
+         bool raysBox = DoesIntersect(rayList[i], unitBox);
+         bool raySphere = DoesIntersect(diagonal, sphereList[i]);
+         bool raysSphere = DoesIntersect(rayList[i], unitSphere);
+         bool inFrustum = frustum.contains(point);
+         mismatches += (TestBit(rayBoxHits, i) != rayBox) + (TestBit(raysBoxHits, i) != raysBox) +
+                       (TestBit(raySphereHits, i) != raySphere) + (TestBit(raysSphereHits, i) != raysSphere) +
+                       (TestBit(frustumHits, i) != inFrustum);
+         expRayBox += rayBox;
+         expRaysBox += raysBox;
+         expRaySphere += raySphere;
+         expRaysSphere += raysSphere;
+         expFrustum += inFrustum;
+      }
+      equalityIntCheck(mismatches, 0);
+      equalityIntCheck(numRayBox, expRayBox);
+      equalityIntCheck(numRaysBox, expRaysBox);
+      equalityIntCheck(numRaySphere, expRaySphere);
+      equalityIntCheck(numRaysSphere, expRaysSphere);
+      equalityIntCheck(numFrustum, expFrustum);
+      boolCheck(expRayBox > 0 && expRayBox < 37, true);   // The data hits some and misses some
+      boolCheck(expFrustum > 0 && expFrustum < 37, true);
+   }
+
+   // Test IntersectingOctants against testing each octant, including spheres on the center planes
+   {
+      AABBf box(Vector3f(-1,0,2), Vector3f(1,1,4));
+      Cell cell(NULL, box.lowBound, box.highBound);
+      unsigned int seed = 5;
+      int mismatches = 0;
+      int numPartial = 0;
+      for (int i = 0; i < 200; i++) {
+         float v[4];
+         for (int j = 0; j < 4; j++) {
+            seed = seed * 1103515245 + 12345;
+            v[j] = (seed >> 8) % 2000 / 500.0f - 2.0f;
+         }
+         Vector3f center(i % 7 == 0 ? 0.0f : v[0], 0.5f + v[1] / 2.0f, 3.0f + v[2]);
+         Spheref sphere(center, fabs(v[3]) / 2.0f);
+         unsigned int octants = IntersectingOctants(sphere, box);
+         for (int octant = 0; octant < 8; octant++) {
+            Vector3f low, high;
+            cell.getSubcellBounds(octant, low, high);
+            AABBf octantBox(low, high);
+            mismatches += ((octants >> octant) & 1) != DoesIntersect(sphere, octantBox);
+         }
+         numPartial += (octants != 0 && octants != 0xFF);
+      }
+      equalityIntCheck(mismatches, 0);
+      boolCheck(numPartial > 0, true);
+   }
+
+   // Test the batch sphere-box tests, which are exact at the corners
+   {
+      AABBSoAf boxes;
+      boxes.push(AABBf(Vector3f(0,0,0), Vector3f(1,1,1)));
+      boxes.push(AABBf(Vector3f(2,2,2), Vector3f(3,3,3)));
+      boxes.push(AABBf(Vector3f(-1,-1,-1), Vector3f(1,1,1)));
+      Spheref cornerSphere(Vector3f(-0.475,-0.475,0.0), 0.5);   // 0.672 away from the corner
+      BitMask hits;
+      equalityIntCheck(DoesIntersect(cornerSphere, boxes, hits), 1);
+      boolCheck(TestBit(hits, 0), false);
+      boolCheck(TestBit(hits, 2), true);
+
+      SphereSoAf spheres;
+      spheres.push(cornerSphere);
+      spheres.push(Spheref(Vector3f(-0.3,-0.3,0.0), 0.5));   // 0.424 away from the corner
+      spheres.push(Spheref(Vector3f(0.5,0.5,0.5), 0.1));
+      equalityIntCheck(DoesIntersect(spheres, AABBf(Vector3f(0,0,0), Vector3f(1,1,1)), hits), 2);
+      boolCheck(TestBit(hits, 0), false);
+      boolCheck(TestBit(hits, 1), true);
+   }
+
+   // Test that every instruction set the CPU supports gives the scalar results
+   {
+      AABBSoAf boxes;
+      SphereSoAf spheres;
+      RaySoAf rays;
+      PointSoAf points;
+      TriangleSoAf triangles;
+      std::vector<Trianglef> triangleList;
+      unsigned int seed = 11;
+      for (int i = 0; i < 101; i++) {
+         float v[6];
+         for (int j = 0; j < 6; j++) {
+            seed = seed * 1103515245 + 12345;
+            v[j] = (seed >> 8) % 2000 / 500.0f - 2.0f;
+         }
+         Vector3f low(v[0], v[1], v[2]);
+         boxes.push(AABBf(low, low + Vector3f(fabs(v[3]), fabs(v[4]), fabs(v[5]))));
+         spheres.push(Spheref(low, fabs(v[3])));
+         rays.push(Rayf(low * 2.0f, Vector3f(v[3], v[4], (i % 3 == 0) ? 0.0f : v[5]).normalized()));
+         points.push(low);
+         Trianglef triangle(low, low + Vector3f(v[3], v[4], 0), low + Vector3f(0, v[5], v[3]));
+         triangles.push(triangle);
+         triangleList.push_back(triangle);
+      }
+      Rayf ray(Vector3f(-1,-1,-1), Vector3f(1,1,1).normalized());
+      Spheref sphere(Vector3f(0.5,0.5,0.5), 1);
+      AABBf box(Vector3f(0,0,0), Vector3f(1,1,1));
+      Frustumf frustum(Vector3f(-1,-1,1), Vector3f(1,-1,1), Vector3f(-1,1,1), Vector3f(1,1,1),
+                       Vector3f(-2,-2,-1), Vector3f(2,-2,-1), Vector3f(-2,2,-1), Vector3f(2,2,-1));
+
+      SimdLevel bestLevel = GetSimdLevel();
+      BitMask expected[11], got[11];
+      TriangleHitSoAf expectedHits, gotHits;
+      int mismatches = 0;
+      for (int level = SIMD_SCALAR; level < NUM_SIMD_LEVELS; level++) {
+         if (!SetSimdLevel((SimdLevel) level))
+            continue;
+         BitMask * hits = (level == SIMD_SCALAR) ? expected : got;
+         DoesIntersect(ray, boxes, hits[0]);
+         DoesIntersect(rays, box, hits[1]);
+         DoesIntersect(sphere, boxes, hits[2]);
+         DoesIntersect(spheres, box, hits[3]);
+         DoesIntersect(ray, spheres, hits[4]);
+         DoesIntersect(rays, sphere, hits[5]);
+         Contains(frustum, points, hits[6]);
+         DoesIntersect(triangles, box, hits[7]);
+         TriangleHitSoAf& triangleHits = (level == SIMD_SCALAR) ? expectedHits : gotHits;
+         DoesIntersect(ray, triangles, 3.0f, hits[8], triangleHits);
+         hits[9].assign(4, 0);    // Boxes outside the frustum
+         hits[10].assign(4, 0);   // Boxes partly inside it
+         for (int i = 0; i < 101; i++) {
+            AABBf b(Vector3f(boxes.minX[i], boxes.minY[i], boxes.minZ[i]), Vector3f(boxes.maxX[i], boxes.maxY[i], boxes.maxZ[i]));
+            FrustumClass where = Classify(frustum, b);
+            hits[9][i / 32] |= (where == FRUSTUM_OUTSIDE) << (i % 32);
+            hits[10][i / 32] |= (where == FRUSTUM_INTERSECTS) << (i % 32);
+         }
+         for (int k = 0; k < 11; k++) {
+            mismatches += (hits[k] != expected[k]);
+         }
+         for (int i = 0; i < 101; i++) {   // Fused multiply-adds can change the last bits
+            mismatches += TestBit(expected[8], i) && fabs(triangleHits.t[i] - expectedHits.t[i]) > 1e-5f;
+         }
+      }
+      for (int i = 0; i < 101; i++) {
+         TriangleHitf hit;
+         mismatches += (TestBit(expected[7], i) != DoesIntersect(triangleList[i], box));
+         mismatches += (TestBit(expected[8], i) != DoesIntersect(ray, triangleList[i], 3.0f, hit));
+      }
+      int numRayTriangles = 0, numOutside = 0, numIntersecting = 0;
+      for (int i = 0; i < 101; i++) {
+         numRayTriangles += TestBit(expected[8], i);
+         numOutside += TestBit(expected[9], i);
+         numIntersecting += TestBit(expected[10], i);
+         mismatches += TestBit(expected[9], i) && TestBit(expected[6], i);   // A box's low corner can't be inside then
+      }
+      boolCheck(numRayTriangles > 0, true);
+      boolCheck(numOutside > 0 && numIntersecting > 0 && numOutside + numIntersecting < 101, true);
+      equalityIntCheck(mismatches, 0);
+      boolCheck(SetSimdLevel(bestLevel), true);
+      boolCheck(IsSimdLevelSupported(SIMD_SCALAR), true);
+      boolCheck(SetSimdLevel(NUM_SIMD_LEVELS), false);
+   }
+
+   // Test frustums taken from a projection times view matrix
+   {
+      Matrix4f viewProjection = Mmath::PerspectiveMatrix<float>(M_PI / 2, 1, 1, 10) *
+                                Mmath::ViewMatrix<float>(Vector3f(0,0,0), Vector3f(0,0,-1), Vector3f(0,1,0));
+      Frustumf fromMatrix(viewProjection);
+      Frustumf fromCorners(Vector3f(-1,-1,-1), Vector3f(1,-1,-1), Vector3f(-1,1,-1), Vector3f(1,1,-1),
+                           Vector3f(-10,-10,-10), Vector3f(10,-10,-10), Vector3f(-10,10,-10), Vector3f(10,10,-10));
+      Vector3f points[6] = {
+         Vector3f(0,0,-5), Vector3f(4.9,-4.9,-5), Vector3f(0,0,-0.5), Vector3f(5.1,0,-5), Vector3f(0,-5.1,-5), Vector3f(0,0,-10.5)
+      };
+      for (int i = 0; i < 6; i++) {
+         boolCheck(fromMatrix.contains(points[i]), i < 2);
+         boolCheck(fromCorners.contains(points[i]), i < 2);
+      }
+      for (int i = 0; i < 4; i++) {
+         equalityFloatCheck(fromMatrix.planeX[i] * fromMatrix.planeX[i] + fromMatrix.planeZ[i] * fromMatrix.planeZ[i] +
+                            fromMatrix.planeY[i] * fromMatrix.planeY[i], 1, 1e-5);
+      }
+      equalityFloatCheck(fromMatrix.planeD[4], -1, 1e-4);   // The near plane, facing -z
+      equalityFloatCheck(fromMatrix.planeZ[4], -1, 1e-5);
+      equalityFloatCheck(fromMatrix.far.point(2), -10, 1e-3);
+
+      AABBf inside(Vector3f(-1,-1,-6), Vector3f(1,1,-4));
+      AABBf behind(Vector3f(-1,-1,1), Vector3f(1,1,2));
+      AABBf acrossRight(Vector3f(4,-1,-6), Vector3f(6,1,-4));
+      AABBf touchingNear(Vector3f(-1,-1,-1), Vector3f(1,1,0));
+      equalityIntCheck(Classify(fromMatrix, inside), FRUSTUM_INSIDE);
+      equalityIntCheck(Classify(fromMatrix, behind), FRUSTUM_OUTSIDE);
+      equalityIntCheck(Classify(fromMatrix, acrossRight), FRUSTUM_INTERSECTS);
+      equalityIntCheck(Classify(fromMatrix, touchingNear), FRUSTUM_INTERSECTS);
+      unsigned int outside, straddling;
+      ClassifyPlanes(fromMatrix, acrossRight, outside, straddling);
+      equalityIntCheck(outside, 0);
+      equalityIntCheck(straddling, 1 << 1);
+      ClassifyPlanes(fromMatrix, behind, outside, straddling);
+      boolCheck((outside >> 4) & 1, true);
+   }
+
+   printf("Testing matrix math\n");
+
+   // Test the batch transforms against transforming one vector at a time
+   {
+      const int count = 11;   // Not a whole number of vectors
+      float tx[count], ty[count], tz[count], qw[count], qx[count], qy[count], qz[count];
+      float sx[count], sy[count], sz[count];
+      float px[count], py[count], pz[count], hx[count], hy[count], hz[count];
+      float ox[count], oy[count], oz[count], oHx[count], oHy[count], oHz[count];
+      for (int i = 0; i < count; i++) {
+         Quaternionf rot = Mmath::AngleAxisQuat<float>(0.4f * i, Vector3f(1, i % 3, 2).normalized());
+         tx[i] = i; ty[i] = -2.0f * i; tz[i] = 0.5f;
+         qw[i] = rot.w(); qx[i] = rot.x(); qy[i] = rot.y(); qz[i] = rot.z();
+         sx[i] = 1.0f + 0.1f * i; sy[i] = 2.0f; sz[i] = i % 2 ? -0.5f : 0.5f;
+         px[i] = 0.3f * i; py[i] = 1.0f - i; pz[i] = 2.0f;
+         hx[i] = px[i] + 1.0f; hy[i] = py[i] + 0.5f; hz[i] = pz[i] + 2.0f;
+      }
+      Mmath::Vec3Array<float> points(px, py, pz), highs(hx, hy, hz), out(ox, oy, oz), outHigh(oHx, oHy, oHz);
+      Mmath::TRSArray<float> trs(Mmath::Vec3Array<float>(tx, ty, tz), Mmath::QuatArray<float>(qw, qx, qy, qz),
+                                 Mmath::Vec3Array<float>(sx, sy, sz));
+      Matrix4f m = Mmath::TransformationMatrix<float>(Vector3f(1,2,3), Mmath::AngleAxisQuat<float>(1.0f, Vector3f(0,1,0)),
+                                                      Vector3f(2,3,4));
+
+      float worst[4] = {0, 0, 0, 0};
+      Mmath::TransformPoints(m, points, count, out);
+      for (int i = 0; i < count; i++) {
+         Vector4f expected = m * Mmath::vec3To4(Vector3f(px[i], py[i], pz[i]), 1.0f);
+         worst[0] = std::max(worst[0], (Vector3f(ox[i], oy[i], oz[i]) - expected.head<3>()).norm());
+      }
+      Mmath::TransformPoints(trs, points, count, out);
+      for (int i = 0; i < count; i++) {
+         Matrix4f mi = Mmath::TransformationMatrix<float>(Vector3f(tx[i], ty[i], tz[i]), Quaternionf(qw[i], qx[i], qy[i], qz[i]),
+                                                          Vector3f(sx[i], sy[i], sz[i]));
+         Vector4f expected = mi * Mmath::vec3To4(Vector3f(px[i], py[i], pz[i]), 1.0f);
+         worst[1] = std::max(worst[1], (Vector3f(ox[i], oy[i], oz[i]) - expected.head<3>()).norm());
+      }
+
+      // A transformed normal stays perpendicular to a transformed tangent
+      float nx[count], ny[count], nz[count];
+      Mmath::Vec3Array<float> normals(nx, ny, nz);
+      Mmath::TransformNormals(trs, Mmath::Vec3Array<float>(px, py, pz), count, normals);
+      for (int i = 0; i < count; i++) {
+         Vector3f normal(px[i], py[i], pz[i]);
+         Vector3f tangent = normal.cross(Vector3f(0,0,1));
+         Matrix4f mi = Mmath::TransformationMatrix<float>(Vector3f(tx[i], ty[i], tz[i]), Quaternionf(qw[i], qx[i], qy[i], qz[i]),
+                                                          Vector3f(sx[i], sy[i], sz[i]));
+         Vector3f movedTangent = (mi * Mmath::vec3To4(tangent, 0.0f)).head<3>();
+         worst[2] = std::max(worst[2], fabsf(movedTangent.dot(Vector3f(nx[i], ny[i], nz[i]))));
+      }
+      Mmath::TransformNormals(m, points, count, normals);
+      for (int i = 0; i < count; i++) {
+         Vector3f tangent = Vector3f(px[i], py[i], pz[i]).cross(Vector3f(0,0,1));
+         Vector3f movedTangent = (m * Mmath::vec3To4(tangent, 0.0f)).head<3>();
+         worst[2] = std::max(worst[2], fabsf(movedTangent.dot(Vector3f(nx[i], ny[i], nz[i]))));
+      }
+
+      // The fitted boxes hold every transformed corner, and touch the extremes on each axis
+      Mmath::TransformBoxes(trs, points, highs, count, out, outHigh);
+      int outsideCorners = 0;
+      for (int i = 0; i < count; i++) {
+         Matrix4f mi = Mmath::TransformationMatrix<float>(Vector3f(tx[i], ty[i], tz[i]), Quaternionf(qw[i], qx[i], qy[i], qz[i]),
+                                                          Vector3f(sx[i], sy[i], sz[i]));
+         Vector3f low( INFINITY,  INFINITY,  INFINITY), high(-INFINITY, -INFINITY, -INFINITY);
+         for (int c = 0; c < 8; c++) {
+            Vector3f corner(c & 4 ? hx[i] : px[i], c & 2 ? hy[i] : py[i], c & 1 ? hz[i] : pz[i]);
+            Vector3f moved = (mi * Mmath::vec3To4(corner, 1.0f)).head<3>();
+            low = low.cwiseMin(moved);
+            high = high.cwiseMax(moved);
+         }
+         worst[3] = std::max(worst[3], (Vector3f(out.x[i], out.y[i], out.z[i]) - low).norm());
+         worst[3] = std::max(worst[3], (Vector3f(oHx[i], oHy[i], oHz[i]) - high).norm());
+      }
+      Mmath::TransformBoxes(m, points, highs, count, out, outHigh);
+      for (int i = 0; i < count; i++) {
+         for (int c = 0; c < 8; c++) {
+            Vector3f corner(c & 4 ? hx[i] : px[i], c & 2 ? hy[i] : py[i], c & 1 ? hz[i] : pz[i]);
+            Vector3f moved = (m * Mmath::vec3To4(corner, 1.0f)).head<3>();
+            outsideCorners += (moved - Vector3f(ox[i], oy[i], oz[i])).minCoeff() < -1e-4f ||
+                              (Vector3f(oHx[i], oHy[i], oHz[i]) - moved).minCoeff() < -1e-4f;
+         }
+      }
+      equalityFloatCheck(worst[0], 0, 1e-4);
+      equalityFloatCheck(worst[1], 0, 1e-4);
+      equalityFloatCheck(worst[2], 0, 1e-4);
+      equalityFloatCheck(worst[3], 0, 1e-4);
+      equalityIntCheck(outsideCorners, 0);
+   }
+
    printf("Testing Intersect Functions\n");
 
    // Test Intersect (ray and plane)
@@ -274,5 +701,883 @@ int main() {
 
    printf("Testing octree\n");
 
+   // Test that only occupied subcells get allocated, and that they are freed on removal
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      AABBf a(Vector3f(0.1,0.1,0.1), Vector3f(0.6,0.6,0.6));
+      AABBf b(Vector3f(0.4,0.4,0.4), Vector3f(0.9,0.9,0.9));
+      tree.insert(&a);
+      tree.insert(&b);
+      equalityIntCheck(tree.rootCell->subcells.size(), 1);
+      equalityIntCheck(tree.rootCell->childMask, 1);
+      equalityIntCheck(tree.rootCell->subcells[0]->subcells.size(), 1);
+
+      ObjectList collisions;
+      boolCheck(tree.testIntersection(&a, NULL, boxBoxTest, &collisions), true);
+      equalityIntCheck(collisions.size(), 1);
+
+      AABBf c(Vector3f(7,7,7), Vector3f(7.5,7.5,7.5));
+      collisions.clear();
+      boolCheck(tree.testIntersectionOutside(&c, boxInCellTest, boxBoxTest, &collisions), false);
+
+      tree.remove(&a);
+      tree.remove(&b);
+      boolCheck(tree.rootCell->isLeaf(), true);
+      equalityIntCheck(tree.rootCell->subcells.size(), 0);
+   }
+
+   // Test that kept object bounds skip the object-object test for non-overlapping objects
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 0, boxInCellTest);
+      tree.setObjectBoundsFunction(boxBounds);
+      std::vector<AABBf> boxes;
+      for (int i = 0; i < 37; i++) {
+         boxes.push_back(AABBf(Vector3f(0.2*i,0,0), Vector3f(0.2*i+0.1,0.1,0.1)));
+      }
+      for (int i = 0; i < 37; i++) {
+         tree.insert(&boxes[i]);
+      }
+      equalityIntCheck(tree.rootCell->bounds->size(), 37);
+
+      AABBf query(Vector3f(1.95,0,0), Vector3f(2.45,1,1));
+      ObjectList collisions;
+      numBoxBoxTests = 0;
+      boolCheck(tree.testIntersectionOutside(&query, boxInCellTest, countingBoxBoxTest, &collisions), true);
+      equalityIntCheck(collisions.size(), 3);
+      equalityIntCheck(numBoxBoxTests, 3);
+
+      tree.remove(&boxes[10]);
+      collisions.clear();
+      tree.testIntersectionOutside(&query, boxInCellTest, countingBoxBoxTest, &collisions);
+      equalityIntCheck(collisions.size(), 2);
+
+      // Cells only pay for a bounds list while the tree has a bounds function
+      tree.setObjectBoundsFunction(NULL);
+      boolCheck(tree.rootCell->bounds == NULL, true);
+      collisions.clear();
+      tree.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &collisions);
+      equalityIntCheck(collisions.size(), 2);
+   }
+
+   // Test that handles stay the same through updates and get reused after removal
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      AABBf a(Vector3f(1,1,1), Vector3f(3,3,3));  // Spans several max depth cells
+      AABBf b(Vector3f(5,5,5), Vector3f(6,6,6));
+      AABBf outside(Vector3f(9,9,9), Vector3f(10,10,10));
+      ObjectHandle handleA = tree.insert(&a);
+      ObjectHandle handleB = tree.insert(&b);
+      equalityIntCheck(handleA, 0);
+      equalityIntCheck(handleB, 1);
+      equalityIntCheck(tree.insert(&a), handleA);
+      boolCheck(tree.insert(&outside) == INVALID_HANDLE, true);
+      boolCheck(tree.getObject(handleB) == &b, true);
+
+      ObjectList collisions;
+      boolCheck(tree.testIntersectionInside(handleA, boxBoxTest, &collisions), false);
+
+      a = AABBf(Vector3f(5.2,5.2,5.2), Vector3f(5.8,5.8,5.8));
+      tree.update(handleA);
+      equalityIntCheck(tree.getHandle(&a), handleA);
+      boolCheck(tree.testIntersectionInside(handleA, boxBoxTest, &collisions), true);
+      equalityIntCheck(collisions.size(), 1);
+
+      tree.remove(handleA);
+      equalityIntCheck(tree.getHandle(&a), INVALID_HANDLE);
+      equalityIntCheck(tree.insert(&a), handleA);
+
+      // Moving out of the tree drops the object, as inserting it there would
+      b = outside;
+      tree.update(handleB);
+      equalityIntCheck(tree.getHandle(&b), INVALID_HANDLE);
+      boolCheck(tree.getObject(handleB) == NULL, true);
+      equalityIntCheck(tree.stats().numObjects, 1);
+      a = outside;
+      tree.update(&handleA, 1);
+      equalityIntCheck(tree.getHandle(&a), INVALID_HANDLE);
+      equalityIntCheck(tree.stats().numObjects, 0);
+   }
+
+   // Test that objects stay findable by pointer through many removals and reinsertions
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 2, boxInCellTest);
+      std::vector<AABBf> boxes(1000, AABBf(Vector3f(1,1,1), Vector3f(2,2,2)));
+      std::vector<ObjectHandle> handles;
+      for (size_t i = 0; i < boxes.size(); i++) {
+         handles.push_back(tree.insert(&boxes[i]));
+      }
+      for (size_t i = 0; i < boxes.size(); i += 3) {
+         tree.remove(&boxes[i]);
+      }
+      int wrong = 0;
+      for (size_t i = 0; i < boxes.size(); i++) {
+         wrong += tree.getHandle(&boxes[i]) != (i % 3 == 0 ? INVALID_HANDLE : handles[i]);
+      }
+      for (size_t i = 0; i < boxes.size(); i += 3) {
+         tree.insert(&boxes[i]);
+      }
+      for (size_t i = 0; i < boxes.size(); i++) {
+         wrong += tree.getObject(tree.getHandle(&boxes[i])) != &boxes[i];
+      }
+      equalityIntCheck(wrong, 0);
+      equalityIntCheck(tree.stats().numObjects, 1000);
+   }
+
+   // Test that removing from the middle of a cell keeps the other objects findable
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 0, boxInCellTest);
+      tree.setObjectBoundsFunction(boxBounds);
+      AABBf boxes[5];
+      for (int i = 0; i < 5; i++) {
+         boxes[i] = AABBf(Vector3f(i,0,0), Vector3f(i+0.5,1,1));
+         tree.insert(&boxes[i]);
+      }
+      tree.remove(&boxes[1]);
+      boolCheck(tree.rootCell->objects[1] == &boxes[4], true);
+      tree.remove(&boxes[4]);
+      tree.remove(&boxes[0]);
+      equalityIntCheck(tree.rootCell->objects.size(), 2);
+      equalityIntCheck(tree.rootCell->bounds->size(), 2);
+
+      AABBf query(Vector3f(2.2,0,0), Vector3f(3.2,1,1));
+      ObjectList collisions;
+      tree.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &collisions);
+      equalityIntCheck(collisions.size(), 2);
+      tree.remove(&boxes[3]);
+      tree.remove(&boxes[2]);
+      equalityIntCheck(tree.rootCell->objects.size(), 0);
+   }
+
+   // Test that deferred collapse keeps emptied cells around until compact is called
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      tree.setDeferredCollapse(true, 0);
+      AABBf a(Vector3f(0.1,0.1,0.1), Vector3f(0.6,0.6,0.6));
+      AABBf b(Vector3f(7.1,7.1,7.1), Vector3f(7.6,7.6,7.6));
+      tree.insert(&a);
+      tree.insert(&b);
+      tree.remove(&a);
+      equalityIntCheck(tree.rootCell->subcells.size(), 2);
+
+      tree.insert(&a);
+      tree.remove(&a);
+      tree.remove(&b);
+      equalityIntCheck(tree.compact(0), 0);
+      boolCheck(tree.rootCell->isLeaf(), true);
+
+      tree.setDeferredCollapse(true, 2);
+      tree.insert(&a);
+      tree.insert(&b);
+      tree.remove(&a);
+      equalityIntCheck(tree.rootCell->subcells.size(), 2);
+      tree.remove(&b);
+      boolCheck(tree.rootCell->isLeaf(), true);
+   }
+
+   // Test that loose cells store every object exactly once, at a depth matching its size
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      tree.setObjectBoundsFunction(boxBounds);
+      tree.setLooseness(2.0f);
+      AABBf big(Vector3f(2.5,2.5,2.5), Vector3f(5.5,5.5,5.5));     // Straddles the root center
+      AABBf small(Vector3f(5.4,5.4,5.4), Vector3f(5.7,5.7,5.7));
+      AABBf far(Vector3f(0.1,0.1,0.1), Vector3f(0.3,0.3,0.3));
+      tree.insert(&big);
+      tree.insert(&small);
+      tree.insert(&far);
+      equalityIntCheck(tree.rootCell->objects.size(), 0);
+      equalityIntCheck(tree.rootCell->getSubcell(7)->objects.size(), 1);
+
+      ObjectList collisions;
+      boolCheck(tree.testIntersection(&small, NULL, boxBoxTest, &collisions), true);
+      equalityIntCheck(collisions.size(), 1);
+      collisions.clear();
+      boolCheck(tree.testIntersection(&far, NULL, boxBoxTest, &collisions), false);
+
+      AABBf query(Vector3f(0,0,0), Vector3f(2.6,2.6,2.6));
+      collisions.clear();
+      tree.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &collisions);
+      equalityIntCheck(collisions.size(), 2);
+
+      tree.remove(&big);
+      tree.remove(&small);
+      tree.remove(&far);
+      boolCheck(tree.rootCell->isLeaf(), true);
+   }
+
+   // Test that objects are stored once, in the deepest cell that fully contains them
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      tree.setContainmentTest(boxInsideCellTest);
+      AABBf big(Vector3f(3,3,3), Vector3f(5,5,5));       // Straddles the root center
+      AABBf small(Vector3f(4.5,4.5,4.5), Vector3f(4.8,4.8,4.8));
+      AABBf far(Vector3f(0.1,0.1,0.1), Vector3f(0.3,0.3,0.3));
+      tree.insert(&big);
+      tree.insert(&small);
+      tree.insert(&far);
+      equalityIntCheck(tree.rootCell->objects.size(), 1);
+      boolCheck(tree.rootCell->objects[0] == &big, true);
+
+      ObjectList collisions;
+      boolCheck(tree.testIntersection(&small, NULL, boxBoxTest, &collisions), true);
+      equalityIntCheck(collisions.size(), 1);
+      collisions.clear();
+      boolCheck(tree.testIntersection(&big, NULL, boxBoxTest, &collisions), true);
+      equalityIntCheck(collisions.size(), 1);
+      collisions.clear();
+      boolCheck(tree.testIntersection(&far, NULL, boxBoxTest, &collisions), false);
+
+      tree.remove(&small);
+      tree.remove(&far);
+      boolCheck(tree.rootCell->isLeaf(), true);
+   }
+
+   // Test that the root grows around the old tree, and that objects past the limit overflow
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      tree.setAutoGrow(true, Vector3f(-100,-100,-100), Vector3f(100,100,100));
+      tree.setKeepOverflow(true);
+      AABBf inside(Vector3f(1.2,1.2,1.2), Vector3f(1.5,1.5,1.5));
+      AABBf outside(Vector3f(-4.8,1.2,1.2), Vector3f(-4.5,1.5,1.5));
+      AABBf tooFar(Vector3f(500,500,500), Vector3f(501,501,501));
+      Cell * oldRoot = tree.rootCell;
+      tree.insert(&inside);
+      boolCheck(tree.insert(&outside) != INVALID_HANDLE, true);
+      boolCheck(oldRoot->parent == tree.rootCell, true);
+      equalityFloatCheck(tree.rootCell->lowBound(0), -8, 1e-5);
+      boolCheck(oldRoot->isLeaf(), false);
+
+      boolCheck(tree.insert(&tooFar) != INVALID_HANDLE, true);
+      equalityIntCheck(tree.getOverflowObjects().size(), 1);
+
+      AABBf query(Vector3f(-10,0,0), Vector3f(600,600,600));
+      ObjectList collisions;
+      tree.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &collisions);
+      equalityIntCheck(collisions.size(), 3);
+
+      collisions.clear();
+      boolCheck(tree.testIntersection(&tooFar, NULL, boxBoxTest, &collisions), false);
+      tree.remove(&tooFar);
+      equalityIntCheck(tree.getOverflowObjects().size(), 0);
+   }
+
+   // Test that overflowed objects get bounds when the bounds function is set after them
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      tree.setKeepOverflow(true);
+      AABBf outside(Vector3f(50,50,50), Vector3f(51,51,51));
+      tree.insert(&outside);
+      tree.setObjectBoundsFunction(boxBounds);
+
+      AABBf query(Vector3f(49,49,49), Vector3f(50.5,50.5,50.5));
+      ObjectList collisions;
+      boolCheck(tree.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &collisions), true);
+      equalityIntCheck(collisions.size(), 1);
+
+      Matrix4f projection = Mmath::PerspectiveMatrix<float>(M_PI / 4, 1, 1, 30);
+      Frustumf view(projection * Mmath::ViewMatrix<float>(Vector3f(50.5,50.5,60), Vector3f(0,0,-1), Vector3f(0,1,0)));
+      CullList visible;
+      CullCache cache;
+      equalityIntCheck(tree.cullFrustums(&view, 1, visible), 1);
+      equalityIntCheck(tree.cullFrustumCoherent(view, cache, visible), 1);
+      SweptHitList hits;
+      equalityIntCheck(tree.sweepBox(query, Vector3f(1,0,0), hits), 1);
+   }
+
+   // Test that objects sticking out of the root are found around it after the root grows
+   {
+      Octree enclosing(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      enclosing.setContainmentTest(boxInsideCellTest);
+      Octree touching(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      touching.setObjectBoundsFunction(boxBounds);
+      Octree * trees[2] = { &enclosing, &touching };
+      AABBf straddler(Vector3f(7,7,7), Vector3f(9,9,9));
+      AABBf far(Vector3f(12,12,12), Vector3f(13,13,13));   // Makes the root grow to 0-16
+      AABBf query(Vector3f(8.5,8.5,8.5), Vector3f(8.9,8.9,8.9));   // Only the part outside the old root
+      for (int t = 0; t < 2; t++) {
+         trees[t]->setAutoGrow(true, Vector3f(-100,-100,-100), Vector3f(100,100,100));
+         trees[t]->insert(&straddler);
+         trees[t]->insert(&far);
+         equalityFloatCheck(trees[t]->rootCell->highBound(0), 16, 1e-5);
+
+         ObjectList collisions;
+         trees[t]->testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &collisions);
+         equalityIntCheck(collisions.size(), 1);
+      }
+   }
+
+   // Test that rebuilding on several threads places objects the same as on one thread
+   {
+      std::vector<AABBf> boxes;
+      unsigned int seed = 1;
+      for (int i = 0; i < 5000; i++) {
+         seed = seed * 1103515245 + 12345;
+         float x = (seed >> 8) % 1000 / 125.0f;
+         seed = seed * 1103515245 + 12345;
+         float y = (seed >> 8) % 1000 / 125.0f;
+         seed = seed * 1103515245 + 12345;
+         float z = (seed >> 8) % 1000 / 125.0f;
+         boxes.push_back(AABBf(Vector3f(x,y,z), Vector3f(x+0.3,y+0.3,z+0.3)));
+      }
+
+      Octree serial(Vector3f(0,0,0), Vector3f(8,8,8), 4, boxInCellTest);
+      Octree parallel(Vector3f(0,0,0), Vector3f(8,8,8), 4, boxInCellTest);
+      serial.setRebuildThreads(1);
+      parallel.setRebuildThreads(4);
+      for (int i = 0; i < 5000; i++) {
+         serial.insert(&boxes[i]);
+         parallel.insert(&boxes[i]);
+      }
+      serial.resetWithBounds(Vector3f(-1,-1,-1), Vector3f(9,9,9));
+      parallel.resetWithBounds(Vector3f(-1,-1,-1), Vector3f(9,9,9));
+
+      AABBf query(Vector3f(2,2,2), Vector3f(3,3,3));
+      ObjectList serialHits, parallelHits;
+      serial.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &serialHits);
+      parallel.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &parallelHits);
+      equalityIntCheck(parallelHits.size(), serialHits.size());
+      serialHits.clear();
+      parallelHits.clear();
+      serial.testIntersectionInside(&boxes[42], boxBoxTest, &serialHits);
+      parallel.testIntersectionInside(&boxes[42], boxBoxTest, &parallelHits);
+      equalityIntCheck(parallelHits.size(), serialHits.size());
+      equalityIntCheck(parallel.rootCell->subcells.size(), serial.rootCell->subcells.size());
+   }
+
+   // Test that the parallel rebuild matches the serial one with a leaf capacity, loose cells
+   // and containment placement (0, 1 and 2 below)
+   for (int mode = 0; mode < 3; mode++) {
+      std::vector<AABBf> boxes;
+      unsigned int seed = 7;
+      for (int i = 0; i < 6000; i++) {
+         seed = seed * 1103515245 + 12345;
+         float x = (seed >> 8) % 1000 / 125.0f;
+         seed = seed * 1103515245 + 12345;
+         float y = (seed >> 8) % 1000 / 125.0f;
+         seed = seed * 1103515245 + 12345;
+         float z = (seed >> 8) % 1000 / 125.0f;
+         seed = seed * 1103515245 + 12345;
+         float size = 0.05f + (seed >> 8) % 100 / 200.0f;
+         boxes.push_back(AABBf(Vector3f(x,y,z), Vector3f(x+size,y+size,z+size)));
+      }
+
+      Octree serial(Vector3f(0,0,0), Vector3f(8,8,8), 6, boxInCellTest);
+      Octree parallel(Vector3f(0,0,0), Vector3f(8,8,8), 6, boxInCellTest);
+      Octree * trees[2] = {&serial, &parallel};
+      for (int t = 0; t < 2; t++) {
+         trees[t]->setObjectBoundsFunction(boxBounds);
+         if (mode == 0)
+            trees[t]->setLeafCapacity(8);
+         else if (mode == 1)
+            trees[t]->setLooseness(2.0f);
+         else
+            trees[t]->setContainmentTest(boxInsideCellTest);
+         for (int i = 0; i < 6000; i++) {
+            trees[t]->insert(&boxes[i]);
+         }
+      }
+      serial.setRebuildThreads(1);
+      parallel.setRebuildThreads(3);
+      serial.resetWithBounds(Vector3f(-1,-1,-1), Vector3f(9,9,9));
+      parallel.resetWithBounds(Vector3f(-1,-1,-1), Vector3f(9,9,9));
+
+      OctreeStats serialStats = serial.stats();
+      OctreeStats parallelStats = parallel.stats();
+      equalityIntCheck(parallelStats.numCells, serialStats.numCells);
+      equalityIntCheck(parallelStats.numLeaves, serialStats.numLeaves);
+      equalityIntCheck(parallelStats.emptyLeaves, serialStats.emptyLeaves);
+      equalityIntCheck(parallelStats.numOverflowObjects, serialStats.numOverflowObjects);
+      equalityIntCheck(parallelStats.maxCellsPerObject, serialStats.maxCellsPerObject);
+      equalityFloatCheck(parallelStats.averageCellsPerObject, serialStats.averageCellsPerObject, 1e-5);
+      boolCheck(parallelStats.cellsPerDepth == serialStats.cellsPerDepth, true);
+      boolCheck(parallelStats.leafOccupancy == serialStats.leafOccupancy, true);
+
+      ObjectList serialHits, parallelHits;
+      serial.testIntersectionInside(&boxes[42], boxBoxTest, &serialHits);
+      parallel.testIntersectionInside(&boxes[42], boxBoxTest, &parallelHits);
+      equalityIntCheck(parallelHits.size(), serialHits.size());
+   }
+
+   // Test that fitting picks tight bounds and a depth from the object sizes
+   {
+      Octree tree(Vector3f(-100,-100,-100), Vector3f(100,100,100), 2, boxInCellTest);
+      tree.setObjectBoundsFunction(boxBounds);
+      AABBf boxes[40];
+      for (int i = 0; i < 40; i++) {
+         float x = (i % 2 == 0) ? 0.1f * i : 10.0f + 0.1f * i;
+         boxes[i] = AABBf(Vector3f(x,0,0), Vector3f(x+0.25,0.25,0.25));
+         tree.insert(&boxes[i]);
+      }
+
+      FitParams params;
+      params.targetObjectsPerLeaf = 4;
+      params.minCellSizeRatio = 2.0f;
+      FitReport report = tree.fitToObjects(params);
+      equalityIntCheck(report.numObjects, 40);
+      equalityFloatCheck(report.medianObjectSize, 0.25, 1e-5);
+      equalityFloatCheck(report.lowBound(0), 0, 0.2);
+      equalityFloatCheck(report.highBound(0), 14.15, 0.2);
+      equalityIntCheck(report.maxDepth, 4);      // 14.4 / 2^4 = 0.9 >= 0.5 > 14.4 / 2^5
+      equalityIntCheck(tree.rootCell->objects.size(), 0);
+
+      ObjectList collisions;
+      tree.testIntersectionInside(&boxes[10], boxBoxTest, &collisions);
+      std::sort(collisions.begin(), collisions.end());
+      collisions.erase(std::unique(collisions.begin(), collisions.end()), collisions.end());
+      equalityIntCheck(collisions.size(), 2);   // Boxes 8 and 12 overlap box 10
+   }
+
+   // Test that work is counted under the API call that did it, and only with OCTREE_STATS
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      AABBf a(Vector3f(1.1,1.1,1.1), Vector3f(1.4,1.4,1.4));
+      AABBf b(Vector3f(1.2,1.2,1.2), Vector3f(1.6,1.6,1.6));
+      tree.insert(&a);
+      tree.insert(&b);
+      tree.testIntersectionInside(&a, boxBoxTest, NULL);
+      tree.update(&b);
+      tree.remove(&b);
+
+      OctreeCounterStats stats = tree.getCounterStats();
+#ifdef OCTREE_STATS
+      equalityIntCheck(stats.perApi[API_INSERT].splits, 3);   // One path down to depth 3
+      equalityIntCheck(stats.perApi[API_QUERY].objectObjectTests, 1);
+      equalityIntCheck(stats.perApi[API_UPDATE].objectCellTests, stats.perApi[API_INSERT].objectCellTests / 2);
+      equalityIntCheck(stats.perApi[API_UPDATE].splits, 0);   // update's own removal and insert count here
+      equalityIntCheck(stats.perApi[API_REMOVE].collapses, 0);   // a still holds the path
+      equalityIntCheck(stats.total.splits, 3);
+#else
+      equalityIntCheck(stats.total.cellsVisited + stats.total.splits, 0);
+#endif
+      tree.resetCounters();
+      equalityIntCheck(tree.getCounterStats().total.objectCellTests, 0);
+   }
+
+   // Test that stats reports the shape of the tree
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 2, boxInCellTest);
+      AABBf inOne(Vector3f(0.5,0.5,0.5), Vector3f(1.5,1.5,1.5));     // Inside one leaf
+      AABBf acrossTwo(Vector3f(5,6.5,6.5), Vector3f(7,7.5,7.5));      // Crosses x = 6
+      tree.insert(&inOne);
+      tree.insert(&acrossTwo);
+
+      OctreeStats stats = tree.stats();
+      equalityIntCheck(stats.cellsPerDepth.size(), 3);
+      equalityIntCheck(stats.cellsPerDepth[0], 1);
+      equalityIntCheck(stats.cellsPerDepth[1], 2);
+      equalityIntCheck(stats.cellsPerDepth[2], 3);
+      equalityIntCheck(stats.numLeaves, 3);
+      equalityIntCheck(stats.emptyLeaves, 0);
+      equalityIntCheck(stats.leafOccupancy[1], 3);
+      equalityIntCheck(stats.numObjects, 2);
+      equalityIntCheck(stats.maxCellsPerObject, 2);
+      equalityFloatCheck(stats.averageCellsPerObject, 1.5, 1e-5);
+      boolCheck(stats.cellBytes >= 6 * sizeof(Cell), true);
+      equalityIntCheck(stats.totalBytes, stats.cellBytes + stats.objectListBytes + stats.registryBytes + stats.mapBytes);
+
+      tree.setDeferredCollapse(true, 0);
+      tree.remove(&inOne);
+      stats = tree.stats();
+      equalityIntCheck(stats.emptyLeaves, 1);
+      equalityIntCheck(stats.leafOccupancy[0], 1);
+   }
+
+   // Test that latency histograms stay within their relative error
+   {
+      LatencyHistogram histogram;
+      for (int i = 1; i <= 1000; i++) {
+         histogram.record(i * 100);
+      }
+      equalityIntCheck(histogram.count(), 1000);
+      equalityIntCheck(histogram.min(), 100);
+      equalityIntCheck(histogram.max(), 100000);
+      equalityFloatCheck(histogram.mean(), 50050, 1e-3);
+      equalityFloatCheck(histogram.valueAtPercentile(0.5), 50000, 50000 * 0.035);
+      equalityFloatCheck(histogram.valueAtPercentile(0.99), 99000, 99000 * 0.035);
+      equalityIntCheck(histogram.valueAtPercentile(1.0), 100000);
+      boolCheck(histogram.valueAtPercentile(0.5) >= 50000, true);   // Never reports low
+
+      LatencyHistogram other;
+      other.record(7);
+      histogram.add(other);
+      equalityIntCheck(histogram.min(), 7);
+      equalityIntCheck(histogram.valueAtPercentile(0.0005), 7);
+   }
+
+   // Test that the trace ring keeps the newest events in order
+   {
+      TraceRing ring(3);
+      for (int i = 0; i < 5; i++) {
+         TraceEvent event;
+         event.name = "insert";
+         event.startNanos = i;
+         event.durationNanos = 1;
+         event.depth = 0;
+         event.cellsTouched = 0;
+         ring.push(event);
+      }
+      equalityIntCheck(ring.size(), 3);
+      equalityIntCheck(ring[0].startNanos, 2);
+      equalityIntCheck(ring[2].startNanos, 4);
+   }
+
+   // Test that every outermost API call is traced with the depth it reached
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      AABBf a(Vector3f(1.1,1.1,1.1), Vector3f(1.4,1.4,1.4));
+      tree.insert(&a);
+      tree.update(&a);
+      tree.testIntersectionInside(&a, boxBoxTest, NULL);
+#ifdef OCTREE_TRACE
+      const TraceRing& events = tree.getTraceEvents();
+      equalityIntCheck(events.size(), 3);   // update's own remove and insert aren't separate calls
+      boolCheck(std::string(events[1].name) == "update", true);
+      equalityIntCheck(events[0].depth, 3);
+      equalityIntCheck(events[0].cellsTouched, 4);
+      equalityIntCheck(tree.getLatencyHistogram(API_QUERY).count(), 1);
+      boolCheck(tree.writeChromeTrace("/tmp/octree_trace_test.json"), true);
+#else
+      equalityIntCheck(tree.getTraceEvents().size(), 0);
+#endif
+      tree.resetTrace();
+      equalityIntCheck(tree.getLatencyHistogram(API_INSERT).count(), 0);
+   }
+
+   // Test that the octree's bounding box prefilter gives the same answers at every SIMD level
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(8,8,8), 1, boxInCellTest);
+      tree.setObjectBoundsFunction(boxBounds);
+      AABBf boxes[53];
+      for (int i = 0; i < 53; i++) {
+         float x = 0.1f + 0.07f * i;
+         boxes[i] = AABBf(Vector3f(x,x,0.5), Vector3f(x+0.1,x+0.1,0.6));
+         tree.insert(&boxes[i]);
+      }
+
+      SimdLevel bestLevel = GetSimdLevel();
+      AABBf query(Vector3f(1,1,0), Vector3f(2,2,1));
+      int expected = -1;
+      int mismatches = 0;
+      for (int level = SIMD_SCALAR; level < NUM_SIMD_LEVELS; level++) {
+         if (!SetSimdLevel((SimdLevel) level))
+            continue;
+         ObjectList collisions;
+         tree.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &collisions);
+         if (expected < 0)
+            expected = collisions.size();
+         mismatches += ((int) collisions.size() != expected);
+      }
+      SetSimdLevel(bestLevel);
+      equalityIntCheck(mismatches, 0);
+      equalityIntCheck(expected, 16);
+   }
+
+   // Test ray casts against a triangle mesh: a 2x2 grid of quads at z = 0 under one quad at z = 1
+   {
+      float vertices[13 * 3];
+      for (int i = 0; i < 9; i++) {
+         vertices[i * 3] = i % 3;
+         vertices[i * 3 + 1] = i / 3;
+         vertices[i * 3 + 2] = 0;
+      }
+      float top[4 * 3] = {0,0,1, 1,0,1, 0,1,1, 1,1,1};
+      std::copy(top, top + 12, vertices + 27);
+
+      unsigned int indices[11 * 3];
+      int numTriangles = 0;
+      for (int y = 0; y < 2; y++) {
+         for (int x = 0; x < 2; x++) {
+            unsigned int v00 = y * 3 + x, v10 = v00 + 1, v01 = v00 + 3, v11 = v00 + 4;
+            unsigned int quad[6] = {v00, v10, v11, v00, v11, v01};
+            std::copy(quad, quad + 6, indices + numTriangles * 3);
+            numTriangles += 2;
+         }
+      }
+      unsigned int topQuad[6] = {9, 10, 12, 9, 12, 11};
+      std::copy(topQuad, topQuad + 6, indices + numTriangles * 3);
+      numTriangles += 2;
+      unsigned int bad[3] = {0, 1, 13};   // Out of range, so skipped
+      std::copy(bad, bad + 3, indices + numTriangles * 3);
+      numTriangles++;
+
+      MeshOctree mesh(vertices, 13, indices, numTriangles);
+      equalityIntCheck(mesh.getNumTriangles(), 10);
+      const Octree& tree = mesh.getOctree();
+      equalityIntCheck(tree.stats().numObjects, 10);
+
+      MeshHit hit;
+      Vector3f down(0,0,-1);
+      boolCheck(mesh.raycast(Rayf(Vector3f(0.25,0.5,5), down), 100, hit), true);
+      equalityIntCheck(hit.triangle, 9);
+      equalityFloatCheck(hit.t, 4, 1e-5);
+      equalityFloatCheck(hit.u, 0.25, 1e-5);
+      equalityFloatCheck(hit.v, 0.25, 1e-5);
+
+      boolCheck(mesh.raycast(Rayf(Vector3f(0.25,0.5,-1), Vector3f(0,0,1)), 100, hit), true);
+      equalityIntCheck(hit.triangle, 1);
+      equalityFloatCheck(hit.t, 1, 1e-5);
+      equalityFloatCheck(hit.point(1), 0.5, 1e-5);
+
+      boolCheck(mesh.raycast(Rayf(Vector3f(1.5,1.5,5), down), 100, hit), true);
+      equalityIntCheck(hit.triangle, 6);
+      equalityFloatCheck(hit.t, 5, 1e-5);
+
+      boolCheck(mesh.raycast(Rayf(Vector3f(1.5,1.5,5), down), 4.5, hit), false);
+      boolCheck(mesh.raycast(Rayf(Vector3f(3,3,5), down), 100, hit), false);
+      boolCheck(mesh.raycast(Rayf(Vector3f(0.5,0.5,5), Vector3f(0,0,1)), 100, hit), false);
+
+      // Every triangle faces +z
+      boolCheck(mesh.raycast(Rayf(Vector3f(0.25,0.5,5), down), 100, hit, true), true);
+      equalityIntCheck(hit.triangle, 9);
+      boolCheck(mesh.raycast(Rayf(Vector3f(0.25,0.5,-1), Vector3f(0,0,1)), 100, hit, true), false);
+   }
+
+   // Test that spheres only go in the cells they touch, with and without the octants test
+   {
+      Spheref nearCorner(Vector3f(0.7,0.7,0.5), 0.35);   // Reaches past x = 1 and y = 1, but not the corner between
+      for (int batched = 0; batched < 2; batched++) {
+         Octree tree(Vector3f(0,0,0), Vector3f(2,2,2), 1, sphereInCellTest);
+         if (batched)
+            tree.setOctantsTest(sphereOctantsTest);
+         tree.insert(&nearCorner);
+         equalityIntCheck(tree.stats().maxCellsPerObject, 3);
+      }
+
+      std::vector<Spheref> spheres;
+      unsigned int seed = 3;
+      for (int i = 0; i < 300; i++) {
+         float v[4];
+         for (int j = 0; j < 4; j++) {
+            seed = seed * 1103515245 + 12345;
+            v[j] = (seed >> 8) % 1000 / 100.0f;   // 0 to 10
+         }
+         spheres.push_back(Spheref(Vector3f(v[0], v[1], v[2]), v[3] / 20.0f));
+      }
+      Octree plain(Vector3f(0,0,0), Vector3f(10,10,10), 4, sphereInCellTest);
+      Octree batched(Vector3f(0,0,0), Vector3f(10,10,10), 4, sphereInCellTest);
+      batched.setOctantsTest(sphereOctantsTest);
+      for (int i = 0; i < 300; i++) {
+         plain.insert(&spheres[i]);
+         batched.insert(&spheres[i]);
+      }
+      OctreeStats plainStats = plain.stats(), batchedStats = batched.stats();
+      equalityIntCheck(batchedStats.numCells, plainStats.numCells);
+      equalityFloatCheck(batchedStats.averageCellsPerObject, plainStats.averageCellsPerObject, 1e-5);
+      equalityIntCheck(batchedStats.maxCellsPerObject, plainStats.maxCellsPerObject);
+   }
+
+   // Test culling several views in one pass against culling each view alone
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(10,10,10), 3, boxInCellTest);
+      tree.setObjectBoundsFunction(boxBounds);
+      std::vector<AABBf> boxes;
+      for (int i = 0; i < 1000; i++) {
+         Vector3f low(i % 10, (i / 10) % 10, i / 100);
+         boxes.push_back(AABBf(low + Vector3f(0.2,0.2,0.2), low + Vector3f(0.8,0.8,0.8)));
+      }
+      boxes.push_back(AABBf(Vector3f(1,1,1), Vector3f(9,9,9)));   // In many cells
+      for (size_t i = 0; i < boxes.size(); i++) {
+         tree.insert(&boxes[i]);
+      }
+
+      Matrix4f projection = Mmath::PerspectiveMatrix<float>(M_PI / 6, 1, 1, 30);
+      Frustumf views[3] = {
+         Frustumf(projection * Mmath::ViewMatrix<float>(Vector3f(5,5,20), Vector3f(0,0,-1), Vector3f(0,1,0))),
+         Frustumf(projection * Mmath::ViewMatrix<float>(Vector3f(-10,2,2), Vector3f(1,0,0), Vector3f(0,1,0))),
+         Frustumf(projection * Mmath::ViewMatrix<float>(Vector3f(5,5,-40), Vector3f(0,0,-1), Vector3f(0,1,0)))   // Sees nothing
+      };
+
+      CullList visible;
+      int numVisible = tree.cullFrustums(views, 3, visible);
+      equalityIntCheck(numVisible, visible.size());
+
+      std::vector<ViewMask> found(boxes.size(), 0);
+      int duplicates = 0;
+      for (int i = 0; i < numVisible; i++) {
+         int index = (AABBf *) visible[i].object - &boxes[0];
+         duplicates += found[index] != 0;
+         found[index] = visible[i].views;
+      }
+      int mismatches = 0, numSeen[3] = {0, 0, 0};
+      for (size_t i = 0; i < boxes.size(); i++) {
+         ViewMask expected = 0;
+         for (int v = 0; v < 3; v++) {
+            if (Classify(views[v], boxes[i]) != FRUSTUM_OUTSIDE)
+               expected |= 1ULL << v;
+            numSeen[v] += (expected >> v) & 1;
+         }
+         mismatches += found[i] != expected;
+      }
+      equalityIntCheck(duplicates, 0);
+      equalityIntCheck(mismatches, 0);
+      boolCheck(numSeen[0] > 0 && numSeen[0] < 1000, true);
+      boolCheck(numSeen[1] > 0 && numSeen[1] < 1000, true);
+      equalityIntCheck(numSeen[2], 0);
+      equalityIntCheck(found.back(), 3);
+
+      for (int v = 0; v < 3; v++) {
+         equalityIntCheck(tree.cullFrustums(&views[v], 1, visible), numSeen[v]);
+      }
+      boolCheck(tree.rootCell->cull == NULL, true);   // Only coherent culls give cells cull state
+   }
+
+   // Test coherent culling along a walk against culling each frame from scratch. The cells
+   // hold the coherent state, so the from-scratch culls get a tree of their own.
+   {
+      Octree tree(Vector3f(0,0,0), Vector3f(16,16,16), 4, boxInCellTest);
+      Octree scratchTree(Vector3f(0,0,0), Vector3f(16,16,16), 4, boxInCellTest);
+      tree.setObjectBoundsFunction(boxBounds);
+      scratchTree.setObjectBoundsFunction(boxBounds);
+      std::vector<AABBf> boxes;
+      for (int i = 0; i < 4096; i++) {
+         Vector3f low(i % 16, (i / 16) % 16, i / 256);
+         boxes.push_back(AABBf(low + Vector3f(0.3,0.3,0.3), low + Vector3f(0.7,0.7,0.7)));
+      }
+      for (size_t i = 0; i < boxes.size(); i++) {
+         tree.insert(&boxes[i]);
+         scratchTree.insert(&boxes[i]);
+      }
+
+      Matrix4f projection = Mmath::PerspectiveMatrix<float>(M_PI / 4, 1, 0.1, 12);
+      CullCache cache, fresh, other;
+      CullList visible, expected, otherVisible;
+      int mismatches = 0;
+      unsigned long long coherentTests = 0, freshTests = 0, reused = 0;
+      for (int frame = 0; frame < 40; frame++) {
+         if (frame == 20) {
+            // Changing the tree between frames must not leave stale cells behind
+            for (int i = 0; i < 2048; i += 3) {
+               tree.remove(&boxes[i]);
+               scratchTree.remove(&boxes[i]);
+            }
+         }
+         Vector3f eye(2 + frame * 0.25f, 8, 8);
+         Vector3f look(cosf(frame * 0.02f), sinf(frame * 0.02f), 0);
+         Frustumf view(projection * Mmath::ViewMatrix<float>(eye, look, Vector3f(0,0,1)));
+
+         int numVisible = tree.cullFrustumCoherent(view, cache, visible);
+         fresh.clear();
+         scratchTree.cullFrustumCoherent(view, fresh, expected);
+         coherentTests += cache.planeTests;
+         freshTests += fresh.planeTests;
+         reused += cache.reusedCells;
+
+         tree.cullFrustums(&view, 1, expected);
+         std::vector<bool> found(boxes.size(), false);
+         for (int i = 0; i < numVisible; i++) {
+            found[(AABBf *) visible[i].object - &boxes[0]] = true;
+         }
+         mismatches += numVisible != (int) expected.size();
+         for (size_t i = 0; i < expected.size(); i++) {
+            mismatches += !found[(AABBf *) expected[i].object - &boxes[0]];
+         }
+
+         // Another view taking a turn makes this one start over, but must find the same objects
+         if (frame % 10 == 5)
+            mismatches += tree.cullFrustumCoherent(view, other, otherVisible) != (int) expected.size();
+      }
+      equalityIntCheck(mismatches, 0);
+      boolCheck(reused > 0, true);
+      boolCheck(coherentTests < freshTests, true);
+      boolCheck(tree.rootCell->cull != NULL, true);
+   }
+
+   // Test that updating many objects at once places them as updating them one at a time does
+   {
+      Octree batched(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      Octree single(Vector3f(0,0,0), Vector3f(8,8,8), 3, boxInCellTest);
+      std::vector<AABBf> boxes;
+      for (int i = 0; i < 64; i++) {
+         Vector3f low(i % 4 * 2 + 0.2f, (i / 4) % 4 * 2 + 0.2f, i / 16 * 2 + 0.2f);
+         boxes.push_back(AABBf(low, low + Vector3f(0.5,0.5,0.5)));
+      }
+      std::vector<ObjectHandle> handles;
+      for (size_t i = 0; i < boxes.size(); i++) {
+         handles.push_back(batched.insert(&boxes[i]));
+         single.insert(&boxes[i]);
+      }
+      int cellsBefore = batched.stats().numCells;
+
+      // Every box moves into the cell the next one left
+      for (size_t i = 0; i < boxes.size(); i++) {
+         boxes[i].lowBound(0) = fmodf(boxes[i].lowBound(0) + 2.0f, 8.0f);
+         boxes[i].highBound(0) = boxes[i].lowBound(0) + 0.5f;
+      }
+      handles.push_back(handles[0]);   // Listed twice
+      batched.update(&handles[0], handles.size());
+      for (size_t i = 0; i < boxes.size(); i++) {
+         single.update(&boxes[i]);
+      }
+
+      equalityIntCheck(batched.stats().numCells, cellsBefore);
+      equalityIntCheck(batched.stats().numCells, single.stats().numCells);
+      equalityIntCheck(batched.stats().numObjects, 64);
+      ObjectList collisions;
+      AABBf query(Vector3f(0,0,0), Vector3f(1,8,8));
+      batched.testIntersectionOutside(&query, boxInCellTest, boxBoxTest, &collisions);
+      equalityIntCheck(collisions.size(), 16);
+      boolCheck(batched.rootCell->subcells.size() == 8, true);
+   }
+
+   // Test that swept queries find thin objects a fast box passes between its start and end
+   {
+      AABBf wall(Vector3f(5,0,0), Vector3f(5.1,10,10));
+      AABBf moving(Vector3f(1,4,4), Vector3f(2,5,5));
+      float tEnter, tExit;
+      boolCheck(SweepIntersect(moving, Vector3f(8,0,0), wall, tEnter, tExit), true);
+      equalityFloatCheck(tEnter, 3.0 / 8, 1e-5);
+      equalityFloatCheck(tExit, 4.1 / 8, 1e-5);
+      boolCheck(SweepIntersect(moving, Vector3f(2,0,0), wall, tEnter, tExit), false);   // Stops short
+      boolCheck(SweepIntersect(moving, Vector3f(8,20,0), wall, tEnter, tExit), false);   // Clears the top before reaching x = 5
+      boolCheck(SweepIntersect(moving, Vector3f(0,0,0), moving, tEnter, tExit), true);
+      equalityFloatCheck(tEnter, 0, 1e-5);
+
+      Octree tree(Vector3f(0,0,0), Vector3f(16,16,16), 3, boxInCellTest);
+      tree.setObjectBoundsFunction(boxBounds);
+      std::vector<AABBf> boxes;
+      unsigned int seed = 7;
+      for (int i = 0; i < 400; i++) {
+         float v[4];
+         for (int j = 0; j < 4; j++) {
+            seed = seed * 1103515245 + 12345;
+            v[j] = (seed >> 8) % 1500 / 100.0f;   // 0 to 15
+         }
+         Vector3f low(v[0], v[1], v[2]);
+         boxes.push_back(AABBf(low, low + Vector3f(0.05f, 0.2f + v[3] / 10, 0.3f)));   // Thin in x
+      }
+      for (size_t i = 0; i < boxes.size(); i++) {
+         tree.insert(&boxes[i]);
+      }
+
+      Spheref bullet(Vector3f(0.5,7,7), 0.25);
+      Vector3f motion(15,1,-2);
+      SweptHitList hits;
+      int numHits = tree.sweepSphere(bullet, motion, hits);
+      equalityIntCheck(numHits, hits.size());
+
+      AABBf bulletBox(bullet.center - Vector3f(0.25,0.25,0.25), bullet.center + Vector3f(0.25,0.25,0.25));
+      int expected = 0, mismatches = 0, unsorted = 0, seenAtEnds = 0;
+      std::vector<bool> found(boxes.size(), false);
+      for (int i = 0; i < numHits; i++) {
+         int index = (AABBf *) hits[i].object - &boxes[0];
+         found[index] = true;
+         unsorted += i > 0 && hits[i].tEnter < hits[i - 1].tEnter;
+         mismatches += !SweepIntersect(bulletBox, motion, boxes[index], tEnter, tExit) ||
+                       tEnter != hits[i].tEnter || tExit != hits[i].tExit;
+      }
+      for (size_t i = 0; i < boxes.size(); i++) {
+         if (SweepIntersect(bulletBox, motion, boxes[i], tEnter, tExit)) {
+            expected++;
+            mismatches += !found[i];
+         }
+         AABBf endBox(bulletBox.lowBound + motion, bulletBox.highBound + motion);
+         seenAtEnds += boxBoxTest(&bulletBox, &boxes[i]) || boxBoxTest(&endBox, &boxes[i]);
+      }
+      equalityIntCheck(numHits, expected);
+      equalityIntCheck(mismatches, 0);
+      equalityIntCheck(unsorted, 0);
+      boolCheck(numHits > seenAtEnds, true);   // Testing only the ends would have tunneled
+   }
+
    return 0;
 }
\ No newline at end of file